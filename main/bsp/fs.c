@@ -1,13 +1,23 @@
 #include "fs.h"
 #include "esp_littlefs.h"
+#include "esp_rom_crc.h"
 #include "log.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
+// Host builds keep their files somewhere else
+#ifndef FS_BASE_PATH
 #define FS_BASE_PATH       "/fs"
+#endif
 #define FS_PARTITION_LABEL "storage"
 
+// Helpers
+static void fs_writer_flush(fs_writer_t *writer);
+
 status_t fs_init(void)
 {
     esp_vfs_littlefs_conf_t conf = {
@@ -112,6 +122,108 @@ status_t fs_close(file_t file)
     return rc == 0 ? STATUS_OK : -STATUS_NOFILE;
 }
 
+status_t fs_writer_open(fs_writer_t *writer, const char *name, const char *type)
+{
+    memset(writer, 0, sizeof(fs_writer_t));
+    writer->buf = malloc(FS_BLOCK_SIZE);
+    if (writer->buf == NULL)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    writer->file = fs_open(name, type);
+    if (writer->file == NULL)
+    {
+        free(writer->buf);
+        writer->buf = NULL;
+        return -STATUS_NOFILE;
+    }
+
+    // Whole blocks are handed over, stdio buffering would only copy them
+    // again
+    setvbuf((FILE *) writer->file, NULL, _IONBF, 0);
+    return STATUS_OK;
+}
+
+void fs_writer_write(fs_writer_t *writer, const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+    while (len > 0 && writer->status == STATUS_OK)
+    {
+        size_t chunk = FS_BLOCK_SIZE - writer->len;
+        if (chunk > len) { chunk = len; }
+        memcpy(&writer->buf[writer->len], bytes, chunk);
+        writer->len += chunk;
+        bytes += chunk;
+        len -= chunk;
+
+        if (writer->len == FS_BLOCK_SIZE)
+        {
+            fs_writer_flush(writer);
+        }
+    }
+}
+
+status_t fs_writer_sync(fs_writer_t *writer)
+{
+    fs_writer_flush(writer);
+    if (writer->status == STATUS_OK &&
+        (fflush((FILE *) writer->file) != 0 || fsync(fileno((FILE *) writer->file)) != 0))
+    {
+        writer->status = -STATUS_IO;
+    }
+    return writer->status;
+}
+
+status_t fs_writer_close(fs_writer_t *writer, uint32_t *crc)
+{
+    status_t status = fs_writer_sync(writer);
+    status_t close_status = fs_close(writer->file);
+    if (status == STATUS_OK) { status = close_status; }
+    if (crc != NULL) { *crc = writer->crc; }
+
+    free(writer->buf);
+    writer->buf = NULL;
+    writer->file = NULL;
+    return status;
+}
+
+void fs_writer_abort(fs_writer_t *writer)
+{
+    fs_close(writer->file);
+    free(writer->buf);
+    writer->buf = NULL;
+    writer->file = NULL;
+}
+
+status_t fs_crc(const char *name, uint32_t *crc)
+{
+    uint8_t *buf = malloc(FS_BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    FILE *file = (FILE *) fs_open(name, "r");
+    if (file == NULL)
+    {
+        free(buf);
+        return -STATUS_NOFILE;
+    }
+
+    *crc = 0;
+    size_t len;
+    while ((len = fread(buf, 1, FS_BLOCK_SIZE, file)) > 0)
+    {
+        *crc = esp_rom_crc32_le(*crc, buf, len);
+    }
+    status_t status = ferror(file) ? -STATUS_IO : STATUS_OK;
+
+    fclose(file);
+    free(buf);
+    return status;
+}
+
 status_t fs_rm(const char *name)
 {
     char path[64];
@@ -132,4 +244,23 @@ bool fs_exists(const char *name)
     char path[64];
     sprintf(path, "%s/%s", FS_BASE_PATH, name);
     return stat(path, &st) == 0;
-}
\ No newline at end of file
+}
+
+// Private
+
+static void fs_writer_flush(fs_writer_t *writer)
+{
+    if (writer->len == 0 || writer->status != STATUS_OK)
+    {
+        return;
+    }
+
+    if (fwrite(writer->buf, 1, writer->len, (FILE *) writer->file) != writer->len)
+    {
+        writer->status = -STATUS_IO;
+        return;
+    }
+    writer->crc = esp_rom_crc32_le(writer->crc, writer->buf, writer->len);
+    writer->written += writer->len;
+    writer->len = 0;
+}
@@ -2,11 +2,30 @@
 #define STORAGE_H_
 
 #include "status.h"
+#include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 
+// Bytes a buffered writer hands to the file system at once: one LittleFS
+// block
+#define FS_BLOCK_SIZE 4096U
+
 typedef void *file_t;
 
+// Buffered writer, for files written in many small pieces. Output is gathered
+// in a block-sized buffer and written a whole block at a time, instead of one
+// stdio call per piece. Errors are kept rather than returned: the first one
+// comes back from fs_writer_close(), so callers check once at the end. A CRC32
+// (zlib) of everything written is kept along the way.
+typedef struct {
+    file_t file;
+    uint8_t *buf;           // FS_BLOCK_SIZE bytes, reused for every block
+    size_t len;             // Bytes waiting in buf
+    size_t written;         // Bytes handed to the file system
+    uint32_t crc;           // Of the bytes handed to the file system
+    status_t status;        // First error
+} fs_writer_t;
+
 status_t fs_init(void);
 
 file_t fs_open(const char *name, const char *type);
@@ -23,6 +42,63 @@ void fs_rewind(file_t file);
 
 status_t fs_close(file_t file);
 
+/**
+ * @brief Open a file for buffered writing
+ * @param writer writer to set up
+ * @param name file name
+ * @param type "w" or "a", as for fs_open()
+ * @return -STATUS_NOMEM: couldn't allocate the buffer
+ *         -STATUS_NOFILE: couldn't open the file
+ *          STATUS_OK: successful
+ */
+status_t fs_writer_open(fs_writer_t *writer, const char *name, const char *type);
+
+/**
+ * @brief Write to a file through its buffer. Nothing is written after an
+ * error.
+ * @param writer open writer
+ * @param data bytes to write
+ * @param len number of bytes
+ */
+void fs_writer_write(fs_writer_t *writer, const void *data, size_t len);
+
+/**
+ * @brief Write out the buffer and make sure the file is on flash
+ * @param writer open writer
+ * @return -STATUS_IO: this or an earlier write failed
+ *          STATUS_OK: successful
+ */
+status_t fs_writer_sync(fs_writer_t *writer);
+
+/**
+ * @brief Sync and close a file opened with fs_writer_open()
+ * @param writer open writer, closed even on error
+ * @param crc filled in with the CRC32 of the whole file as written. May be
+ * NULL.
+ * @return -STATUS_IO: a write or the sync failed
+ *         -STATUS_NOFILE: couldn't close the file
+ *          STATUS_OK: successful
+ */
+status_t fs_writer_close(fs_writer_t *writer, uint32_t *crc);
+
+/**
+ * @brief Close a file opened with fs_writer_open() without writing out the
+ * buffer
+ * @param writer open writer
+ */
+void fs_writer_abort(fs_writer_t *writer);
+
+/**
+ * @brief CRC32 (zlib) of a file's contents, read a block at a time
+ * @param name file name
+ * @param crc filled in with the CRC
+ * @return -STATUS_NOMEM: couldn't allocate the read buffer
+ *         -STATUS_NOFILE: couldn't open the file
+ *         -STATUS_IO: read error
+ *          STATUS_OK: successful
+ */
+status_t fs_crc(const char *name, uint32_t *crc);
+
 status_t fs_rm(const char *name);
 
 bool fs_exists(const char *name);
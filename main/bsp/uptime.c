@@ -2,7 +2,20 @@
 
 #include "esp_timer.h"
 
+#include <time.h>
+
+// The clock starts at 1970 after a reset, anything before this hasn't been
+// set yet (2024-01-01)
+#define WALLCLOCK_MIN 1704067200
+
 int64_t uptime(void)
 {
     return esp_timer_get_time() / 1000;
-}
\ No newline at end of file
+}
+
+bool wallclock(uint32_t *now)
+{
+    time_t t = time(NULL);
+    *now = (uint32_t) t;
+    return t >= WALLCLOCK_MIN;
+}
@@ -2,8 +2,17 @@
 #define UPTIME_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // in ms
 int64_t uptime(void);
 
+/**
+ * @brief Wall clock time. It's only known once it has been set over the
+ * network, after every reset.
+ * @param now seconds since the Unix epoch
+ * @return true if the clock is set, false otherwise
+ */
+bool wallclock(uint32_t *now);
+
 #endif /*UPTIME_H_*/
\ No newline at end of file
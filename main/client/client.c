@@ -24,7 +24,8 @@
 // Event handlers
 static void client_ping_timer_cb(TimerHandle_t xTimer);
 static void client_reconnect_timer_cb(TimerHandle_t xTimer);
-static void ws_evt_cb(ws_evt_t evt, cJSON *data, void *ctx);
+static void ws_evt_cb(ws_evt_t evt, const char *data, size_t len, void *ctx);
+static void msg_stream_cb(msg_t *msg, void *ctx);
 static void net_evt_cb(net_evt_t evt, void *ctx);
 status_t client_msg_handler(msg_t *msg);
 
@@ -38,6 +39,7 @@ typedef struct {
     TimerHandle_t reconnect_timer;
     client_cmd_handler_t handlers[CLIENT_CMD_HANDLER_MAX];
     TaskHandle_t reset_task_handle;
+    msg_stream_t stream;
 } client_ctx_t;
 
 static client_ctx_t _ctx;
@@ -59,12 +61,10 @@ status_t client_init(const config_client_t *config, device_type_t device_type)
         return -STATUS_BAD_CONFIG;
     }
 
-    for (int i=0; i<CLIENT_CMD_HANDLER_MAX; i++)
-    {
-        _ctx.handlers[i] = NULL;
-    }
-
+    // Handlers registered before init are kept: the card list and device
+    // come up first
     client_handler_register(client_msg_handler);
+    msg_stream_init(&_ctx.stream, msg_stream_cb, (void *)&_ctx);
 
     // Create ping timer - sends periodic pings to host
     _ctx.ping_timer = xTimerCreate(
@@ -136,6 +136,16 @@ status_t client_send_msg(msg_t *msg)
     return status;
 }
 
+status_t client_send_msg_timeout(msg_t *msg, uint32_t timeout_ms)
+{
+    status_t status;
+    cJSON *root = cJSON_CreateObject();
+    msg_to_cJSON(msg, root);
+    status = ws_send_timeout(root, pdMS_TO_TICKS(timeout_ms));
+    cJSON_Delete(root);
+    return status;
+}
+
 static void client_ping_timer_cb(TimerHandle_t xTimer)
 {
     msg_t msg = {
@@ -170,7 +180,7 @@ static void net_evt_cb(net_evt_t evt, void *ctx)
     }
 }
 
-void ws_evt_cb(ws_evt_t evt, cJSON *data, void *ctx)
+void ws_evt_cb(ws_evt_t evt, const char *data, size_t len, void *ctx)
 {
     client_ctx_t *client_ctx = (client_ctx_t *)ctx;
     switch (evt)
@@ -197,6 +207,7 @@ void ws_evt_cb(ws_evt_t evt, cJSON *data, void *ctx)
             // Start the reconnection timer to makle sure the websocket 
             // reconnects after a while. If not, then we need to manually reconnect.
             ERROR("Client lost websocket connection");
+            msg_stream_reset(&_ctx.stream);
             if (xTimerIsTimerActive(_ctx.reconnect_timer) == pdFALSE)
             {
                 INFO("Starting reconnection timer");
@@ -204,24 +215,29 @@ void ws_evt_cb(ws_evt_t evt, cJSON *data, void *ctx)
             }
             break;
 
-        case WS_MSG:
-        {
-            // Parse in-bound message
-            msg_t msg;
-            msg_from_cJSON(data, &msg);
+        case WS_MSG_BEGIN:
+            msg_stream_reset(&_ctx.stream);
+            break;
+
+        case WS_MSG_DATA:
+            // Parse in-bound message. Messages are passed to msg_stream_cb()
+            // as they're parsed.
+            msg_stream_feed(&_ctx.stream, data, len);
+            break;
+    }
+}
 
-            // Send message to handlers
-            for (int i=0; i<CLIENT_CMD_HANDLER_MAX; i++)
+static void msg_stream_cb(msg_t *msg, void *ctx)
+{
+    // Send message to handlers
+    for (int i=0; i<CLIENT_CMD_HANDLER_MAX; i++)
+    {
+        if (_ctx.handlers[i] != NULL)
+        {
+            if (_ctx.handlers[i](msg) == STATUS_OK)
             {
-                if (_ctx.handlers[i] != NULL)
-                {
-                    if (_ctx.handlers[i](&msg) == STATUS_OK)
-                    {
-                        break;
-                    }
-                }
+                break;
             }
-            break;
         }
     }
 }
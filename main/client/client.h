@@ -16,4 +16,14 @@ status_t client_handler_register(client_cmd_handler_t handler);
 
 status_t client_send_msg(msg_t *msg);
 
+/**
+ * @brief Send a message, or drop it if the connection doesn't take it in time
+ * @param msg message to send
+ * @param timeout_ms longest wait for the connection
+ * @return -STATUS_NO_RESOURCE: not connected
+ *         -STATUS_IO: not sent in time
+ *          STATUS_OK: successful
+ */
+status_t client_send_msg_timeout(msg_t *msg, uint32_t timeout_ms);
+
 #endif /*CLIENT_H_*/
\ No newline at end of file
@@ -0,0 +1,368 @@
+#include "json_stream.h"
+
+#include <string.h>
+
+typedef enum {
+    JS_START,       // Before the opening brace
+    JS_KEY_OR_END,  // Before a key, or the closing brace
+    JS_KEY,         // Inside a key
+    JS_COLON,       // After a key
+    JS_VALUE,       // Before a value
+    JS_STRING,      // Inside a string value
+    JS_LITERAL,     // Inside a number, true, false or null
+    JS_NEXT,        // After a value
+    JS_SKIP,        // Inside a nested container
+    JS_DONE,        // After the closing brace
+    JS_ERROR,
+} json_state_t;
+
+// Helpers
+static status_t json_stream_char(json_stream_t *stream, char c);
+static void json_stream_emit(json_stream_t *stream, json_evt_t evt, json_type_t type);
+static json_type_t json_literal_type(const char *literal);
+static bool json_is_space(char c);
+static status_t json_stream_hex(json_stream_t *stream, char c);
+static status_t json_stream_code(json_stream_t *stream, uint32_t code);
+static status_t json_stream_utf8(json_stream_t *stream, uint32_t code);
+static status_t json_stream_put(json_stream_t *stream, char c);
+
+void json_stream_init(json_stream_t *stream, json_stream_cb_t cb, void *ctx)
+{
+    stream->cb = cb;
+    stream->ctx = ctx;
+    json_stream_reset(stream);
+}
+
+void json_stream_reset(json_stream_t *stream)
+{
+    stream->state = JS_START;
+    stream->in_array = false;
+    stream->escape = false;
+    stream->skip_string = false;
+    stream->unicode = 0;
+    stream->surrogate = 0;
+    stream->depth = 0;
+    stream->key_len = 0;
+    stream->value_len = 0;
+    stream->key[0] = '\0';
+}
+
+status_t json_stream_feed(json_stream_t *stream, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (json_stream_char(stream, data[i]) != STATUS_OK)
+        {
+            stream->state = JS_ERROR;
+            return -STATUS_PARSE;
+        }
+    }
+    return stream->state == JS_ERROR ? -STATUS_PARSE : STATUS_OK;
+}
+
+bool json_stream_done(const json_stream_t *stream)
+{
+    return stream->state == JS_DONE;
+}
+
+// Private
+
+static status_t json_stream_char(json_stream_t *stream, char c)
+{
+    switch (stream->state)
+    {
+        case JS_START:
+            if (json_is_space(c)) { return STATUS_OK; }
+            if (c != '{') { return -STATUS_PARSE; }
+            stream->state = JS_KEY_OR_END;
+            return STATUS_OK;
+
+        case JS_KEY_OR_END:
+            if (json_is_space(c)) { return STATUS_OK; }
+            if (c == '}')
+            {
+                stream->state = JS_DONE;
+                json_stream_emit(stream, JSON_EVT_END, JSON_NULL);
+                return STATUS_OK;
+            }
+            if (c != '"') { return -STATUS_PARSE; }
+            stream->key_len = 0;
+            stream->state = JS_KEY;
+            return STATUS_OK;
+
+        case JS_KEY:
+            if (!stream->escape && c == '"')
+            {
+                stream->key[stream->key_len] = '\0';
+                stream->state = JS_COLON;
+                return STATUS_OK;
+            }
+            stream->escape = !stream->escape && c == '\\';
+            if (stream->escape) { return STATUS_OK; }
+            if (stream->key_len == JSON_STREAM_KEY_MAX) { return -STATUS_PARSE; }
+            stream->key[stream->key_len++] = c;
+            return STATUS_OK;
+
+        case JS_COLON:
+            if (json_is_space(c)) { return STATUS_OK; }
+            if (c != ':') { return -STATUS_PARSE; }
+            stream->state = JS_VALUE;
+            return STATUS_OK;
+
+        case JS_VALUE:
+            if (json_is_space(c)) { return STATUS_OK; }
+            stream->value_len = 0;
+            if (c == '"')
+            {
+                stream->state = JS_STRING;
+            }
+            else if (c == '[' && !stream->in_array)
+            {
+                stream->in_array = true;
+                json_stream_emit(stream, JSON_EVT_ARRAY_BEGIN, JSON_NULL);
+            }
+            else if (c == ']' && stream->in_array)
+            {
+                // Empty array. A trailing comma is tolerated too.
+                stream->state = JS_NEXT;
+                return json_stream_char(stream, c);
+            }
+            else if (c == '{' || c == '[')
+            {
+                stream->depth = 1;
+                stream->state = JS_SKIP;
+            }
+            else
+            {
+                stream->state = JS_LITERAL;
+                return json_stream_char(stream, c);
+            }
+            return STATUS_OK;
+
+        case JS_STRING:
+            if (stream->unicode > 0)
+            {
+                return json_stream_hex(stream, c);
+            }
+            if (stream->escape)
+            {
+                // \uXXXX escapes are decoded to UTF-8, surrogate pairs to
+                // the character they make up
+                stream->escape = false;
+                if (c == 'u')
+                {
+                    stream->unicode = 4;
+                    stream->code = 0;
+                    return STATUS_OK;
+                }
+                if (c == 'n') { c = '\n'; }
+                else if (c == 't') { c = '\t'; }
+                else if (c == 'r') { c = '\r'; }
+                else if (c == 'b') { c = '\b'; }
+                else if (c == 'f') { c = '\f'; }
+            }
+            else if (c == '\\')
+            {
+                stream->escape = true;
+                return STATUS_OK;
+            }
+            else if (c == '"')
+            {
+                if (json_stream_code(stream, 0) != STATUS_OK) { return -STATUS_PARSE; }
+                stream->value[stream->value_len] = '\0';
+                json_stream_emit(stream, stream->in_array ? JSON_EVT_ITEM : JSON_EVT_VALUE, JSON_STRING);
+                stream->state = JS_NEXT;
+                return STATUS_OK;
+            }
+            return json_stream_put(stream, c);
+
+        case JS_LITERAL:
+            if (c == ',' || c == '}' || c == ']' || json_is_space(c))
+            {
+                stream->value[stream->value_len] = '\0';
+                json_type_t type = json_literal_type(stream->value);
+                if (type == JSON_NUMBER && !(stream->value[0] == '-' || (stream->value[0] >= '0' && stream->value[0] <= '9')))
+                {
+                    return -STATUS_PARSE;
+                }
+                json_stream_emit(stream, stream->in_array ? JSON_EVT_ITEM : JSON_EVT_VALUE, type);
+                stream->state = JS_NEXT;
+                return json_stream_char(stream, c);
+            }
+            if (stream->value_len == JSON_STREAM_VALUE_MAX) { return -STATUS_PARSE; }
+            stream->value[stream->value_len++] = c;
+            return STATUS_OK;
+
+        case JS_NEXT:
+            if (json_is_space(c)) { return STATUS_OK; }
+            if (c == ',')
+            {
+                stream->state = stream->in_array ? JS_VALUE : JS_KEY_OR_END;
+            }
+            else if (c == ']' && stream->in_array)
+            {
+                stream->in_array = false;
+                json_stream_emit(stream, JSON_EVT_ARRAY_END, JSON_NULL);
+            }
+            else if (c == '}' && !stream->in_array)
+            {
+                stream->state = JS_DONE;
+                json_stream_emit(stream, JSON_EVT_END, JSON_NULL);
+            }
+            else
+            {
+                return -STATUS_PARSE;
+            }
+            return STATUS_OK;
+
+        case JS_SKIP:
+            // Only brackets outside of strings count
+            if (stream->skip_string)
+            {
+                if (stream->escape) { stream->escape = false; }
+                else if (c == '\\') { stream->escape = true; }
+                else if (c == '"') { stream->skip_string = false; }
+            }
+            else if (c == '"') { stream->skip_string = true; }
+            else if (c == '{' || c == '[') { stream->depth++; }
+            else if (c == '}' || c == ']')
+            {
+                if (--stream->depth == 0) { stream->state = JS_NEXT; }
+            }
+            return STATUS_OK;
+
+        case JS_DONE:
+            return json_is_space(c) ? STATUS_OK : -STATUS_PARSE;
+
+        case JS_ERROR:
+        default:
+            return -STATUS_PARSE;
+    }
+}
+
+static status_t json_stream_hex(json_stream_t *stream, char c)
+{
+    uint32_t digit;
+    if (c >= '0' && c <= '9') { digit = c - '0'; }
+    else if (c >= 'a' && c <= 'f') { digit = c - 'a' + 10; }
+    else if (c >= 'A' && c <= 'F') { digit = c - 'A' + 10; }
+    else { return -STATUS_PARSE; }
+
+    stream->code = (stream->code << 4) | digit;
+    if (--stream->unicode > 0)
+    {
+        return STATUS_OK;
+    }
+
+    // A NUL would end the value early
+    if (stream->code == 0)
+    {
+        return -STATUS_PARSE;
+    }
+    return json_stream_code(stream, stream->code);
+}
+
+// Add a decoded \u escape to the value. A high surrogate is held until the
+// next character, which makes a pair with it if it's a low surrogate. One
+// without its pair is kept on its own, as Python keeps it. 0 only writes out
+// a held surrogate.
+static status_t json_stream_code(json_stream_t *stream, uint32_t code)
+{
+    if (stream->surrogate != 0)
+    {
+        uint32_t high = stream->surrogate;
+        stream->surrogate = 0;
+        if (code >= 0xDC00 && code <= 0xDFFF)
+        {
+            code = 0x10000 + ((high - 0xD800) << 10) + (code - 0xDC00);
+        }
+        else if (json_stream_utf8(stream, high) != STATUS_OK)
+        {
+            return -STATUS_PARSE;
+        }
+    }
+    if (code == 0)
+    {
+        return STATUS_OK;
+    }
+    if (code >= 0xD800 && code <= 0xDBFF)
+    {
+        stream->surrogate = code;
+        return STATUS_OK;
+    }
+    return json_stream_utf8(stream, code);
+}
+
+static status_t json_stream_utf8(json_stream_t *stream, uint32_t code)
+{
+    char utf8[4];
+    size_t len;
+    if (code < 0x80)
+    {
+        utf8[0] = (char) code;
+        len = 1;
+    }
+    else if (code < 0x800)
+    {
+        utf8[0] = (char) (0xC0 | (code >> 6));
+        utf8[1] = (char) (0x80 | (code & 0x3F));
+        len = 2;
+    }
+    else if (code < 0x10000)
+    {
+        utf8[0] = (char) (0xE0 | (code >> 12));
+        utf8[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+        utf8[2] = (char) (0x80 | (code & 0x3F));
+        len = 3;
+    }
+    else
+    {
+        utf8[0] = (char) (0xF0 | (code >> 18));
+        utf8[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+        utf8[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+        utf8[3] = (char) (0x80 | (code & 0x3F));
+        len = 4;
+    }
+    if (stream->value_len + len > JSON_STREAM_VALUE_MAX)
+    {
+        return -STATUS_PARSE;
+    }
+    memcpy(&stream->value[stream->value_len], utf8, len);
+    stream->value_len += len;
+    return STATUS_OK;
+}
+
+static status_t json_stream_put(json_stream_t *stream, char c)
+{
+    // A held surrogate goes before whatever follows it
+    if (json_stream_code(stream, 0) != STATUS_OK || stream->value_len == JSON_STREAM_VALUE_MAX)
+    {
+        return -STATUS_PARSE;
+    }
+    stream->value[stream->value_len++] = c;
+    return STATUS_OK;
+}
+
+static void json_stream_emit(json_stream_t *stream, json_evt_t evt, json_type_t type)
+{
+    json_token_t token = {
+        .evt = evt,
+        .key = stream->key,
+        .type = type,
+        .value = stream->value,
+    };
+    stream->cb(&token, stream->ctx);
+}
+
+static json_type_t json_literal_type(const char *literal)
+{
+    if (strcmp(literal, "true") == 0)   { return JSON_TRUE; }
+    if (strcmp(literal, "false") == 0)  { return JSON_FALSE; }
+    if (strcmp(literal, "null") == 0)   { return JSON_NULL; }
+    return JSON_NUMBER;
+}
+
+static bool json_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
@@ -0,0 +1,96 @@
+#ifndef JSON_STREAM_H_
+#define JSON_STREAM_H_
+
+#include "status.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Incremental tokenizer for the flat JSON objects sent by the server. Bytes
+// are fed in as they arrive, in chunks of any size, and each value is
+// reported through a callback as soon as it is complete. Nothing is kept
+// once a value has been reported, so memory use doesn't depend on the size
+// of the message.
+//
+// Only the top level object is tokenized: its scalar members, and the scalar
+// elements of its array members. Deeper objects and arrays are skipped.
+
+// Longest key and scalar value that are reported. Longer ones are an error.
+#define JSON_STREAM_KEY_MAX     32U
+#define JSON_STREAM_VALUE_MAX   128U
+
+typedef enum {
+    JSON_EVT_VALUE,         // Scalar member of the object
+    JSON_EVT_ARRAY_BEGIN,   // Array member starts
+    JSON_EVT_ITEM,          // Scalar element of an array member
+    JSON_EVT_ARRAY_END,     // Array member ends
+    JSON_EVT_END,           // The object is complete
+} json_evt_t;
+
+typedef enum {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+} json_type_t;
+
+typedef struct {
+    json_evt_t evt;
+    const char *key;        // Member the event belongs to
+    json_type_t type;       // JSON_EVT_VALUE, JSON_EVT_ITEM only
+    const char *value;      // JSON_EVT_VALUE, JSON_EVT_ITEM only. Strings are unescaped.
+} json_token_t;
+
+typedef void (*json_stream_cb_t)(const json_token_t *token, void *ctx);
+
+typedef struct {
+    json_stream_cb_t cb;
+    void *ctx;
+    uint8_t state;
+    bool in_array;          // Inside an array member
+    bool escape;            // Last string character was a backslash
+    bool skip_string;       // Inside a string of a skipped container
+    uint8_t unicode;        // Hex digits of a \u escape still to come
+    uint32_t code;          // Code point of the \u escape
+    uint32_t surrogate;     // High surrogate waiting for the low one, or 0
+    uint32_t depth;         // Nesting of the skipped container
+    size_t key_len;
+    size_t value_len;
+    char key[JSON_STREAM_KEY_MAX + 1];
+    char value[JSON_STREAM_VALUE_MAX + 1];
+} json_stream_t;
+
+/**
+ * @brief Initialize a tokenizer
+ * @param stream tokenizer
+ * @param cb called for every token
+ * @param ctx passed to cb
+ */
+void json_stream_init(json_stream_t *stream, json_stream_cb_t cb, void *ctx);
+
+/**
+ * @brief Get ready for a new object, dropping anything partially parsed
+ * @param stream tokenizer
+ */
+void json_stream_reset(json_stream_t *stream);
+
+/**
+ * @brief Tokenize the next bytes of the object
+ * @param stream tokenizer
+ * @param data next bytes
+ * @param len number of bytes in data
+ * @return -STATUS_PARSE: the object is malformed. Further bytes are ignored
+ *                        until json_stream_reset().
+ *          STATUS_OK: successful
+ */
+status_t json_stream_feed(json_stream_t *stream, const char *data, size_t len);
+
+/**
+ * @brief Check if the whole object has been tokenized
+ * @param stream tokenizer
+ * @return true if JSON_EVT_END was reported, false otherwise
+ */
+bool json_stream_done(const json_stream_t *stream);
+
+#endif /*JSON_STREAM_H_*/
@@ -1,7 +1,9 @@
 #include "msg.h"
 #include "log.h"
+#include "esp_rom_crc.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -14,6 +16,15 @@
 #define MSG_UPDATE_LOCKOUT_STR      "update_device_locked_out"
 #define MSG_BUMP_STR                "bump"
 #define MSG_SYNC_STR                "sync"
+#define MSG_SYNC_ADD_STR            "sync_add"
+#define MSG_SYNC_REMOVE_STR         "sync_remove"
+#define MSG_SYNC_PAGE_STR           "sync_page"
+#define MSG_SYNC_ACK_STR            "sync_ack"
+#define MSG_SYNC_RESUME_STR         "sync_resume"
+#define MSG_SYNC_ERROR_STR          "sync_error"
+#define MSG_TAG_DIGEST_STR          "tag_digest"
+#define MSG_TAG_BUCKET_STR          "tag_bucket"
+#define MSG_POLICY_STR              "policy"
 #define MSG_UNLOCK_STR              "unlock"
 #define MSG_LOCK_STR                "lock"
 #define MSG_ILOCK_SESS_START_STR    "interlock_session_start"
@@ -26,10 +37,33 @@
 #define MSG_ACCESS_LOCKED_OUT_STR   "log_access_locked_out"
 #define MSG_ACCESS_GRANTED_STR      "log_access"
 
+// Array member of a sync message holding the cards
+#define MSG_SYNC_TAGS_KEY           "tags"
+
+// Longest array gathered with the scalar fields. Only the cards of a sync
+// are streamed, other arrays are short.
+#define MSG_ARRAY_MAX               256U
+
 // Helpers
 msg_type_t str_to_msgtype(char *msg_type_str);
 char *msgtype_to_str(msg_type_t msg);
 status_t hexstr_to_bytes(char *str, size_t bytes, uint8_t *buf);
+void bytes_to_hexstr(const uint8_t *buf, size_t bytes, char *str);
+static void msg_sync_hashes(cJSON *json, sync_payload_t *sync);
+static void msg_stream_token(const json_token_t *token, void *ctx);
+static cJSON *msg_token_item(const json_token_t *token);
+static void msg_add_card(cJSON *json, const char *name, uint64_t card);
+static void msg_stream_flush(msg_stream_t *stream);
+static void msg_stream_sync(msg_stream_t *stream, sync_stage_t stage);
+static void msg_stream_hash(msg_stream_t *stream, const char *str);
+static void msg_stream_hash_item(msg_stream_t *stream, const json_token_t *token);
+static void msg_stream_hash_repr(msg_stream_t *stream, const char *str);
+static bool msg_repr_printable(uint32_t code);
+static void msg_stream_crc(msg_stream_t *stream, const char *str);
+static void msg_stream_page_begin(msg_stream_t *stream);
+static void msg_stream_page_item(msg_stream_t *stream, const json_token_t *token);
+static void msg_stream_page_end(msg_stream_t *stream, msg_t *msg);
+static void msg_sync_page(cJSON *json, sync_payload_t *sync);
 
 status_t msg_to_cJSON(msg_t *msg, cJSON *json)
 {
@@ -65,23 +99,80 @@ status_t msg_to_cJSON(msg_t *msg, cJSON *json)
             status = -STATUS_UNIMPL;
             break;
 
+        case MSG_TAG_DIGEST: {
+            char hex_str[33];
+            bytes_to_hexstr(msg->tag_digest.hash, 16, hex_str);
+            cJSON_AddStringToObject(json, "hash", hex_str);
+            cJSON_AddNumberToObject(json, "count", msg->tag_digest.count);
+            sprintf(hex_str, "%08lx", msg->tag_digest.root);
+            cJSON_AddStringToObject(json, "root", hex_str);
+            if (msg->tag_digest.group >= 0)
+            {
+                cJSON_AddNumberToObject(json, "group", msg->tag_digest.group);
+            }
+
+            cJSON *digests = cJSON_AddArrayToObject(json, "digests");
+            for (int i = 0; i < 16; i++)
+            {
+                sprintf(hex_str, "%08lx", msg->tag_digest.digests[i]);
+                cJSON_AddItemToArray(digests, cJSON_CreateString(hex_str));
+            }
+            status = STATUS_OK;
+            break;
+        }
+
+        case MSG_TAG_BUCKET: {
+            char card_str[24];
+            cJSON_AddNumberToObject(json, "bucket", msg->tag_bucket.bucket);
+            if (msg->tag_bucket.status != STATUS_OK)
+            {
+                cJSON_AddNumberToObject(json, "status", msg->tag_bucket.status);
+                status = STATUS_OK;
+                break;
+            }
+            cJSON *tags = cJSON_AddArrayToObject(json, "tags");
+            for (size_t i = 0; i < msg->tag_bucket.num_tags; i++)
+            {
+                sprintf(card_str, "%llu", (unsigned long long) msg->tag_bucket.tags[i]);
+                cJSON_AddItemToArray(tags, cJSON_CreateString(card_str));
+            }
+            status = STATUS_OK;
+            break;
+        }
+
+        case MSG_SYNC_ACK:
+        case MSG_SYNC_RESUME:
+            cJSON_AddNumberToObject(json, "sync_id", msg->sync_page.sync_id);
+            cJSON_AddNumberToObject(json, "page", msg->sync_page.page);
+            status = STATUS_OK;
+            break;
+
+        case MSG_SYNC_ERROR:
+            cJSON_AddNumberToObject(json, "sync_id", msg->sync_error.sync_id);
+            cJSON_AddNumberToObject(json, "status", msg->sync_error.status);
+            cJSON_AddStringToObject(json, "reason", msg->sync_error.reason);
+            status = STATUS_OK;
+            break;
+
         case MSG_ACCESS_DENIED:
-            cJSON_AddNumberToObject(json, "card_id", msg->access_denied.card_id);
+            msg_add_card(json, "card_id", msg->access_denied.card_id);
             status = STATUS_OK;
             break;
 
         case MSG_ACCESS_LOCKED_OUT:
-            cJSON_AddNumberToObject(json, "card_id", msg->access_lockout.card_id);
+            msg_add_card(json, "card_id", msg->access_lockout.card_id);
             status = STATUS_OK;
             break;
 
         case MSG_ACCESS_GRANTED:
-            cJSON_AddNumberToObject(json, "card_id", msg->access_granted.card_id);
+            msg_add_card(json, "card_id", msg->access_granted.card_id);
             status = STATUS_OK;
             break;
 
-        // These have no payloads
+        // These have no payloads. A sync sent to the server asks it for
+        // the full card list.
         case MSG_PING:
+        case MSG_SYNC:
             status = STATUS_OK;
             break;
         
@@ -89,7 +180,10 @@ status_t msg_to_cJSON(msg_t *msg, cJSON *json)
         // for completeness of implementation, but are the lowest priority
         case MSG_AUTHORISED:
         case MSG_UPDATE_LOCKOUT:
-        case MSG_SYNC:
+        case MSG_SYNC_ADD:
+        case MSG_SYNC_REMOVE:
+        case MSG_SYNC_PAGE:
+        case MSG_POLICY:
         case MSG_REBOOT:
         case MSG_BUMP:
         case MSG_UNLOCK:
@@ -139,16 +233,51 @@ status_t msg_from_cJSON(cJSON *json, msg_t *msg)
             break;
         }
 
-        case MSG_SYNC: {
-            // TODO: how to not copy kB's of data
-            cJSON *payload_val = cJSON_GetObjectItem(json, "hash");
+        case MSG_SYNC:
+        case MSG_SYNC_ADD:
+        case MSG_SYNC_REMOVE:
+        case MSG_SYNC_PAGE:
+            // The cards were already handed out by the message stream, this
+            // is the end of the message
+            msg->sync.stage = SYNC_END;
+            msg->sync.tags = NULL;
+            msg->sync.attrs = NULL;
+            msg->sync.num_tags = 0;
+            msg->sync.has_digest = false;
+            msg->sync.page_ok = false;
+            msg_sync_hashes(json, &msg->sync);
+            msg_sync_page(json, &msg->sync);
+            status = STATUS_OK;
+            break;
+
+        case MSG_TAG_DIGEST: {
+            cJSON *payload_val = cJSON_GetObjectItem(json, "group");
+            msg->tag_digest.group = payload_val ? payload_val->valueint : -1;
+            status = STATUS_OK;
+            break;
+        }
+
+        case MSG_TAG_BUCKET: {
+            cJSON *payload_val = cJSON_GetObjectItem(json, "bucket");
             if (payload_val)
             {
-                // TODO: convert string to hex bytes
-                hexstr_to_bytes(payload_val->valuestring, 16, msg->sync.hash);
+                msg->tag_bucket.bucket = (uint32_t) payload_val->valueint;
+                status = STATUS_OK;
             }
-            payload_val = cJSON_GetObjectItem(json, "tags");
-            msg->sync.tags = payload_val; // To be parsed by the handler
+            break;
+        }
+
+        case MSG_POLICY: {
+            cJSON *payload_val = cJSON_GetObjectItem(json, "utc_offset");
+            msg->policy.utc_offset = payload_val ? payload_val->valueint : 0;
+            payload_val = cJSON_GetObjectItem(json, "tz");
+            msg->policy.tz = cJSON_IsString(payload_val) ? payload_val->valuestring : NULL;
+            payload_val = cJSON_GetObjectItem(json, "holiday_groups");
+            msg->policy.holiday_groups = payload_val ? (uint16_t) payload_val->valueint : 0;
+            payload_val = cJSON_GetObjectItem(json, "lockout_groups");
+            msg->policy.lockout_groups = payload_val ? (uint16_t) payload_val->valueint : 0;
+            msg->policy.windows = cJSON_GetObjectItem(json, "windows");
+            msg->policy.holidays = cJSON_GetObjectItem(json, "holidays");
             status = STATUS_OK;
             break;
         }
@@ -191,6 +320,72 @@ status_t msg_from_cJSON(cJSON *json, msg_t *msg)
     return status;
 }
 
+void msg_stream_init(msg_stream_t *stream, msg_stream_cb_t cb, void *ctx)
+{
+    stream->cb = cb;
+    stream->ctx = ctx;
+    stream->fields = NULL;
+    stream->syncing = false;
+    stream->sync_type = MSG_SYNC;
+    stream->dropped = false;
+    mbedtls_md5_init(&stream->md5);
+    mbedtls_md5_init(&stream->md5_page);
+    json_stream_init(&stream->tokens, msg_stream_token, stream);
+    msg_stream_reset(stream);
+}
+
+void msg_stream_reset(msg_stream_t *stream)
+{
+    if (stream->syncing)
+    {
+        WARN("Sync message incomplete, dropping it");
+        if (stream->sync_type == MSG_SYNC_PAGE && stream->hash_page)
+        {
+            // The page will be sent again
+            mbedtls_md5_clone(&stream->md5, &stream->md5_page);
+            stream->num_hashed = stream->num_hashed_page;
+        }
+        msg_stream_sync(stream, SYNC_ABORT);
+    }
+
+    cJSON_Delete(stream->fields);
+    stream->fields = NULL;
+    stream->num_tags = 0;
+    stream->has_attrs = false;
+    stream->has_digest = false;
+    stream->dropped = false;
+    json_stream_reset(&stream->tokens);
+}
+
+status_t msg_stream_feed(msg_stream_t *stream, const char *data, size_t len)
+{
+    if (stream->dropped)
+    {
+        return -STATUS_PARSE;
+    }
+
+    if (stream->fields == NULL)
+    {
+        stream->fields = cJSON_CreateObject();
+        if (stream->fields == NULL) { return -STATUS_NOMEM; }
+    }
+
+    status_t status = json_stream_feed(&stream->tokens, data, len);
+    if (status != STATUS_OK)
+    {
+        // Drop what was parsed, and ignore the rest of the message
+        ERROR("Malformed message");
+        msg_stream_reset(stream);
+        stream->dropped = true;
+    }
+    else if (json_stream_done(&stream->tokens))
+    {
+        // Ready for the next message
+        msg_stream_reset(stream);
+    }
+    return status;
+}
+
 msg_type_t str_to_msgtype(char *msg_type_str)
 {
     if (strcmp(MSG_AUTHENTICATE_STR, msg_type_str) == 0)        { return MSG_AUTHENTICATE; }
@@ -202,6 +397,15 @@ msg_type_t str_to_msgtype(char *msg_type_str)
     if (strcmp(MSG_UPDATE_LOCKOUT_STR, msg_type_str) == 0)      { return MSG_UPDATE_LOCKOUT; }
     if (strcmp(MSG_BUMP_STR, msg_type_str) == 0)                { return MSG_BUMP; }
     if (strcmp(MSG_SYNC_STR, msg_type_str) == 0)                { return MSG_SYNC; }
+    if (strcmp(MSG_SYNC_ADD_STR, msg_type_str) == 0)            { return MSG_SYNC_ADD; }
+    if (strcmp(MSG_SYNC_REMOVE_STR, msg_type_str) == 0)         { return MSG_SYNC_REMOVE; }
+    if (strcmp(MSG_SYNC_PAGE_STR, msg_type_str) == 0)           { return MSG_SYNC_PAGE; }
+    if (strcmp(MSG_SYNC_ACK_STR, msg_type_str) == 0)            { return MSG_SYNC_ACK; }
+    if (strcmp(MSG_SYNC_RESUME_STR, msg_type_str) == 0)         { return MSG_SYNC_RESUME; }
+    if (strcmp(MSG_SYNC_ERROR_STR, msg_type_str) == 0)          { return MSG_SYNC_ERROR; }
+    if (strcmp(MSG_TAG_DIGEST_STR, msg_type_str) == 0)          { return MSG_TAG_DIGEST; }
+    if (strcmp(MSG_TAG_BUCKET_STR, msg_type_str) == 0)          { return MSG_TAG_BUCKET; }
+    if (strcmp(MSG_POLICY_STR, msg_type_str) == 0)              { return MSG_POLICY; }
     if (strcmp(MSG_UNLOCK_STR, msg_type_str) == 0)              { return MSG_UNLOCK; }
     if (strcmp(MSG_LOCK_STR, msg_type_str) == 0)                { return MSG_LOCK; }
     if (strcmp(MSG_ILOCK_SESS_START_STR, msg_type_str) == 0)    { return MSG_ILOCK_SESS_START; }
@@ -227,6 +431,15 @@ char *msgtype_to_str(msg_type_t msg)
     if (MSG_UPDATE_LOCKOUT == msg)      { return MSG_UPDATE_LOCKOUT_STR; }
     if (MSG_BUMP == msg)                { return MSG_BUMP_STR; }
     if (MSG_SYNC == msg)                { return MSG_SYNC_STR; }
+    if (MSG_SYNC_ADD == msg)            { return MSG_SYNC_ADD_STR; }
+    if (MSG_SYNC_REMOVE == msg)         { return MSG_SYNC_REMOVE_STR; }
+    if (MSG_SYNC_PAGE == msg)           { return MSG_SYNC_PAGE_STR; }
+    if (MSG_SYNC_ACK == msg)            { return MSG_SYNC_ACK_STR; }
+    if (MSG_SYNC_RESUME == msg)         { return MSG_SYNC_RESUME_STR; }
+    if (MSG_SYNC_ERROR == msg)          { return MSG_SYNC_ERROR_STR; }
+    if (MSG_TAG_DIGEST == msg)          { return MSG_TAG_DIGEST_STR; }
+    if (MSG_TAG_BUCKET == msg)          { return MSG_TAG_BUCKET_STR; }
+    if (MSG_POLICY == msg)              { return MSG_POLICY_STR; }
     if (MSG_UNLOCK == msg)              { return MSG_UNLOCK_STR; }
     if (MSG_LOCK == msg)                { return MSG_LOCK_STR; }
     if (MSG_ILOCK_SESS_START == msg)    { return MSG_ILOCK_SESS_START_STR; }
@@ -251,4 +464,403 @@ status_t hexstr_to_bytes(char *str, size_t bytes, uint8_t *buf)
     }
 
     return STATUS_OK;
-}
\ No newline at end of file
+}
+
+void bytes_to_hexstr(const uint8_t *buf, size_t bytes, char *str)
+{
+    for (size_t count = 0; count < bytes; count++) {
+        sprintf(&str[2 * count], "%02x", buf[count]);
+    }
+}
+
+static void msg_sync_hashes(cJSON *json, sync_payload_t *sync)
+{
+    cJSON *hash = cJSON_GetObjectItem(json, "hash");
+    sync->has_hash = cJSON_IsString(hash);
+    if (sync->has_hash)
+    {
+        hexstr_to_bytes(hash->valuestring, 16, sync->hash);
+    }
+
+    hash = cJSON_GetObjectItem(json, "base_hash");
+    sync->has_base_hash = cJSON_IsString(hash);
+    if (sync->has_base_hash)
+    {
+        hexstr_to_bytes(hash->valuestring, 16, sync->base_hash);
+    }
+}
+
+static void msg_stream_token(const json_token_t *token, void *ctx)
+{
+    msg_stream_t *stream = (msg_stream_t *) ctx;
+    bool tags = strcmp(token->key, MSG_SYNC_TAGS_KEY) == 0;
+
+    switch (token->evt)
+    {
+        case JSON_EVT_VALUE: {
+            cJSON *item = msg_token_item(token);
+            if (item == NULL) { return; }
+            cJSON_AddItemToObject(stream->fields, token->key, item);
+            break;
+        }
+
+        case JSON_EVT_ARRAY_BEGIN:
+            if (tags)
+            {
+                // The command usually comes first. Without it, assume a
+                // full list.
+                cJSON *command = cJSON_GetObjectItem(stream->fields, "command");
+                stream->sync_type = MSG_SYNC;
+                if (cJSON_IsString(command))
+                {
+                    msg_type_t type = str_to_msgtype(command->valuestring);
+                    if (type == MSG_SYNC_ADD || type == MSG_SYNC_REMOVE || type == MSG_SYNC_PAGE)
+                    {
+                        stream->sync_type = type;
+                    }
+                }
+
+                stream->num_tags = 0;
+                stream->has_attrs = false;
+                stream->has_digest = false;
+                if (stream->sync_type == MSG_SYNC)
+                {
+                    // Shares the hash with paged syncs, so one in progress
+                    // has to start over
+                    stream->next_page = 0;
+                    stream->num_hashed = 0;
+                    mbedtls_md5_starts(&stream->md5);
+                    msg_stream_hash(stream, "[");
+                }
+                else if (stream->sync_type == MSG_SYNC_PAGE)
+                {
+                    msg_stream_page_begin(stream);
+                }
+                msg_stream_sync(stream, SYNC_BEGIN);
+            }
+            else
+            {
+                // Other arrays are gathered like the scalar fields
+                cJSON_AddItemToObject(stream->fields, token->key, cJSON_CreateArray());
+            }
+            break;
+
+        case JSON_EVT_ITEM:
+            if (tags && stream->syncing)
+            {
+                char *end;
+                stream->tags[stream->num_tags] = (uint64_t) strtoull(token->value, &end, 10);
+                stream->has_attrs |= tag_attrs_parse(end, &stream->attrs[stream->num_tags]);
+                stream->num_tags++;
+
+                if (stream->sync_type == MSG_SYNC)
+                {
+                    msg_stream_hash_item(stream, token);
+                }
+                else if (stream->sync_type == MSG_SYNC_PAGE)
+                {
+                    msg_stream_page_item(stream, token);
+                }
+                if (stream->num_tags == MSG_SYNC_BATCH)
+                {
+                    msg_stream_flush(stream);
+                }
+            }
+            else if (!tags)
+            {
+                cJSON *array = cJSON_GetObjectItem(stream->fields, token->key);
+                if (!cJSON_IsArray(array) || cJSON_GetArraySize(array) >= MSG_ARRAY_MAX) { return; }
+
+                cJSON *item = msg_token_item(token);
+                if (item == NULL) { return; }
+                cJSON_AddItemToArray(array, item);
+            }
+            break;
+
+        case JSON_EVT_ARRAY_END:
+            if (tags && stream->syncing)
+            {
+                msg_stream_flush(stream);
+                if (stream->sync_type == MSG_SYNC)
+                {
+                    msg_stream_hash(stream, "]");
+                    stream->has_digest = mbedtls_md5_finish(&stream->md5, stream->digest) == 0;
+                }
+                else if (stream->sync_type == MSG_SYNC_PAGE)
+                {
+                    msg_stream_crc(stream, "]");
+                }
+            }
+            break;
+
+        case JSON_EVT_END: {
+            msg_t msg = {
+                .type = MSG_INVALID,
+            };
+            msg_from_cJSON(stream->fields, &msg);
+            if (msg.type == MSG_SYNC && stream->has_digest)
+            {
+                msg.sync.has_digest = true;
+                memcpy(msg.sync.digest, stream->digest, sizeof(msg.sync.digest));
+            }
+            if (msg.type == MSG_SYNC_PAGE && stream->syncing && stream->sync_type == MSG_SYNC_PAGE)
+            {
+                msg_stream_page_end(stream, &msg);
+            }
+
+            // Cards that came in anything but the expected sync message are
+            // dropped
+            if (stream->syncing && msg.type != stream->sync_type)
+            {
+                msg_stream_sync(stream, SYNC_ABORT);
+            }
+            stream->syncing = false;
+            stream->cb(&msg, stream->ctx);
+            break;
+        }
+    }
+}
+
+static cJSON *msg_token_item(const json_token_t *token)
+{
+    cJSON *item = NULL;
+    switch (token->type)
+    {
+        case JSON_STRING: item = cJSON_CreateString(token->value); break;
+        case JSON_NUMBER: item = cJSON_CreateNumber(strtod(token->value, NULL)); break;
+        case JSON_TRUE:   item = cJSON_CreateTrue(); break;
+        case JSON_FALSE:  item = cJSON_CreateFalse(); break;
+        case JSON_NULL:   item = cJSON_CreateNull(); break;
+    }
+
+    // cJSON_Parse() sets valueint on bools, msg_from_cJSON() reads it
+    if (item != NULL && token->type == JSON_TRUE) { item->valueint = 1; }
+    return item;
+}
+
+static void msg_add_card(cJSON *json, const char *name, uint64_t card)
+{
+    // Written out as the number's digits: a cJSON number is a double, which
+    // only holds 53 bits
+    char card_str[24];
+    sprintf(card_str, "%llu", (unsigned long long) card);
+    cJSON_AddRawToObject(json, name, card_str);
+}
+
+static void msg_stream_flush(msg_stream_t *stream)
+{
+    if (stream->num_tags > 0)
+    {
+        msg_stream_sync(stream, SYNC_TAGS);
+        stream->num_tags = 0;
+        stream->has_attrs = false;
+    }
+}
+
+static void msg_stream_sync(msg_stream_t *stream, sync_stage_t stage)
+{
+    msg_t msg = {
+        .type = stream->sync_type,
+        .sync.stage = stage,
+        .sync.tags = stream->tags,
+        .sync.attrs = stream->has_attrs ? stream->attrs : NULL,
+        .sync.num_tags = stream->num_tags,
+    };
+
+    // Pass the hashes and page along if they came before the cards
+    msg_sync_hashes(stream->fields, &msg.sync);
+    msg_sync_page(stream->fields, &msg.sync);
+
+    stream->syncing = stage == SYNC_BEGIN || stage == SYNC_TAGS;
+    stream->cb(&msg, stream->ctx);
+}
+
+static void msg_stream_hash(msg_stream_t *stream, const char *str)
+{
+    mbedtls_md5_update(&stream->md5, (const unsigned char *) str, strlen(str));
+}
+
+static void msg_stream_hash_item(msg_stream_t *stream, const json_token_t *token)
+{
+    msg_stream_hash(stream, stream->num_hashed++ > 0 ? ", " : "");
+    switch (token->type)
+    {
+        case JSON_STRING:
+            msg_stream_hash_repr(stream, token->value);
+            break;
+
+        // As Python writes what json.loads() makes of them. Integers are
+        // written the way JSON has them, except -0. Other numbers are hashed
+        // as sent, which only matches if that's how Python writes them.
+        case JSON_TRUE: msg_stream_hash(stream, "True"); break;
+        case JSON_FALSE: msg_stream_hash(stream, "False"); break;
+        case JSON_NULL: msg_stream_hash(stream, "None"); break;
+        default:
+            msg_stream_hash(stream, strcmp(token->value, "-0") == 0 ? "0" : token->value);
+            break;
+    }
+}
+
+// Hash a string the way Python's repr() writes it: in single quotes, or
+// double quotes if it has a ' and no ", with backslashes, the quote and
+// characters Python doesn't print escaped. The string is UTF-8, other
+// characters are hashed as they came.
+static void msg_stream_hash_repr(msg_stream_t *stream, const char *str)
+{
+    const char *quote = strchr(str, '\'') != NULL && strchr(str, '"') == NULL ? "\"" : "'";
+    char esc[11];
+
+    msg_stream_hash(stream, quote);
+    const unsigned char *c = (const unsigned char *) str;
+    while (*c != '\0')
+    {
+        // Decode one character
+        uint32_t code = *c;
+        size_t len = 1;
+        if (code >= 0xF0 && (c[1] & 0xC0) == 0x80 && (c[2] & 0xC0) == 0x80 && (c[3] & 0xC0) == 0x80)
+        {
+            code = ((code & 0x07) << 18) | ((c[1] & 0x3F) << 12) | ((c[2] & 0x3F) << 6) | (c[3] & 0x3F);
+            len = 4;
+        }
+        else if (code >= 0xE0 && (c[1] & 0xC0) == 0x80 && (c[2] & 0xC0) == 0x80)
+        {
+            code = ((code & 0x0F) << 12) | ((c[1] & 0x3F) << 6) | (c[2] & 0x3F);
+            len = 3;
+        }
+        else if (code >= 0xC0 && (c[1] & 0xC0) == 0x80)
+        {
+            code = ((code & 0x1F) << 6) | (c[1] & 0x3F);
+            len = 2;
+        }
+
+        if (code == '\\') { strcpy(esc, "\\\\"); }
+        else if (code == '\n') { strcpy(esc, "\\n"); }
+        else if (code == '\r') { strcpy(esc, "\\r"); }
+        else if (code == '\t') { strcpy(esc, "\\t"); }
+        else if (code == (unsigned char) quote[0]) { sprintf(esc, "\\%c", quote[0]); }
+        else if (msg_repr_printable(code))
+        {
+            memcpy(esc, c, len);
+            esc[len] = '\0';
+        }
+        else if (code < 0x100) { sprintf(esc, "\\x%02lx", code); }
+        else if (code < 0x10000) { sprintf(esc, "\\u%04lx", code); }
+        else { sprintf(esc, "\\U%08lx", code); }
+
+        msg_stream_hash(stream, esc);
+        c += len;
+    }
+    msg_stream_hash(stream, quote);
+}
+
+// Python's str.isprintable() for one character: false for control and
+// format characters, separators other than space, surrogates, private use
+// and noncharacters. Unassigned code points aren't known here, they're taken
+// as printable.
+static bool msg_repr_printable(uint32_t code)
+{
+    static const uint32_t hidden[][2] = {
+        { 0x0000, 0x001F }, { 0x007F, 0x00A0 }, { 0x00AD, 0x00AD },
+        { 0x0600, 0x0605 }, { 0x061C, 0x061C }, { 0x06DD, 0x06DD }, { 0x070F, 0x070F },
+        { 0x0890, 0x0891 }, { 0x08E2, 0x08E2 }, { 0x1680, 0x1680 }, { 0x180E, 0x180E },
+        { 0x2000, 0x200F }, { 0x2028, 0x202F }, { 0x205F, 0x206F },
+        { 0x3000, 0x3000 }, { 0xD800, 0xF8FF }, { 0xFDD0, 0xFDEF }, { 0xFEFF, 0xFEFF },
+        { 0xFFF9, 0xFFFB }, { 0xFFFE, 0xFFFF }, { 0x110BD, 0x110BD }, { 0x110CD, 0x110CD },
+        { 0x13430, 0x1343F }, { 0x1BCA0, 0x1BCA3 }, { 0x1D173, 0x1D17A }, { 0xE0001, 0xE0001 },
+        { 0xE0020, 0xE007F }, { 0xF0000, 0x10FFFF },
+    };
+
+    if ((code & 0xFFFE) == 0xFFFE)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(hidden) / sizeof(hidden[0]); i++)
+    {
+        if (code >= hidden[i][0] && code <= hidden[i][1])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void msg_stream_crc(msg_stream_t *stream, const char *str)
+{
+    stream->page_crc = esp_rom_crc32_le(stream->page_crc, (const uint8_t *) str, strlen(str));
+}
+
+static void msg_stream_page_begin(msg_stream_t *stream)
+{
+    sync_payload_t sync = {0};
+    msg_sync_page(stream->fields, &sync);
+
+    // Page 0 starts a new list. Any other page is only hashed if it's the
+    // one after the last good page, pages sent again are ignored.
+    if (sync.page == 0)
+    {
+        stream->num_hashed = 0;
+        mbedtls_md5_starts(&stream->md5);
+        msg_stream_hash(stream, "[");
+    }
+    stream->hash_page = sync.page == 0 || (sync.sync_id == stream->page_sync_id && sync.page == stream->next_page);
+    if (stream->hash_page)
+    {
+        mbedtls_md5_clone(&stream->md5_page, &stream->md5);
+        stream->num_hashed_page = stream->num_hashed;
+    }
+
+    stream->page_crc = 0;
+    stream->page_items = 0;
+    msg_stream_crc(stream, "[");
+}
+
+static void msg_stream_page_item(msg_stream_t *stream, const json_token_t *token)
+{
+    if (stream->hash_page)
+    {
+        msg_stream_hash_item(stream, token);
+    }
+
+    const char *quote = token->type == JSON_STRING ? "'" : "";
+    msg_stream_crc(stream, stream->page_items++ > 0 ? ", " : "");
+    msg_stream_crc(stream, quote);
+    msg_stream_crc(stream, token->value);
+    msg_stream_crc(stream, quote);
+}
+
+static void msg_stream_page_end(msg_stream_t *stream, msg_t *msg)
+{
+    cJSON *crc = cJSON_GetObjectItem(stream->fields, "crc");
+    bool intact = cJSON_IsString(crc) && strtoul(crc->valuestring, NULL, 16) == stream->page_crc;
+    msg->sync.page_ok = intact && stream->hash_page && msg->sync.page < msg->sync.pages;
+    if (!stream->hash_page)
+    {
+        return;
+    }
+
+    if (!msg->sync.page_ok)
+    {
+        // Sent again from this page
+        mbedtls_md5_clone(&stream->md5, &stream->md5_page);
+        stream->num_hashed = stream->num_hashed_page;
+        return;
+    }
+
+    stream->page_sync_id = msg->sync.sync_id;
+    stream->next_page = msg->sync.page + 1;
+    if (stream->next_page == msg->sync.pages)
+    {
+        msg_stream_hash(stream, "]");
+        msg->sync.has_digest = mbedtls_md5_finish(&stream->md5, msg->sync.digest) == 0;
+    }
+}
+
+static void msg_sync_page(cJSON *json, sync_payload_t *sync)
+{
+    cJSON *value = cJSON_GetObjectItem(json, "sync_id");
+    sync->sync_id = cJSON_IsNumber(value) ? (uint32_t) value->valuedouble : 0;
+    value = cJSON_GetObjectItem(json, "page");
+    sync->page = cJSON_IsNumber(value) ? (uint32_t) value->valuedouble : 0;
+    value = cJSON_GetObjectItem(json, "pages");
+    sync->pages = cJSON_IsNumber(value) ? (uint32_t) value->valuedouble : 0;
+}
@@ -2,7 +2,10 @@
 #define MSGS_H_
 
 #include "status.h"
+#include "json_stream.h"
+#include "tag_record.h"
 #include "cJSON.h"
+#include "mbedtls/md5.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -17,6 +20,15 @@ typedef enum {
     MSG_UPDATE_LOCKOUT,
     MSG_BUMP,
     MSG_SYNC,
+    MSG_SYNC_ADD,
+    MSG_SYNC_REMOVE,
+    MSG_SYNC_PAGE,
+    MSG_SYNC_ACK,
+    MSG_SYNC_RESUME,
+    MSG_SYNC_ERROR,
+    MSG_TAG_DIGEST,
+    MSG_TAG_BUCKET,
+    MSG_POLICY,
     MSG_UNLOCK,
     MSG_LOCK,
     MSG_ILOCK_SESS_START,
@@ -47,13 +59,104 @@ typedef struct {
     bool locked_out;
 } update_lockout_payload_t;
 
+// The card list of a sync message can be long, so it isn't delivered in one
+// message. Handlers see SYNC_BEGIN, then any number of SYNC_TAGS batches, then
+// SYNC_END once the whole message is in (or SYNC_ABORT if it never completes).
+//
+// MSG_SYNC carries the full list. MSG_SYNC_ADD and MSG_SYNC_REMOVE carry a
+// change to the list with the given base hash, and are delivered the same way.
+//
+// A card of the list is a number, or a string of the number followed by its
+// attributes: "card,valid_from,valid_until,groups,flags" (see tag_record.h).
+// Card numbers are up to 64 bits, and are read from the text of the number so
+// none of them go through a double.
+//
+// The hash of a full list is checked against the cards as they arrive. The
+// portal hashes the list as Python prints it, str(tags): items in brackets,
+// separated by ", ", strings in single quotes and numbers as their digits,
+// e.g. "['1234', '5678,0,0,1,0']". The MD5 of that text is built up one card
+// at a time while the list streams in, and handed over with SYNC_END.
+//
+// MSG_SYNC_PAGE carries one page of a full list that's sent in pages. A page
+// has a sync id, its number from 0, the number of pages, and a CRC-32 (zlib)
+// of the page's own cards printed the same way, e.g. crc32("['1234']"). These
+// fields, and the hash of the whole list, go before the cards on every page.
+// Each page is delivered like a sync message, with page_ok set at SYNC_END if
+// it's intact and the next one expected. The device answers each page it
+// stored with MSG_SYNC_ACK. After a reconnect or a bad page, MSG_SYNC_RESUME
+// tells the server which page to send next. The hash of the whole list is
+// built up across pages, and handed over with the last one.
+typedef enum {
+    SYNC_BEGIN,
+    SYNC_TAGS,
+    SYNC_END,
+    SYNC_ABORT,
+} sync_stage_t;
+
 typedef struct {
-    uint8_t hash[16];
-    cJSON *tags; // Special case, pass the JSON array for further parsing to avoid having to copy
+    sync_stage_t stage;
+    bool has_hash;          // The hash can arrive before or after the tags
+    uint8_t hash[16];       // Hash of the list once this message is applied
+    bool has_base_hash;
+    uint8_t base_hash[16];  // Delta only: hash of the list it applies to
+    bool has_digest;        // MSG_SYNC, last MSG_SYNC_PAGE, SYNC_END only
+    uint8_t digest[16];     // MD5 of the cards as they were received
+    uint32_t sync_id;       // MSG_SYNC_PAGE only
+    uint32_t page;
+    uint32_t pages;
+    bool page_ok;           // SYNC_END only: CRC matched, page in order
+    const uint64_t *tags;   // SYNC_TAGS only
+    const tag_attrs_t *attrs; // SYNC_TAGS only, one per card. NULL if none
+                            // of the cards have attributes.
+    size_t num_tags;
 } sync_payload_t;
 
+// Acknowledges a stored page, or asks for the sync to go on from a page
+typedef struct {
+    uint32_t sync_id;
+    uint32_t page;          // Stored page, or next page wanted
+} sync_page_payload_t;
+
+// Tells the server a list it sent wasn't stored. The reason names the limit
+// it ran into, if that's why.
+typedef struct {
+    uint32_t sync_id;       // Paged sync only, 0 otherwise
+    status_t status;
+    const char *reason;
+} sync_error_payload_t;
+
+// Request from the server: group < 0 asks for the root and group digests,
+// otherwise for the bucket digests of that group. The reply echoes the group.
+typedef struct {
+    int32_t group;
+    uint8_t hash[16];       // Reply: stored list hash
+    uint32_t count;         // Reply: cards in the list
+    uint32_t root;          // Reply
+    uint32_t digests[16];   // Reply: group or bucket digests
+} tag_digest_payload_t;
+
+// Request from the server for the cards in a bucket, and the reply
+typedef struct {
+    uint32_t bucket;
+    const uint64_t *tags;   // Reply only
+    size_t num_tags;
+    status_t status;        // Reply: if not STATUS_OK, the cards couldn't
+                            // all be gathered and none are sent
+} tag_bucket_payload_t;
+
+// Local access policy from the server (see policy.h). The arrays point into
+// the parsed message, and are only valid while it's being handled.
 typedef struct {
-    uint32_t card_id;
+    int32_t utc_offset;         // Local time minus UTC, in minutes
+    const char *tz;             // POSIX TZ rule, with DST. NULL if not sent.
+    uint16_t holiday_groups;    // Groups let in on holidays
+    uint16_t lockout_groups;    // Groups let in while locked out
+    const cJSON *windows;       // "group,days,start,end" strings
+    const cJSON *holidays;      // Dates as yyyymmdd numbers
+} policy_payload_t;
+
+typedef struct {
+    uint64_t card_id;
 } ilock_sess_start_reqpayload_t;
 
 typedef struct {
@@ -68,23 +171,23 @@ typedef struct {
 typedef struct {
     char session_id[32];
     float session_kwh; // check
-    uint32_t card_id;
+    uint64_t card_id;
 } ilock_sess_end_payload_t;
 
 typedef struct {
-    uint32_t card_id;
+    uint64_t card_id;
 } access_denied_payload_t;
 
 typedef struct {
-    uint32_t card_id;
+    uint64_t card_id;
 } access_locked_out_payload_t;
 
 typedef struct {
-    uint32_t card_id;
+    uint64_t card_id;
 } access_granted_payload_t;
 
 typedef struct {
-    uint32_t card_id;
+    uint64_t card_id;
     float amount;
 } debit_reqpayload_t;
 
@@ -101,6 +204,11 @@ typedef struct {
         ip_addr_payload_t ip_address;
         update_lockout_payload_t update_lockout;
         sync_payload_t sync;
+        sync_page_payload_t sync_page;
+        sync_error_payload_t sync_error;
+        tag_digest_payload_t tag_digest;
+        tag_bucket_payload_t tag_bucket;
+        policy_payload_t policy;
         ilock_sess_start_reqpayload_t ilock_start_req;
         ilock_sess_start_rsppayload_t ilock_start_rsp;
         ilock_sess_update_payload_t ilock_update;
@@ -113,7 +221,70 @@ typedef struct {
     };
 } msg_t;
 
+// Cards handed to the handlers per SYNC_TAGS message
+#define MSG_SYNC_BATCH 64U
+
+typedef void (*msg_stream_cb_t)(msg_t *msg, void *ctx);
+
+// Parses in-bound messages as their bytes arrive. Scalar fields are gathered
+// in a small cJSON object and parsed by msg_from_cJSON() when the message
+// completes. The card list of a sync message is never gathered: cards are
+// handed out in batches as they are parsed.
+typedef struct {
+    json_stream_t tokens;
+    msg_stream_cb_t cb;
+    void *ctx;
+    cJSON *fields;
+    bool syncing;           // SYNC_BEGIN was sent, but not SYNC_END
+    msg_type_t sync_type;   // Message the cards belong to
+    bool dropped;           // The rest of the current message is ignored
+    size_t num_tags;
+    uint64_t tags[MSG_SYNC_BATCH];
+    bool has_attrs;         // Some card of the batch has attributes
+    tag_attrs_t attrs[MSG_SYNC_BATCH];
+    mbedtls_md5_context md5; // Full list only: hash of the cards so far
+    size_t num_hashed;
+    bool has_digest;
+    uint8_t digest[16];
+
+    // Paged syncs: the hash goes on across pages. It's saved at the start of
+    // each page, and put back if the page turns out bad.
+    mbedtls_md5_context md5_page;
+    size_t num_hashed_page;
+    size_t page_items;      // Cards of the page so far
+    bool hash_page;         // The page is the next one expected
+    uint32_t page_crc;      // CRC-32 of the page's cards so far
+    uint32_t page_sync_id;  // Sync of the last good page
+    uint32_t next_page;
+} msg_stream_t;
+
 status_t msg_to_cJSON(msg_t *msg, cJSON *json);
 status_t msg_from_cJSON(cJSON *json, msg_t *msg);
 
+/**
+ * @brief Initialize a message stream
+ * @param stream message stream
+ * @param cb called with every parsed message
+ * @param ctx passed to cb
+ */
+void msg_stream_init(msg_stream_t *stream, msg_stream_cb_t cb, void *ctx);
+
+/**
+ * @brief Start a new message. A sync still in progress is aborted.
+ * @param stream message stream
+ */
+void msg_stream_reset(msg_stream_t *stream);
+
+/**
+ * @brief Parse the next bytes of the current message
+ * @param stream message stream
+ * @param data next bytes
+ * @param len number of bytes in data
+ * @return -STATUS_PARSE: the message is malformed. The rest of it is ignored,
+ *                        until msg_stream_reset().
+ *         -STATUS_NOMEM: couldn't store the message fields
+ *          STATUS_OK: successful
+ */
+status_t msg_stream_feed(msg_stream_t *stream, const char *data, size_t len);
+
 #endif /*MSGS_H_*/
\ No newline at end of file
@@ -6,8 +6,10 @@
 #include "freertos/event_groups.h"
 
 #include "esp_wifi.h"
+#include "esp_netif_sntp.h"
 
 #define WIFI_RETRIES         5U
+#define NET_SNTP_SERVER      "pool.ntp.org"
 #define NET_EVT_HANDLERS_NUM 10
 
 #define WIFI_CONNECTED_BIT      BIT0
@@ -64,6 +66,11 @@ status_t net_init(const config_network_t *config)
     esp_netif_init();
     esp_event_loop_create_default();
     esp_netif_create_default_wifi_sta();
+
+    // Keep the wall clock set, for cards that are only valid for a while.
+    // It polls by itself once there's a connection.
+    esp_sntp_config_t sntp_config = ESP_NETIF_SNTP_DEFAULT_CONFIG(NET_SNTP_SERVER);
+    esp_netif_sntp_init(&sntp_config);
     
     // Start wifi
     wifi_init_config_t wifi_initiation = WIFI_INIT_CONFIG_DEFAULT();
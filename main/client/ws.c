@@ -86,6 +86,11 @@ status_t ws_evt_cb_register(ws_evt_cb_t cb, void *ctx)
 }
 
 status_t ws_send(cJSON *msg)
+{
+    return ws_send_timeout(msg, portMAX_DELAY);
+}
+
+status_t ws_send_timeout(cJSON *msg, TickType_t timeout)
 {
     assert(msg);
 
@@ -105,7 +110,13 @@ status_t ws_send(cJSON *msg)
         else
         {
             INFO("--> %.*s", strlen(pkt), pkt);
-            esp_websocket_client_send_text(_ctx.client, pkt, strlen(pkt), portMAX_DELAY);
+            int sent = esp_websocket_client_send_text(_ctx.client, pkt, strlen(pkt), timeout);
+            cJSON_free(pkt);
+            if (sent < 0)
+            {
+                ERROR("Couldn't send on websocket");
+                return -STATUS_IO;
+            }
             return STATUS_OK;
         }
     }
@@ -129,7 +140,7 @@ static void ws_evt_cb(void *handler_args, esp_event_base_t base, int32_t event_i
         _ctx.connected = true;
         if (_ctx.handler.cb != NULL)
         {
-            _ctx.handler.cb(WS_OPEN, NULL, _ctx.handler.ctx);
+            _ctx.handler.cb(WS_OPEN, NULL, 0, _ctx.handler.ctx);
         }
         break;
 
@@ -145,7 +156,7 @@ static void ws_evt_cb(void *handler_args, esp_event_base_t base, int32_t event_i
         }
         if (_ctx.handler.cb != NULL)
         {
-            _ctx.handler.cb(WS_CLOSE, NULL, _ctx.handler.ctx);
+            _ctx.handler.cb(WS_CLOSE, NULL, 0, _ctx.handler.ctx);
         }
         break;
 
@@ -158,20 +169,25 @@ static void ws_evt_cb(void *handler_args, esp_event_base_t base, int32_t event_i
         {
             WARN("Received closed message with code=%d", 256 * data->data_ptr[0] + data->data_ptr[1]);
         } 
-        else 
+        else if (data->op_code == 0x1 || data->op_code == 0x0)
         {
-            INFO("<-- %.*s", data->data_len, (char *)data->data_ptr);
-        }
+            // Long messages arrive in several chunks. Only the start is
+            // logged, a full card list would take minutes to print.
+            bool first = data->op_code == 0x1 && data->payload_offset == 0;
+            if (first)
+            {
+                INFO("<-- %.*s (%d bytes)", data->data_len, (char *)data->data_ptr, data->payload_len);
+            }
 
-        // Try to parse a json payload. If we succeed, then send it to be parsed further.
-        cJSON *msg = cJSON_Parse(data->data_ptr);
-        if (msg) 
-        {
+            // Hand the bytes on as they are, they're parsed incrementally
             if (_ctx.handler.cb != NULL)
             {
-                _ctx.handler.cb(WS_MSG, msg, _ctx.handler.ctx);
+                if (first)
+                {
+                    _ctx.handler.cb(WS_MSG_BEGIN, NULL, 0, _ctx.handler.ctx);
+                }
+                _ctx.handler.cb(WS_MSG_DATA, data->data_ptr, data->data_len, _ctx.handler.ctx);
             }
-            cJSON_Delete(msg);
         }
         break;
 
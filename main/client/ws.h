@@ -3,14 +3,18 @@
 
 #include "config.h"
 #include "cJSON.h"
+#include "freertos/FreeRTOS.h"
 
 typedef enum {
     WS_OPEN,
     WS_CLOSE,
-    WS_MSG,
+    WS_MSG_BEGIN,   // A new text message starts
+    WS_MSG_DATA,    // Next bytes of the current message
 } ws_evt_t;
 
-typedef void (*ws_evt_cb_t)(ws_evt_t evt, cJSON *data, void *ctx);
+// Messages are passed on in chunks as they're received, they aren't
+// reassembled. data and len are only set for WS_MSG_DATA.
+typedef void (*ws_evt_cb_t)(ws_evt_t evt, const char *data, size_t len, void *ctx);
 
 status_t ws_init(char *url);
 
@@ -22,6 +26,16 @@ status_t ws_close(void);
 
 status_t ws_send(cJSON *msg);
 
+/**
+ * @brief Send a message, giving up if the connection doesn't take it in time
+ * @param msg message to send
+ * @param timeout longest wait for the connection
+ * @return -STATUS_NO_RESOURCE: not connected
+ *         -STATUS_IO: not sent in time, or the send failed
+ *          STATUS_OK: successful
+ */
+status_t ws_send_timeout(cJSON *msg, TickType_t timeout);
+
 status_t ws_evt_cb_register(ws_evt_cb_t cb, void *ctx);
 
 #endif /*WS_H_*/
\ No newline at end of file
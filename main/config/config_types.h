@@ -72,7 +72,7 @@ typedef struct {
     int fixed_unlock_delay;
     int rgb_led_count;
     bool wiegand_enabled;
-    bool uid_32bit_mode;
+    bool uid_32bit_mode;    // Unused, formats are detected from each frame
 } config_general_t;
 
 // Buzzer config
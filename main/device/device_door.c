@@ -3,13 +3,17 @@
 #include "bsp.h"
 #include "tags.h"
 #include "nvstate.h"
+#include "policy.h"
 #include "signal.h"
 #include "wiegand.h"
 #include "client.h"
+#include "console.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 // Task config
@@ -19,14 +23,38 @@
 
 #define DOOR_TASK_SLEEP 100 //ms
 
+// Longest a swipe report waits on the connection. A stalled websocket drops
+// the report instead of holding up the next swipe.
+#define DOOR_REPORT_TIMEOUT 500 //ms
+
+// Recent decisions kept, so repeat swipes skip the card lookup and the
+// lockout read
+#define DOOR_CACHE_LEN  8U
+
+typedef struct {
+    uint64_t card;
+    msg_type_t decision;    // MSG_ACCESS_GRANTED, _DENIED or _LOCKED_OUT
+} door_decision_t;
+
 typedef struct {
     const config_general_t *config;
     bool prev_door_open_state;
     bool unlock_door;
     int64_t time_opened;
     int64_t time_unlocked;
-    uint32_t last_card_id; // TODO: debounce reads
+    uint64_t last_card_id; // TODO: debounce reads
     wieg_evt_handle_t evt_handle;
+    TaskHandle_t task;
+
+    // Decision cache, most recently used first. It holds decisions made with
+    // the card list and lockout status at these change counts.
+    door_decision_t cache[DOOR_CACHE_LEN];
+    size_t cache_len;
+    uint32_t cache_tags_changes;
+    uint32_t cache_lockout_changes;
+    uint32_t cache_policy_changes;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
 } door_ctx_t;
 
 // API
@@ -38,6 +66,10 @@ static void lock_door(void);
 static void unlock_door(void);
 static status_t client_cmd_handler(msg_t *msg);
 static void door_handle_swipe(wieg_evt_t event, card_t *card, void *ctx);
+static msg_type_t door_decide(uint64_t card, bool *cacheable);
+static bool door_cache_lookup(door_ctx_t *ctx, uint64_t card, msg_type_t *decision);
+static void door_cache_store(door_ctx_t *ctx, uint64_t card, msg_type_t decision);
+int _door_cache_stats(int argc, char **argv);
 
 // Door instance
 device_t door = {
@@ -58,12 +90,16 @@ static status_t door_init(const config_t *config)
     signal_init(&config->buzzer);
 
     _ctx.config = &config->general;
+
+    // The task first, swipes and server requests wake it
+    xTaskCreate(door_task, DOOR_TASK_NAME, DOOR_TASK_STACK, (void *)&_ctx, DOOR_TASK_PRIO, &_ctx.task);
+
     _ctx.evt_handle = wieg_evt_handler_reg(WIEG_EVT_NEWCARD, door_handle_swipe, (void *)&_ctx);
 
     // Register cb for server requests
     client_handler_register(client_cmd_handler);
 
-    xTaskCreate(door_task, DOOR_TASK_NAME, DOOR_TASK_STACK, (void *)&_ctx, DOOR_TASK_PRIO, NULL);
+    console_register("door_cache", "show swipe decision cache stats", NULL, _door_cache_stats);
     return STATUS_OK;
 }
 
@@ -71,48 +107,67 @@ static void door_handle_swipe(wieg_evt_t event, card_t *card, void *ctx)
 {
     door_ctx_t *door_ctx = (door_ctx_t *) ctx;
 
-    WARN("New card: %lu", card->raw);
-    INFO("    facility: 0x%hx", card->facility);
-    INFO("    user id:  0x%hx", card->user_id);
+    WARN("New card: %llu", card->raw);
+    if (card->format != CARD_FMT_UID)
+    {
+        INFO("    facility: 0x%lx", card->facility);
+        INFO("    user id:  0x%lx", card->user_id);
+    }
 
     // Signal that a card was read
     signal_cardread();
 
-    // Check the card swipe against the authorized card list
-    if (tags_verify(card->raw) == STATUS_OK)
+    // Check the card swipe against the authorized card list, unless it was
+    // just swiped
+    msg_type_t decision;
+    if (!door_cache_lookup(door_ctx, card->raw, &decision))
     {
-        WARN("Access granted");
-        if (nvstate_locked_out())
-        {
+        bool cacheable;
+        decision = door_decide(card->raw, &cacheable);
+        if (cacheable) { door_cache_store(door_ctx, card->raw, decision); }
+    }
+
+    // Act on the decision first, the report goes out after
+    msg_t msg;
+    switch (decision)
+    {
+        case MSG_ACCESS_GRANTED: {
+            // Open the door now, rather than on the door task's next poll
+            WARN("Access granted");
+            door_ctx->unlock_door = true;
+            xTaskNotifyGive(door_ctx->task);
+            msg = (msg_t) {
+                .type = MSG_ACCESS_GRANTED,
+                .access_granted.card_id = card->raw,
+            };
+            break;
+        }
+
+        case MSG_ACCESS_LOCKED_OUT: {
             // If "locked out", don't open the door even if the card is good
-            msg_t msg = {
+            WARN("Access granted, but locked out");
+            signal_alert();
+            msg = (msg_t) {
                 .type = MSG_ACCESS_LOCKED_OUT,
                 .access_lockout.card_id = card->raw,
             };
-            client_send_msg(&msg);
-            signal_alert();
+            break;
         }
-        else
-        {
-            // Open the door
-            msg_t msg = {
-                .type = MSG_ACCESS_GRANTED,
-                .access_granted.card_id = card->raw,
+
+        default: {
+            // Couldn't match card in database, don't unlock
+            WARN("Access denied");
+            signal_alert();
+            msg = (msg_t) {
+                .type = MSG_ACCESS_DENIED,
+                .access_denied.card_id = card->raw,
             };
-            client_send_msg(&msg);
-            door_ctx->unlock_door = true;
+            break;
         }
     }
-    else
+    if (client_send_msg_timeout(&msg, DOOR_REPORT_TIMEOUT) == -STATUS_IO)
     {
-        // Couldn't match card in database, don't unlock
-        WARN("Access denied");
-        msg_t msg = {
-            .type = MSG_ACCESS_DENIED,
-            .access_denied.card_id = card->raw,
-        };
-        client_send_msg(&msg);
-        signal_alert();
+        WARN("Swipe of %llu not reported", card->raw);
     }
 
     // Store the last card
@@ -121,6 +176,108 @@ static void door_handle_swipe(wieg_evt_t event, card_t *card, void *ctx)
     _ctx.last_card_id = card->raw;
 }
 
+static msg_type_t door_decide(uint64_t card, bool *cacheable)
+{
+    tag_record_t record;
+    *cacheable = true;
+    if (tags_verify(card, &record) != STATUS_OK)
+    {
+        return MSG_ACCESS_DENIED;
+    }
+
+    // A card that's only valid for a while changes its answer by itself, so
+    // it isn't cached
+    if (record.attrs.valid_from != 0 || record.attrs.valid_until != 0)
+    {
+        *cacheable = false;
+
+        uint32_t now;
+        if (!wallclock(&now))
+        {
+            WARN("Clock not set, can't check when card is valid");
+            return MSG_ACCESS_DENIED;
+        }
+        if (!tag_attrs_valid_at(&record.attrs, now))
+        {
+            WARN("Card not valid at this time");
+            return MSG_ACCESS_DENIED;
+        }
+    }
+
+    // Same for a card on a schedule
+    if (policy_timed(record.attrs.groups))
+    {
+        *cacheable = false;
+    }
+    switch (policy_evaluate(record.attrs.groups, nvstate_locked_out()))
+    {
+        case POLICY_ALLOW:
+            return MSG_ACCESS_GRANTED;
+        case POLICY_LOCKED_OUT:
+            return MSG_ACCESS_LOCKED_OUT;
+        default:
+            WARN("Card not allowed in at this time");
+            return MSG_ACCESS_DENIED;
+    }
+}
+
+static bool door_cache_lookup(door_ctx_t *ctx, uint64_t card, msg_type_t *decision)
+{
+    // A sync, lockout or policy change since the decisions were made drops them all.
+    // The counts are read before deciding, so a change made while deciding
+    // drops that decision on the next swipe.
+    uint32_t tags_changes_now = tags_changes();
+    uint32_t lockout_changes_now = nvstate_locked_out_changes();
+    uint32_t policy_changes_now = policy_changes();
+    if (tags_changes_now != ctx->cache_tags_changes || lockout_changes_now != ctx->cache_lockout_changes ||
+        policy_changes_now != ctx->cache_policy_changes)
+    {
+        ctx->cache_len = 0;
+        ctx->cache_tags_changes = tags_changes_now;
+        ctx->cache_lockout_changes = lockout_changes_now;
+        ctx->cache_policy_changes = policy_changes_now;
+    }
+
+    for (size_t i = 0; i < ctx->cache_len; i++)
+    {
+        if (ctx->cache[i].card == card)
+        {
+            // Move it to the front
+            door_decision_t hit = ctx->cache[i];
+            memmove(&ctx->cache[1], &ctx->cache[0], i * sizeof(door_decision_t));
+            ctx->cache[0] = hit;
+
+            *decision = hit.decision;
+            ctx->cache_hits++;
+            return true;
+        }
+    }
+    ctx->cache_misses++;
+    return false;
+}
+
+static void door_cache_store(door_ctx_t *ctx, uint64_t card, msg_type_t decision)
+{
+    // The least recently used decision falls off the end
+    if (ctx->cache_len < DOOR_CACHE_LEN)
+    {
+        ctx->cache_len++;
+    }
+    memmove(&ctx->cache[1], &ctx->cache[0], (ctx->cache_len - 1) * sizeof(door_decision_t));
+    ctx->cache[0].card = card;
+    ctx->cache[0].decision = decision;
+}
+
+int _door_cache_stats(int argc, char **argv)
+{
+    uint32_t hits = _ctx.cache_hits;
+    uint32_t misses = _ctx.cache_misses;
+    printf("Swipe cache: %lu hits, %lu misses (%lu%% hit rate), %u of %u entries used\n",
+        hits, misses, hits + misses == 0 ? 0 : (uint32_t) ((uint64_t) hits * 100U / (hits + misses)),
+        _ctx.cache_len, DOOR_CACHE_LEN);
+    return 0;
+}
+
 void door_task(void *params)
 {
     assert(params);
@@ -201,7 +358,8 @@ void door_task(void *params)
             }
         }
         
-        vTaskDelay(pdMS_TO_TICKS(DOOR_TASK_SLEEP));
+        // A swipe or bump wakes the task early
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DOOR_TASK_SLEEP));
     }
 }
 
@@ -231,6 +389,7 @@ static status_t client_cmd_handler(msg_t *msg)
     {
         WARN("Door bumped!");
         _ctx.unlock_door = true;
+        xTaskNotifyGive(_ctx.task);
         status = STATUS_OK;
     }
     if (msg->type == MSG_UNLOCK)
@@ -14,6 +14,7 @@
 #include "nvstate.h"
 #include "device.h"
 #include "tags.h"
+#include "policy.h"
 #include "client.h"
 #include "ota_dfu.h"
 #include "console.h"
@@ -77,7 +78,8 @@ void app_main(void)
         status = wieg_init(
             config->pins.wiegand_zero, 
             config->pins.wiegand_one, 
-            config->general.uid_32bit_mode ? WIEG_32_BIT : WIEG_24_BIT
+            WIEG_ENCODINGS_ALL,
+            WIEG_CAPTURE_GPIO
         );
         if (status != STATUS_OK) { ERROR("wieg_init failed: %ld", status); }
     }
@@ -87,15 +89,16 @@ void app_main(void)
         // TODO: Add rdm6300 lib
     }
 
-    INFO("Setting up client");
-    status = client_init(&config->client, config->device_type);
-    client_handler_register(server_cmd_handler);
-    client_open();
-
+    // The card list and device come up before the network, so cards are
+    // checked against the stored list while WiFi connects and the server
+    // syncs. Swipe results are only logged to the server once it's up.
     INFO("Setting up authorized tag db");
     status = tags_init();
     if (status != STATUS_OK) { ERROR("tags_init failed: %ld", status); }
 
+    status = policy_init();
+    if (status != STATUS_OK) { ERROR("policy_init failed: %ld", status); }
+
     switch(config->device_type) {
         case DEVICE_DOOR:
             INFO("Configuring as door");
@@ -120,6 +123,11 @@ void app_main(void)
     status = device->init(config);
     if (status != STATUS_OK) { ERROR("device init failed: %lu", status); }
 
+    INFO("Setting up client");
+    status = client_init(&config->client, config->device_type);
+    client_handler_register(server_cmd_handler);
+    client_open();
+
     while(1)
     {
         vTaskDelay(pdMS_TO_TICKS(1000));
@@ -137,8 +145,8 @@ static status_t server_cmd_handler(msg_t *msg)
     if (msg->type == MSG_UPDATE_LOCKOUT)
     {
         WARN("Updating lockout setting to %u", msg->update_lockout.locked_out);
-        nvstate_locked_out_set(msg->update_lockout.locked_out);
-        status = STATUS_OK;
+        status = nvstate_locked_out_set(msg->update_lockout.locked_out);
+        if (status != STATUS_OK) { ERROR("Couldn't store lockout setting: %ld", status); }
     }
 
     return status;
@@ -7,9 +7,13 @@
 // Keys used for storing the individual settings
 #define NVS_LOCKED_OUT_KEY "locked_out"
 #define NVS_TAG_HASH_KEY   "tag_hash"
+#define NVS_TAG_FORMAT_KEY "tag_format"
+#define NVS_TAG_BANK_KEY   "tag_bank"
 #define NVS_TAG_CONFIG_KEY "config"
+#define NVS_POLICY_KEY     "policy"
 
 static nvs_handle_t _handle;
+static volatile uint32_t _locked_out_changes;
 
 status_t nvstate_init(void)
 {
@@ -63,7 +67,20 @@ bool nvstate_locked_out(void)
 status_t nvstate_locked_out_set(bool locked_out)
 {
     esp_err_t err = nvs_set_u8(_handle, NVS_LOCKED_OUT_KEY, (uint8_t) locked_out); 
-    return err == ESP_OK ? STATUS_OK : STATUS_NO_RESOURCE;
+    if (err == ESP_OK) { err = nvs_commit(_handle); }
+    if (err != ESP_OK)
+    {
+        return -STATUS_NO_RESOURCE;
+    }
+
+    // Only a stored change makes decisions taken under the old state stale
+    _locked_out_changes++;
+    return STATUS_OK;
+}
+
+uint32_t nvstate_locked_out_changes(void)
+{
+    return _locked_out_changes;
 }
 
 status_t nvstate_tag_hash(uint8_t *tag_hash, size_t *len)
@@ -83,6 +100,52 @@ status_t nvstate_tag_hash_set(uint8_t *tag_hash, size_t len)
     return err == ESP_OK ? STATUS_OK : STATUS_NO_RESOURCE;
 }
 
+uint8_t nvstate_tag_format(void)
+{
+    uint8_t format = 0;
+    nvs_get_u8(_handle, NVS_TAG_FORMAT_KEY, &format);
+    return format;
+}
+
+status_t nvstate_tag_format_set(uint8_t format)
+{
+    esp_err_t err = nvs_set_u8(_handle, NVS_TAG_FORMAT_KEY, format);
+    return err == ESP_OK ? STATUS_OK : STATUS_NO_RESOURCE;
+}
+
+uint8_t nvstate_tag_bank(void)
+{
+    uint8_t bank = 0;
+    nvs_get_u8(_handle, NVS_TAG_BANK_KEY, &bank);
+    return bank;
+}
+
+status_t nvstate_tag_bank_set(uint8_t bank)
+{
+    // This is what switches the tag db over, so make sure it's on flash
+    esp_err_t err = nvs_set_u8(_handle, NVS_TAG_BANK_KEY, bank);
+    if (err == ESP_OK) { err = nvs_commit(_handle); }
+    return err == ESP_OK ? STATUS_OK : -STATUS_NO_RESOURCE;
+}
+
+status_t nvstate_policy(void *policy, size_t len)
+{
+    assert(policy);
+
+    size_t bytes = len;
+    esp_err_t err = nvs_get_blob(_handle, NVS_POLICY_KEY, policy, &bytes);
+    return err == ESP_OK && bytes == len ? STATUS_OK : -STATUS_NO_RESOURCE;
+}
+
+status_t nvstate_policy_set(const void *policy, size_t len)
+{
+    assert(policy);
+
+    esp_err_t err = nvs_set_blob(_handle, NVS_POLICY_KEY, policy, len);
+    if (err == ESP_OK) { err = nvs_commit(_handle); }
+    return err == ESP_OK ? STATUS_OK : -STATUS_NO_RESOURCE;
+}
+
 status_t nvstate_config(config_t *config)
 {
     assert(config);
@@ -26,10 +26,18 @@ bool nvstate_locked_out(void);
 /**
  * @brief Set the locked out status.
  * @param locked_out true if locked out, false otherwise
- * @return STATUS_OK: successful
+ * @return -STATUS_NO_RESOURCE: couldn't store the status, it's unchanged
+ *          STATUS_OK: successful
  */
 status_t nvstate_locked_out_set(bool locked_out);
 
+/**
+ * @brief Number of lockout changes since boot. Anything derived from the
+ * lockout status is stale once this changes.
+ * @return change count
+ */
+uint32_t nvstate_locked_out_changes(void);
+
 /**
  * @brief Get the current hash of the list of authorized tags. 
  * @param tag_hash memory for the returned tag_hash (must be at least 
@@ -48,6 +56,54 @@ status_t nvstate_tag_hash(uint8_t *tag_hash, size_t *len);
  */
 status_t nvstate_tag_hash_set(uint8_t *tag_hash, size_t len);
 
+/**
+ * @brief Get the layout used for the authorized tag db (see tag_image.h)
+ * @return stored format, 0 if none was set
+ */
+uint8_t nvstate_tag_format(void);
+
+/**
+ * @brief Set the layout used for the authorized tag db
+ * @param format new format
+ * @return STATUS_OK: successful
+ */
+status_t nvstate_tag_format_set(uint8_t format);
+
+/**
+ * @brief Get the bank holding the current authorized tag db
+ * @return stored bank, 0 if none was set
+ */
+uint8_t nvstate_tag_bank(void);
+
+/**
+ * @brief Switch the authorized tag db to another bank. The change is
+ * committed to flash before returning.
+ * @param bank new bank
+ * @return -STATUS_NO_RESOURCE: couldn't store the bank
+ *          STATUS_OK: successful
+ */
+status_t nvstate_tag_bank_set(uint8_t bank);
+
+/**
+ * @brief Get the stored access policy (see policy.h)
+ * @param policy memory for the policy
+ * @param len size of the policy. A stored policy of another size isn't
+ * returned.
+ * @return -STATUS_NO_RESOURCE: no policy of this size stored
+ *          STATUS_OK: successful
+ */
+status_t nvstate_policy(void *policy, size_t len);
+
+/**
+ * @brief Store the access policy. The change is committed to flash before
+ * returning.
+ * @param policy new policy
+ * @param len size of the policy
+ * @return -STATUS_NO_RESOURCE: couldn't store the policy
+ *          STATUS_OK: successful
+ */
+status_t nvstate_policy_set(const void *policy, size_t len);
+
 /** 
  * @brief Get the current stored config
  * @param config stored config
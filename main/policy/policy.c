@@ -0,0 +1,297 @@
+#include "policy.h"
+#include "bsp.h"
+#include "client.h"
+#include "nvstate.h"
+#include "log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+// Compiled policy layout. A stored policy with another version is ignored.
+#define POLICY_VERSION      1U
+
+#define POLICY_DAYS         7U
+#define POLICY_SLOT_SECS    (15U * 60U)
+#define POLICY_DAY_SECS     (24U * 60U * 60U)
+
+// What's stored and evaluated
+typedef struct {
+    uint32_t version;           // POLICY_VERSION
+    int32_t utc_offset;         // Local time minus UTC, in seconds. Used without tz.
+    char tz[POLICY_TZ_MAX];     // POSIX TZ rule, or empty
+    uint16_t holiday_groups;
+    uint16_t lockout_groups;
+    uint32_t num_holidays;
+    int32_t holidays[POLICY_HOLIDAYS_MAX]; // Local days since 1970-01-01, sorted
+
+    // Groups allowed in each quarter-hour, from Monday 00:00
+    uint16_t slots[POLICY_DAYS * POLICY_SLOTS_PER_DAY];
+} policy_t;
+
+typedef struct {
+    SemaphoreHandle_t lock;     // Guards policy
+    bool loaded;                // A policy was received
+    policy_t policy;
+    volatile uint32_t changes;
+} policy_ctx_t;
+
+static policy_ctx_t _ctx;
+
+status_t policy_handler(msg_t *msg);
+
+// Helpers
+static status_t policy_compile(const policy_payload_t *payload, policy_t *policy);
+static bool policy_holiday(const policy_t *policy, int32_t day);
+static void policy_local(const policy_t *policy, uint32_t now, int32_t *day, uint32_t *weekday, uint32_t *secs);
+static void policy_tz_set(const policy_t *policy);
+static int32_t policy_day(uint32_t date);
+static int day_cmp(const void *a, const void *b);
+
+status_t policy_init(void)
+{
+    _ctx.lock = xSemaphoreCreateMutex();
+    if (_ctx.lock == NULL) { return -STATUS_NOMEM; }
+
+    memset(&_ctx.policy, 0, sizeof(policy_t));
+    status_t status = nvstate_policy(&_ctx.policy, sizeof(policy_t));
+    if (status == STATUS_OK && _ctx.policy.version == POLICY_VERSION)
+    {
+        _ctx.loaded = true;
+        policy_tz_set(&_ctx.policy);
+        INFO("Access policy loaded, %lu holidays", _ctx.policy.num_holidays);
+    }
+    else
+    {
+        INFO("No access policy stored, cards aren't on a schedule");
+    }
+
+    return client_handler_register(policy_handler);
+}
+
+policy_decision_t policy_evaluate(uint16_t groups, bool locked_out)
+{
+    xSemaphoreTake(_ctx.lock, portMAX_DELAY);
+
+    policy_decision_t decision;
+    const policy_t *policy = &_ctx.policy;
+    uint32_t now;
+    if (!_ctx.loaded || groups == 0)
+    {
+        decision = locked_out ? POLICY_LOCKED_OUT : POLICY_ALLOW;
+    }
+    else if (locked_out && (groups & policy->lockout_groups) == 0)
+    {
+        decision = POLICY_LOCKED_OUT;
+    }
+    else if (!wallclock(&now))
+    {
+        // Fail closed, the schedule can't be checked
+        decision = POLICY_DENY;
+    }
+    else
+    {
+        int32_t day;
+        uint32_t weekday;
+        uint32_t secs;
+        policy_local(policy, now, &day, &weekday, &secs);
+
+        uint16_t allowed = policy->slots[weekday * POLICY_SLOTS_PER_DAY + secs / POLICY_SLOT_SECS];
+        if (policy_holiday(policy, day))
+        {
+            allowed &= policy->holiday_groups;
+        }
+        decision = (allowed & groups) != 0 ? POLICY_ALLOW : POLICY_DENY;
+    }
+
+    xSemaphoreGive(_ctx.lock);
+    return decision;
+}
+
+bool policy_timed(uint16_t groups)
+{
+    return _ctx.loaded && groups != 0;
+}
+
+uint32_t policy_changes(void)
+{
+    return _ctx.changes;
+}
+
+status_t policy_handler(msg_t *msg)
+{
+    assert(msg);
+
+    if (msg->type != MSG_POLICY)
+    {
+        return -STATUS_UNAVAILABLE;
+    }
+
+    // Compiled outside the lock, swipes are checked against the old policy
+    // meanwhile
+    policy_t *policy = malloc(sizeof(policy_t));
+    if (policy == NULL)
+    {
+        ERROR("Not enough memory for the access policy");
+        return STATUS_OK;
+    }
+
+    status_t status = policy_compile(&msg->policy, policy);
+    if (status == STATUS_OK) { status = nvstate_policy_set(policy, sizeof(policy_t)); }
+    if (status != STATUS_OK)
+    {
+        ERROR("Couldn't store access policy: %ld", status);
+        free(policy);
+        return STATUS_OK;
+    }
+
+    xSemaphoreTake(_ctx.lock, portMAX_DELAY);
+    memcpy(&_ctx.policy, policy, sizeof(policy_t));
+    _ctx.loaded = true;
+    policy_tz_set(&_ctx.policy);
+    _ctx.changes++;
+    xSemaphoreGive(_ctx.lock);
+
+    free(policy);
+    INFO("New access policy, %lu holidays", _ctx.policy.num_holidays);
+    return STATUS_OK;
+}
+
+// Private
+
+static status_t policy_compile(const policy_payload_t *payload, policy_t *policy)
+{
+    memset(policy, 0, sizeof(policy_t));
+    policy->version = POLICY_VERSION;
+    policy->utc_offset = payload->utc_offset * 60;
+    if (payload->tz != NULL && strlen(payload->tz) < POLICY_TZ_MAX)
+    {
+        strcpy(policy->tz, payload->tz);
+    }
+    else if (payload->tz != NULL)
+    {
+        WARN("Policy time zone is too long, using the UTC offset");
+    }
+    policy->holiday_groups = payload->holiday_groups;
+    policy->lockout_groups = payload->lockout_groups;
+
+    // Set each window's group in the quarter-hours it covers
+    const cJSON *window;
+    cJSON_ArrayForEach(window, payload->windows)
+    {
+        unsigned int group, days, start, end;
+        if (!cJSON_IsString(window) ||
+            sscanf(window->valuestring, "%u,%u,%u,%u", &group, &days, &start, &end) != 4 ||
+            group >= POLICY_GROUPS || start >= end || end > POLICY_DAY_SECS / 60)
+        {
+            WARN("Ignoring bad policy window");
+            continue;
+        }
+
+        uint32_t first = start / 15;
+        uint32_t last = (end + 14) / 15;
+        for (uint32_t day = 0; day < POLICY_DAYS; day++)
+        {
+            if ((days & (1U << day)) == 0)
+            {
+                continue;
+            }
+            for (uint32_t slot = first; slot < last; slot++)
+            {
+                policy->slots[day * POLICY_SLOTS_PER_DAY + slot] |= 1U << group;
+            }
+        }
+    }
+
+    const cJSON *holiday;
+    cJSON_ArrayForEach(holiday, payload->holidays)
+    {
+        if (!cJSON_IsNumber(holiday) || policy->num_holidays == POLICY_HOLIDAYS_MAX)
+        {
+            WARN("Ignoring policy holiday");
+            continue;
+        }
+        policy->holidays[policy->num_holidays++] = policy_day((uint32_t) holiday->valuedouble);
+    }
+    qsort(policy->holidays, policy->num_holidays, sizeof(int32_t), day_cmp);
+    return STATUS_OK;
+}
+
+static bool policy_holiday(const policy_t *policy, int32_t day)
+{
+    size_t lo = 0;
+    size_t hi = policy->num_holidays;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (policy->holidays[mid] < day)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < policy->num_holidays && policy->holidays[lo] == day;
+}
+
+// Local day since 1970-01-01, day of the week from Monday and seconds since
+// midnight
+static void policy_local(const policy_t *policy, uint32_t now, int32_t *day, uint32_t *weekday, uint32_t *secs)
+{
+    if (policy->tz[0] != '\0')
+    {
+        // TZ was set to the policy's rule when it was loaded
+        struct tm local;
+        time_t t = (time_t) now;
+        localtime_r(&t, &local);
+        *day = policy_day((uint32_t) ((local.tm_year + 1900) * 10000 + (local.tm_mon + 1) * 100 + local.tm_mday));
+        *weekday = (uint32_t) (local.tm_wday + 6) % POLICY_DAYS;
+        *secs = (uint32_t) (local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec);
+        return;
+    }
+
+    int64_t local = (int64_t) now + policy->utc_offset;
+    *day = (int32_t) (local / POLICY_DAY_SECS);
+    *weekday = (uint32_t) (*day + 3) % POLICY_DAYS; // 1970-01-01 was a Thursday
+    *secs = (uint32_t) (local % POLICY_DAY_SECS);
+}
+
+// Nothing else in the firmware uses local time, so the policy owns TZ
+static void policy_tz_set(const policy_t *policy)
+{
+    if (policy->tz[0] != '\0')
+    {
+        setenv("TZ", policy->tz, 1);
+        tzset();
+    }
+}
+
+static int32_t policy_day(uint32_t date)
+{
+    // Days since 1970-01-01 of a yyyymmdd date in the proleptic Gregorian
+    // calendar, with years starting in March so leap days come last
+    int32_t year = (int32_t) (date / 10000);
+    uint32_t month = (date / 100) % 100;
+    uint32_t mday = date % 100;
+
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t year_of_era = (uint32_t) (year - era * 400);
+    uint32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + mday - 1;
+    uint32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (int32_t) day_of_era - 719468;
+}
+
+static int day_cmp(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *) a;
+    int32_t y = *(const int32_t *) b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,74 @@
+#ifndef POLICY_H_
+#define POLICY_H_
+
+#include "status.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local access policy: when the cards of each group may get in. The server
+// sends the rules in a policy message:
+//   - weekly windows per group, "group,days,start,end": days is a bitmask
+//     from Monday (bit 0) to Sunday (bit 6), start and end are minutes from
+//     local midnight, rounded out to quarter-hours. A window can't cross
+//     midnight, it's sent as two.
+//   - holidays, as yyyymmdd dates. Only holiday_groups get in on them, in
+//     their usual windows.
+//   - lockout_groups, let in on their schedule even while the door is
+//     locked out
+//   - tz, the local time zone as a POSIX TZ rule such as
+//     "CET-1CEST,M3.5.0,M10.5.0/3", so daylight saving changes are followed
+//     without a new policy. Without one, utc_offset is used all year.
+// The rules are compiled into the groups allowed in each quarter-hour of the
+// week, so a swipe is checked with one table read whatever the rules are.
+//
+// Cards in no group aren't restricted by the policy, nor is anything before
+// the first policy arrives.
+
+// Number of groups, one bit each in tag_attrs_t.groups
+#define POLICY_GROUPS           16U
+
+// Quarter-hours in a day
+#define POLICY_SLOTS_PER_DAY    96U
+
+#define POLICY_HOLIDAYS_MAX     64U
+
+// Longest TZ rule, with its terminator
+#define POLICY_TZ_MAX           64U
+
+typedef enum {
+    POLICY_ALLOW,
+    POLICY_DENY,            // Outside the card's schedule, or the time isn't known
+    POLICY_LOCKED_OUT,
+} policy_decision_t;
+
+/**
+ * @brief Load the stored policy, and start handling policy messages
+ * @return -STATUS_NOMEM: couldn't create the lock or register the handler
+ *          STATUS_OK: successful, with or without a stored policy
+ */
+status_t policy_init(void);
+
+/**
+ * @brief Decide if a card that is in the card list gets in now. Constant
+ * time. Takes the policy lock, so call it from a task, not an ISR.
+ * @param groups groups of the card
+ * @param locked_out lockout status of the door
+ * @return decision
+ */
+policy_decision_t policy_evaluate(uint16_t groups, bool locked_out);
+
+/**
+ * @brief Check if the decision for a card depends on the time
+ * @param groups groups of the card
+ * @return true if the card is on a schedule
+ */
+bool policy_timed(uint16_t groups);
+
+/**
+ * @brief Number of policy changes since boot. Decisions made before a change
+ * are stale.
+ * @return change count
+ */
+uint32_t policy_changes(void);
+
+#endif /*POLICY_H_*/
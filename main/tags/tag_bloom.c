@@ -0,0 +1,103 @@
+#include "tag_bloom.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+// Bits per card aimed for. With the best k this passes about 1% of unknown
+// cards; the array is rounded up to a power of 2, so usually a bit better.
+#define TAG_BLOOM_BITS_PER_CARD 10U
+
+// Smallest array allocated, in bits
+#define TAG_BLOOM_MIN_BITS      10
+
+// Most bits set per card. More would make lookups slower for little gain.
+#define TAG_BLOOM_MAX_K         8U
+
+status_t tag_bloom_init(tag_bloom_t *bloom, size_t expected, size_t max_bytes)
+{
+    assert(bloom);
+
+    // Pick the smallest power-of-2 array that gives each card its bits,
+    // unless that's more than the RAM allowed
+    int bits = TAG_BLOOM_MIN_BITS;
+    while (bits < 31 && ((size_t) 1 << bits) < expected * TAG_BLOOM_BITS_PER_CARD &&
+        ((size_t) 1 << (bits + 1)) / 8 <= max_bytes)
+    {
+        bits++;
+    }
+    size_t num_bits = (size_t) 1 << bits;
+
+    // k = ln(2) * bits per card minimizes false positives
+    size_t k = expected == 0 ? 1 : (num_bits * 693U / expected + 500U) / 1000U;
+    if (k < 1) { k = 1; }
+    if (k > TAG_BLOOM_MAX_K) { k = TAG_BLOOM_MAX_K; }
+
+    bloom->count = 0;
+    bloom->k = (uint8_t) k;
+    bloom->shift = 32 - bits;
+    bloom->bits = calloc(num_bits / 32, sizeof(uint32_t));
+    return bloom->bits == NULL ? -STATUS_NOMEM : STATUS_OK;
+}
+
+void tag_bloom_add(tag_bloom_t *bloom, uint32_t card)
+{
+    assert(bloom);
+
+    if (bloom->bits == NULL)
+    {
+        return;
+    }
+
+    // Same bits as tag_bloom_maybe() tests
+    uint32_t h1 = card * 0x9E3779B1U;
+    uint32_t h2 = ((card ^ (card >> 16)) * 0x85EBCA77U) | 1U;
+    for (uint8_t i = 0; i < bloom->k; i++)
+    {
+        uint32_t bit = h1 >> bloom->shift;
+        bloom->bits[bit / 32] |= 1U << (bit % 32);
+        h1 += h2;
+    }
+    bloom->count++;
+}
+
+uint32_t tag_bloom_fp_ppm(const tag_bloom_t *bloom)
+{
+    assert(bloom);
+
+    if (bloom->bits == NULL)
+    {
+        return 1000000U;
+    }
+
+    // An unknown card passes when all its k bits happen to be set
+    size_t words = ((size_t) 1 << (32 - bloom->shift)) / 32;
+    size_t set = 0;
+    for (size_t i = 0; i < words; i++)
+    {
+        set += __builtin_popcount(bloom->bits[i]);
+    }
+
+    double full = (double) set / (double) (words * 32);
+    double rate = 1.0;
+    for (uint8_t i = 0; i < bloom->k; i++)
+    {
+        rate *= full;
+    }
+    return (uint32_t) (rate * 1000000.0 + 0.5);
+}
+
+size_t tag_bloom_bytes(const tag_bloom_t *bloom)
+{
+    assert(bloom);
+
+    return bloom->bits == NULL ? 0 : ((size_t) 1 << (32 - bloom->shift)) / 8;
+}
+
+void tag_bloom_free(tag_bloom_t *bloom)
+{
+    assert(bloom);
+
+    free(bloom->bits);
+    bloom->bits = NULL;
+    bloom->count = 0;
+}
@@ -0,0 +1,88 @@
+#ifndef TAG_BLOOM_H_
+#define TAG_BLOOM_H_
+
+#include "status.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// In-RAM Bloom filter over a card list. It answers "definitely not in the
+// list" or "maybe in the list" from a few bits, so most unknown cards are
+// turned away without searching the list itself. A filter can't have cards
+// removed: it's built once for a list and thrown away with it.
+//
+// The k bit positions of a card come from two hashes (h1 + i * h2), so a
+// lookup is two multiplies and k bit tests.
+typedef struct {
+    uint32_t *bits;     // Bit array, NULL when the filter is unused
+    int shift;          // 32 - log2(number of bits), used by the hash
+    uint8_t k;          // Bits set per card
+    size_t count;       // Cards added
+} tag_bloom_t;
+
+/**
+ * @brief Initialize an empty filter sized for a list
+ * @param bloom filter to initialize
+ * @param expected number of cards that will be added
+ * @param max_bytes most RAM the bit array may use
+ * @return -STATUS_NOMEM: couldn't allocate the bit array, the filter is unused
+ *          STATUS_OK: successful
+ */
+status_t tag_bloom_init(tag_bloom_t *bloom, size_t expected, size_t max_bytes);
+
+/**
+ * @brief Add a card to the filter
+ * @param bloom filter to add to
+ * @param card card number
+ */
+void tag_bloom_add(tag_bloom_t *bloom, uint32_t card);
+
+/**
+ * @brief Check if a card may be in the list. An unused filter passes every
+ * card.
+ * @param bloom filter to check
+ * @param card card number
+ * @return false if the card is definitely not in the list, true otherwise
+ */
+static inline bool tag_bloom_maybe(const tag_bloom_t *bloom, uint32_t card)
+{
+    if (bloom->bits == NULL)
+    {
+        return true;
+    }
+
+    uint32_t h1 = card * 0x9E3779B1U;
+    uint32_t h2 = ((card ^ (card >> 16)) * 0x85EBCA77U) | 1U;
+    for (uint8_t i = 0; i < bloom->k; i++)
+    {
+        uint32_t bit = h1 >> bloom->shift;
+        if ((bloom->bits[bit / 32] & (1U << (bit % 32))) == 0)
+        {
+            return false;
+        }
+        h1 += h2;
+    }
+    return true;
+}
+
+/**
+ * @brief Expected false positive rate, from how full the filter is
+ * @param bloom filter
+ * @return chance that a card not in the list passes, in parts per million
+ */
+uint32_t tag_bloom_fp_ppm(const tag_bloom_t *bloom);
+
+/**
+ * @brief Size of the bit array
+ * @param bloom filter
+ * @return size in bytes, 0 if the filter is unused
+ */
+size_t tag_bloom_bytes(const tag_bloom_t *bloom);
+
+/**
+ * @brief Release the bit array. The filter is left unused.
+ * @param bloom filter to free
+ */
+void tag_bloom_free(tag_bloom_t *bloom);
+
+#endif /*TAG_BLOOM_H_*/
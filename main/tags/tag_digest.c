@@ -0,0 +1,62 @@
+#include "tag_digest.h"
+
+#include "esp_rom_crc.h"
+
+#include <string.h>
+
+// Helpers
+static inline uint32_t tag_digest_mix(uint64_t card);
+static inline uint32_t fmix32(uint32_t x);
+
+void tag_digest_clear(tag_digest_t *digest)
+{
+    memset(digest, 0, sizeof(tag_digest_t));
+}
+
+void tag_digest_add(tag_digest_t *digest, uint64_t card)
+{
+    digest->bucket[tag_digest_bucket_of(card)] += tag_digest_mix(card);
+    digest->count++;
+}
+
+void tag_digest_remove(tag_digest_t *digest, uint64_t card)
+{
+    digest->bucket[tag_digest_bucket_of(card)] -= tag_digest_mix(card);
+    digest->count--;
+}
+
+uint32_t tag_digest_group(const tag_digest_t *digest, uint32_t group)
+{
+    // The ESP32 is little endian, the buckets hash as stored
+    const uint32_t *buckets = &digest->bucket[group * TAG_DIGEST_FANOUT];
+    return esp_rom_crc32_le(0, (const uint8_t *) buckets, TAG_DIGEST_FANOUT * sizeof(uint32_t));
+}
+
+uint32_t tag_digest_root(const tag_digest_t *digest)
+{
+    uint32_t groups[TAG_DIGEST_GROUPS];
+    for (uint32_t g = 0; g < TAG_DIGEST_GROUPS; g++)
+    {
+        groups[g] = tag_digest_group(digest, g);
+    }
+    return esp_rom_crc32_le(0, (const uint8_t *) groups, sizeof(groups));
+}
+
+// Private
+
+static inline uint32_t tag_digest_mix(uint64_t card)
+{
+    // The high half is folded in first, it's zero for 32-bit cards
+    return fmix32((uint32_t) card ^ fmix32((uint32_t) (card >> 32)));
+}
+
+static inline uint32_t fmix32(uint32_t x)
+{
+    // murmur3 finalizer, spreads similar card numbers across the sum
+    x ^= x >> 16;
+    x *= 0x85ebca6bU;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35U;
+    x ^= x >> 16;
+    return x;
+}
@@ -0,0 +1,75 @@
+#ifndef TAG_DIGEST_H_
+#define TAG_DIGEST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Digest of a card set, split into buckets so two copies of the set can be
+// compared piece by piece, and only the pieces that differ re-sent. It forms
+// a three level tree:
+//
+//   bucket[b] = sum of mix(card) for cards with (card & 0xFF) == b, mod 2^32
+//   group[g]  = crc32 of bucket[16g] .. bucket[16g + 15], little endian
+//   root      = crc32 of group[0] .. group[15], little endian
+//
+// mix(card) = fmix32(low32(card) ^ fmix32(high32(card))), where fmix32() is
+// the murmur3 finalizer and fmix32(0) = 0, so a 32-bit card mixes to
+// fmix32(card). crc32 is the zlib one. Cards are bucketed by their low byte,
+// the high bits are shared by cards with the same facility code. Bucket sums
+// are updated in place as cards come and go.
+
+#define TAG_DIGEST_BUCKETS  256U
+#define TAG_DIGEST_GROUPS   16U
+#define TAG_DIGEST_FANOUT   16U
+
+typedef struct {
+    uint32_t bucket[TAG_DIGEST_BUCKETS];
+    uint32_t count;
+} tag_digest_t;
+
+/**
+ * @brief Empty a digest
+ * @param digest digest
+ */
+void tag_digest_clear(tag_digest_t *digest);
+
+/**
+ * @brief Account for a card joining the set. The card must not be in the set.
+ * @param digest digest
+ * @param card card number
+ */
+void tag_digest_add(tag_digest_t *digest, uint64_t card);
+
+/**
+ * @brief Account for a card leaving the set. The card must be in the set.
+ * @param digest digest
+ * @param card card number
+ */
+void tag_digest_remove(tag_digest_t *digest, uint64_t card);
+
+/**
+ * @brief Bucket a card falls in
+ * @param card card number
+ * @return bucket number
+ */
+static inline uint32_t tag_digest_bucket_of(uint64_t card)
+{
+    return (uint32_t) card & (TAG_DIGEST_BUCKETS - 1);
+}
+
+/**
+ * @brief Digest of a group of buckets
+ * @param digest digest
+ * @param group group number, < TAG_DIGEST_GROUPS
+ * @return group digest
+ */
+uint32_t tag_digest_group(const tag_digest_t *digest, uint32_t group);
+
+/**
+ * @brief Digest of the whole set
+ * @param digest digest
+ * @return root digest
+ */
+uint32_t tag_digest_root(const tag_digest_t *digest);
+
+#endif /*TAG_DIGEST_H_*/
@@ -0,0 +1,1045 @@
+#include "tag_image.h"
+#include "tag_mphf.h"
+#include "tag_pack.h"
+#include "log.h"
+
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Label of the raw data partition holding the image
+#define TAG_IMAGE_PARTITION "tags"
+
+// Marks a complete image. Anything else in the header means no image.
+#define TAG_IMAGE_MAGIC     0x49474154U // "TAGI"
+
+// Layout of the header and data region. An image of another version is
+// ignored, and rebuilt by the next sync.
+#define TAG_IMAGE_VERSION   5U
+
+// Flash erase granularity
+#define TAG_IMAGE_SECTOR    0x1000U
+
+// Cards are sorted in RAM this many at a time during a build, then merged
+// from flash. This bounds the RAM a build needs, regardless of list size.
+#define TAG_IMAGE_RUN_LEN   1024U
+#define TAG_IMAGE_MAX_RUNS  128U
+
+// A packed image stores its runs compressed. Gaps within a run shrink as
+// runs get longer: 4096 random 32-bit cards take about 3 bytes each.
+#define TAG_IMAGE_PACK_RUN_LEN 4096U
+
+// Change log at the end of the partition
+#define TAG_IMAGE_LOG_SIZE  (2 * TAG_IMAGE_SECTOR)
+#define TAG_IMAGE_LOG_ERASED 0xFFFFFFFFU
+
+// The rest of the partition is split into banks, each a header sector and
+// a data region. One holds the current image, a new one is built in the
+// next, and the one after that holds the merged card list meanwhile. A
+// packed image is merged straight into its layout, so the third bank holds
+// its compressed runs instead, and it's the compressed size that has to fit
+// in a bank.
+#define TAG_IMAGE_BANKS     3U
+
+// Slots of the hash table filled per pass over the key list. Keys land in
+// random slots, so the table is written one window at a time.
+#define TAG_IMAGE_WINDOW_LEN 4096U
+
+// Stored in the first sector of each bank, and written last: a build that
+// doesn't finish leaves no valid image behind.
+typedef struct {
+    uint32_t magic;     // TAG_IMAGE_MAGIC
+    uint32_t version;   // TAG_IMAGE_VERSION
+    uint32_t seq;       // Images built before this one, the newest is highest
+    uint32_t format;    // tag_image_format_t
+    uint32_t count;     // Number of cards in the array
+    uint32_t size;      // Bytes used in the data region
+    uint32_t crc;       // CRC32 of the used data region
+    tag_mphf_t mphf;    // Hash parameters, TAG_IMAGE_MPHF only
+    uint32_t wide;      // Wide cards before the records
+    uint32_t records;   // Card records at the end of the used data region
+} tag_image_hdr_t;
+
+// Log entry. The op is written after the card, so an entry torn by a reset
+// still reads as erased and is ignored.
+typedef struct {
+    uint32_t card;
+    uint32_t op;        // tag_image_op_t, and the bank it applies to shifted
+                        // up by 8. TAG_IMAGE_LOG_ERASED past the end.
+} tag_log_entry_t;
+
+// Area of the partition that is erased just ahead of sequential writes
+typedef struct {
+    size_t base;        // Partition offset of the region
+    size_t size;        // Size of the region in bytes
+    size_t erased;      // Bytes from base that have been erased
+} tag_region_t;
+
+typedef struct {
+    const esp_partition_t *part;
+    esp_partition_mmap_handle_t mmap;
+    const uint8_t *map;             // The whole partition, memory mapped
+    tag_region_t banks[TAG_IMAGE_BANKS]; // Data region of each bank
+    uint8_t bank;                   // Bank of the current image
+    uint32_t seq;                   // Of the current image
+    size_t log_base;                // Partition offset of the change log
+    const tag_log_entry_t *log;
+    size_t log_len;                 // Entries in the log
+    bool log_stale;                 // The log is for the previous image
+    tag_image_view_t view;          // Current image
+
+    // Build state
+    bool building;
+    bool built;                     // Committed, waiting for tag_image_switch()
+    tag_region_t *data;             // Bank the image is built in
+    tag_region_t *scratch;          // Merged card list
+    tag_region_t *runs;             // Sorted runs: the data bank, or the scratch
+                                    // bank for a packed image
+    uint8_t build_bank;
+    tag_image_format_t build_format;
+    uint32_t *buf;                  // run_cap cards
+    size_t run_cap;
+    const uint64_t *wide;           // Stored after the cards, caller's memory
+    size_t num_wide;
+    const tag_record_t *records;    // Stored after the wide cards, caller's memory
+    size_t num_records;
+    size_t buf_len;
+    size_t num_runs;
+    size_t runs_size;               // Bytes used by the runs
+    uint32_t run_len[TAG_IMAGE_MAX_RUNS];  // Cards in each run
+    uint32_t run_base[TAG_IMAGE_MAX_RUNS]; // Offset of each run in its bank
+
+    // Merge state
+    uint32_t run_pos[TAG_IMAGE_MAX_RUNS];  // Cards of each run merged
+    uint32_t run_off[TAG_IMAGE_MAX_RUNS];  // Offset of the card after the head
+    uint32_t run_head[TAG_IMAGE_MAX_RUNS]; // Smallest card not merged yet
+    size_t merged;                  // Cards merged, without duplicates
+    uint32_t merge_last;
+} tag_image_ctx_t;
+
+static tag_image_ctx_t _ctx;
+
+// Helpers
+static status_t tag_image_flush_run(void);
+static void tag_image_merge_start(void);
+static bool tag_image_merge_next(uint32_t *card);
+static uint32_t tag_image_run_read(size_t run, uint32_t prev);
+static status_t tag_image_merge(size_t *count);
+static status_t tag_image_layout(size_t count, uint32_t *crc);
+static status_t tag_image_layout_mphf(size_t count, tag_mphf_t *mphf, size_t *size, uint32_t *crc);
+static status_t tag_image_layout_packed(size_t *count, size_t *size, uint32_t *crc);
+static status_t tag_image_write_extra(const void *data, size_t bytes, size_t *size, uint32_t *crc);
+static void tag_image_attach(uint8_t bank, const tag_image_hdr_t *hdr);
+static const tag_image_hdr_t *tag_image_hdr(uint8_t bank);
+static const tag_image_hdr_t *tag_image_valid(uint8_t bank);
+static size_t mphf_pilot_bytes(const tag_mphf_t *mphf);
+static status_t tag_image_log_erase(void);
+static status_t region_write(tag_region_t *region, size_t offset, const void *data, size_t len);
+static size_t eytz_subtree(size_t node, size_t n);
+static size_t eytz_rank(size_t node, size_t n);
+static int card_cmp(const void *a, const void *b);
+
+status_t tag_image_init(uint8_t *bank)
+{
+    _ctx.part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_ANY,
+        TAG_IMAGE_PARTITION
+    );
+    if (_ctx.part == NULL)
+    {
+        return -STATUS_UNAVAILABLE;
+    }
+
+    // The log last, the banks split what's left. Bank 0 is where the image
+    // was before there were banks, so an older image is still found.
+    size_t bank_size = ((_ctx.part->size - TAG_IMAGE_LOG_SIZE) / TAG_IMAGE_BANKS) & ~(TAG_IMAGE_SECTOR - 1);
+    for (uint8_t i = 0; i < TAG_IMAGE_BANKS; i++)
+    {
+        _ctx.banks[i].base = i * bank_size + TAG_IMAGE_SECTOR;
+        _ctx.banks[i].size = bank_size - TAG_IMAGE_SECTOR;
+    }
+    _ctx.log_base = _ctx.part->size - TAG_IMAGE_LOG_SIZE;
+
+    const void *map;
+    esp_err_t err = esp_partition_mmap(_ctx.part, 0, _ctx.part->size, ESP_PARTITION_MMAP_DATA, &map, &_ctx.mmap);
+    if (err != ESP_OK)
+    {
+        ERROR("Couldn't map tags partition (%s)", esp_err_to_name(err));
+        _ctx.part = NULL;
+        return -STATUS_IO;
+    }
+    _ctx.map = (const uint8_t *) map;
+    if (*bank >= TAG_IMAGE_BANKS)
+    {
+        *bank = 0;
+    }
+
+    // Only trust an image that is complete and intact. If the given bank has
+    // none (the bank number was lost with nvstate), the newest image in the
+    // other banks is used.
+    const tag_image_hdr_t *hdr = tag_image_valid(*bank);
+    if (hdr == NULL)
+    {
+        uint8_t found = *bank;
+        for (uint8_t i = 0; i < TAG_IMAGE_BANKS; i++)
+        {
+            const tag_image_hdr_t *other = i == *bank ? NULL : tag_image_valid(i);
+            if (other != NULL && (hdr == NULL || other->seq > hdr->seq))
+            {
+                hdr = other;
+                found = i;
+            }
+        }
+        if (hdr != NULL)
+        {
+            WARN("No tag image in bank %u, using bank %u", *bank, found);
+            *bank = found;
+        }
+    }
+    tag_image_attach(*bank, NULL);
+
+    // Find the end of the log. Torn entries are skipped over, their card
+    // can't be written again.
+    _ctx.log = (const tag_log_entry_t *) (_ctx.map + _ctx.log_base);
+    _ctx.log_len = 0;
+    _ctx.log_stale = false;
+    while (_ctx.log_len < TAG_IMAGE_LOG_SIZE / sizeof(tag_log_entry_t) &&
+        (_ctx.log[_ctx.log_len].card != TAG_IMAGE_LOG_ERASED || _ctx.log[_ctx.log_len].op != TAG_IMAGE_LOG_ERASED))
+    {
+        // A reset right after a switch leaves the old image's log behind
+        uint32_t op = _ctx.log[_ctx.log_len].op;
+        _ctx.log_stale |= op != TAG_IMAGE_LOG_ERASED && (op >> 8) != *bank;
+        _ctx.log_len++;
+    }
+
+    if (hdr == NULL)
+    {
+        WARN("No tag image stored");
+        tag_image_log_erase();
+        return -STATUS_NOFILE;
+    }
+
+    tag_image_attach(*bank, hdr);
+
+    // New images are numbered after every image in the partition, not just
+    // the current one. Only the headers are read, that's all the numbering
+    // needs.
+    for (uint8_t i = 0; i < TAG_IMAGE_BANKS; i++)
+    {
+        const tag_image_hdr_t *other = tag_image_hdr(i);
+        if (other->magic == TAG_IMAGE_MAGIC && other->version == TAG_IMAGE_VERSION && other->seq > _ctx.seq)
+        {
+            _ctx.seq = other->seq;
+        }
+    }
+
+    static const char *const names[] = { "sorted", "mphf", "packed" };
+    INFO("Tag image: %u cards (%s, %u bytes) in bank %u, room for %u", _ctx.view.count,
+        names[_ctx.view.format], hdr->size, *bank, _ctx.banks[*bank].size / sizeof(uint32_t));
+    return STATUS_OK;
+}
+
+void tag_image_view(tag_image_view_t *view)
+{
+    *view = _ctx.view;
+}
+
+bool tag_image_contains(const tag_image_view_t *view, uint32_t card)
+{
+    if (view->format == TAG_IMAGE_PACKED)
+    {
+        return tag_pack_contains(&view->pack, card);
+    }
+    if (view->format == TAG_IMAGE_MPHF)
+    {
+        // Every stored card has its own slot. Any other card also maps to
+        // some slot, and fails the comparison.
+        if (view->count == 0) { return false; }
+        uint32_t slot = tag_mphf_slot(&view->mphf, view->pilots, view->remap, tag_mphf_mix(card));
+        return view->cards[slot] == card;
+    }
+
+    const uint32_t *a = view->cards;
+    uint32_t n = view->count;
+
+    // Descend the implicit tree: node k has children 2k and 2k+1 (1-based).
+    // The comparison result picks the child, so there's no data-dependent
+    // branch, and the first few levels stay in cache between swipes.
+    uint32_t k = 1;
+    while (k <= n)
+    {
+        k = 2 * k + (a[k - 1] < card);
+    }
+
+    // The search ran past a leaf. Strip the trailing right turns (and the
+    // last left turn) to get back to the smallest element >= card.
+    k >>= __builtin_ffs(~k);
+    return k != 0 && a[k - 1] == card;
+}
+
+size_t tag_image_count(void)
+{
+    return _ctx.view.count;
+}
+
+void tag_image_foreach(const tag_image_view_t *view, tag_image_card_cb_t cb, void *ctx)
+{
+    if (view->format == TAG_IMAGE_PACKED)
+    {
+        tag_pack_foreach(&view->pack, cb, ctx);
+        return;
+    }
+
+    // The other layouts store each card exactly once, in the card array
+    for (size_t i = 0; i < view->count; i++)
+    {
+        cb(view->cards[i], ctx);
+    }
+}
+
+tag_image_format_t tag_image_format(void)
+{
+    return _ctx.view.format;
+}
+
+uint8_t tag_image_bank(void)
+{
+    return _ctx.bank;
+}
+
+status_t tag_image_begin(tag_image_format_t format)
+{
+    if (_ctx.part == NULL)
+    {
+        return -STATUS_UNAVAILABLE;
+    }
+
+    if (_ctx.building)
+    {
+        tag_image_abort();
+    }
+
+    _ctx.run_cap = format == TAG_IMAGE_PACKED ? TAG_IMAGE_PACK_RUN_LEN : TAG_IMAGE_RUN_LEN;
+    _ctx.buf = malloc(_ctx.run_cap * sizeof(uint32_t));
+    if (_ctx.buf == NULL)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    // The current image is left alone, it's still searched during the build.
+    // The banks after it are used, and their headers are cleared first so
+    // neither reads as an image until the build is complete.
+    _ctx.build_bank = (_ctx.bank + 1) % TAG_IMAGE_BANKS;
+    _ctx.data = &_ctx.banks[_ctx.build_bank];
+    _ctx.scratch = &_ctx.banks[(_ctx.bank + 2) % TAG_IMAGE_BANKS];
+    _ctx.runs = format == TAG_IMAGE_PACKED ? _ctx.scratch : _ctx.data;
+    if (esp_partition_erase_range(_ctx.part, _ctx.data->base - TAG_IMAGE_SECTOR, TAG_IMAGE_SECTOR) != ESP_OK ||
+        esp_partition_erase_range(_ctx.part, _ctx.scratch->base - TAG_IMAGE_SECTOR, TAG_IMAGE_SECTOR) != ESP_OK)
+    {
+        free(_ctx.buf);
+        _ctx.buf = NULL;
+        return -STATUS_IO;
+    }
+
+    _ctx.built = false;
+    _ctx.build_format = format;
+    _ctx.buf_len = 0;
+    _ctx.num_runs = 0;
+    _ctx.runs_size = 0;
+    _ctx.data->erased = 0;
+    _ctx.scratch->erased = 0;
+    _ctx.building = true;
+    return STATUS_OK;
+}
+
+status_t tag_image_add(uint32_t card)
+{
+    assert(_ctx.building);
+
+    // The hash is built over mixed cards, sorted in mixed order. Mixing is a
+    // bijection, so deduplicating mixed cards deduplicates the cards.
+    if (_ctx.build_format == TAG_IMAGE_MPHF)
+    {
+        card = tag_mphf_mix(card);
+    }
+
+    _ctx.buf[_ctx.buf_len++] = card;
+    if (_ctx.buf_len == _ctx.run_cap)
+    {
+        return tag_image_flush_run();
+    }
+    return STATUS_OK;
+}
+
+void tag_image_wide(const uint64_t *cards, size_t count)
+{
+    assert(_ctx.building);
+
+    _ctx.wide = cards;
+    _ctx.num_wide = count;
+}
+
+void tag_image_records(const tag_record_t *records, size_t count)
+{
+    assert(_ctx.building);
+
+    _ctx.records = records;
+    _ctx.num_records = count;
+}
+
+status_t tag_image_commit(uint8_t *bank)
+{
+    assert(_ctx.building);
+
+    size_t count = 0;
+    size_t size = 0;
+    uint32_t crc = 0;
+    tag_mphf_t mphf = { 0 };
+
+    // Sort what's left in RAM, merge all runs into one sorted list without
+    // duplicates, then lay that list out in search order. The packed layout
+    // is encoded as the runs are merged.
+    status_t status = tag_image_flush_run();
+    if (status == STATUS_OK && _ctx.build_format == TAG_IMAGE_PACKED)
+    {
+        status = tag_image_layout_packed(&count, &size, &crc);
+    }
+    else if (status == STATUS_OK)
+    {
+        status = tag_image_merge(&count);
+        if (status == STATUS_OK && _ctx.build_format == TAG_IMAGE_MPHF)
+        {
+            status = tag_image_layout_mphf(count, &mphf, &size, &crc);
+        }
+        else if (status == STATUS_OK)
+        {
+            status = tag_image_layout(count, &crc);
+            size = count * sizeof(uint32_t);
+        }
+    }
+    if (status == STATUS_OK)
+    {
+        status = tag_image_write_extra(_ctx.wide, _ctx.num_wide * sizeof(uint64_t), &size, &crc);
+    }
+    if (status == STATUS_OK)
+    {
+        status = tag_image_write_extra(_ctx.records, _ctx.num_records * sizeof(tag_record_t), &size, &crc);
+    }
+    if (status == STATUS_OK &&
+        esp_rom_crc32_le(0, _ctx.map + _ctx.data->base, size) != crc)
+    {
+        // Read it back before it can become the current image
+        ERROR("New tag image doesn't match what was written");
+        status = -STATUS_IO;
+    }
+    if (status == STATUS_OK)
+    {
+        tag_image_hdr_t hdr = {
+            .magic = TAG_IMAGE_MAGIC,
+            .version = TAG_IMAGE_VERSION,
+            .seq = _ctx.seq + 1,
+            .format = _ctx.build_format,
+            .count = count,
+            .size = size,
+            .crc = crc,
+            .mphf = mphf,
+            .wide = _ctx.num_wide,
+            .records = _ctx.num_records,
+        };
+        if (esp_partition_write(_ctx.part, _ctx.data->base - TAG_IMAGE_SECTOR, &hdr, sizeof(hdr)) != ESP_OK)
+        {
+            status = -STATUS_IO;
+        }
+    }
+
+    free(_ctx.buf);
+    _ctx.buf = NULL;
+    _ctx.building = false;
+    _ctx.wide = NULL;
+    _ctx.num_wide = 0;
+    _ctx.records = NULL;
+    _ctx.num_records = 0;
+
+    if (status == STATUS_OK)
+    {
+        _ctx.built = true;
+        *bank = _ctx.build_bank;
+    }
+    return status;
+}
+
+status_t tag_image_switch(void)
+{
+    if (!_ctx.built)
+    {
+        return -STATUS_UNAVAILABLE;
+    }
+
+    // Only RAM changes here. The log entries are for the old image, they're
+    // skipped from now on and erased before the next one is added.
+    const tag_image_hdr_t *hdr = tag_image_hdr(_ctx.build_bank);
+    tag_image_attach(_ctx.build_bank, hdr);
+    _ctx.log_stale = _ctx.log_len > 0;
+    _ctx.built = false;
+    return STATUS_OK;
+}
+
+void tag_image_abort(void)
+{
+    free(_ctx.buf);
+    _ctx.buf = NULL;
+    _ctx.building = false;
+    _ctx.built = false;
+    _ctx.wide = NULL;
+    _ctx.num_wide = 0;
+    _ctx.records = NULL;
+    _ctx.num_records = 0;
+}
+
+status_t tag_image_log_append(uint32_t card, tag_image_op_t op)
+{
+    if (_ctx.part == NULL || _ctx.building || _ctx.built)
+    {
+        return -STATUS_UNAVAILABLE;
+    }
+    if (_ctx.log_stale && tag_image_log_erase() != STATUS_OK)
+    {
+        return -STATUS_IO;
+    }
+    if (_ctx.log_len == TAG_IMAGE_LOG_SIZE / sizeof(tag_log_entry_t))
+    {
+        return -STATUS_NOMEM;
+    }
+
+    tag_log_entry_t entry = {
+        .card = card,
+        .op = op | ((uint32_t) _ctx.bank << 8),
+    };
+    esp_err_t err = esp_partition_write(_ctx.part, _ctx.log_base + _ctx.log_len * sizeof(entry), &entry, sizeof(entry));
+    if (err != ESP_OK)
+    {
+        return -STATUS_IO;
+    }
+
+    _ctx.log_len++;
+    return STATUS_OK;
+}
+
+void tag_image_log_replay(tag_image_log_cb_t cb, void *ctx)
+{
+    for (size_t i = 0; i < _ctx.log_len; i++)
+    {
+        uint32_t op = _ctx.log[i].op;
+        if ((op >> 8) != _ctx.bank)
+        {
+            continue;
+        }
+        op &= 0xFF;
+        if (op == TAG_IMAGE_LOG_ADD || op == TAG_IMAGE_LOG_REMOVE)
+        {
+            cb(_ctx.log[i].card, (tag_image_op_t) op, ctx);
+        }
+    }
+}
+
+// Private
+
+static status_t tag_image_flush_run(void)
+{
+    if (_ctx.buf_len == 0)
+    {
+        return STATUS_OK;
+    }
+    if (_ctx.num_runs == TAG_IMAGE_MAX_RUNS)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    // Duplicates are dropped within the run already, a compressed run can't
+    // hold a gap of 0
+    qsort(_ctx.buf, _ctx.buf_len, sizeof(uint32_t), card_cmp);
+    size_t len = 1;
+    for (size_t i = 1; i < _ctx.buf_len; i++)
+    {
+        if (_ctx.buf[i] != _ctx.buf[len - 1]) { _ctx.buf[len++] = _ctx.buf[i]; }
+    }
+
+    status_t status = STATUS_OK;
+    size_t base = _ctx.runs_size;
+    if (_ctx.build_format != TAG_IMAGE_PACKED)
+    {
+        // Runs are stored back to back, each one in a fixed-size slot
+        base = _ctx.num_runs * TAG_IMAGE_RUN_LEN * sizeof(uint32_t);
+        status = region_write(_ctx.runs, base, _ctx.buf, len * sizeof(uint32_t));
+        _ctx.runs_size = base + len * sizeof(uint32_t);
+    }
+    else
+    {
+        // As gaps, like the packed layout. The first card is a gap from -1,
+        // which is the card itself.
+        uint8_t out[256];
+        size_t used = 0;
+        uint32_t prev = UINT32_MAX;
+        for (size_t i = 0; i < len && status == STATUS_OK; i++)
+        {
+            used += tag_pack_gap(prev, _ctx.buf[i], &out[used]);
+            prev = _ctx.buf[i];
+            if (used > sizeof(out) - TAG_PACK_VARINT_MAX || i + 1 == len)
+            {
+                status = region_write(_ctx.runs, _ctx.runs_size, out, used);
+                _ctx.runs_size += used;
+                used = 0;
+            }
+        }
+    }
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+
+    _ctx.run_len[_ctx.num_runs] = len;
+    _ctx.run_base[_ctx.num_runs] = base;
+    _ctx.num_runs++;
+    _ctx.buf_len = 0;
+    return STATUS_OK;
+}
+
+static void tag_image_merge_start(void)
+{
+    for (size_t r = 0; r < _ctx.num_runs; r++)
+    {
+        _ctx.run_pos[r] = 0;
+        _ctx.run_off[r] = _ctx.run_base[r];
+        _ctx.run_head[r] = tag_image_run_read(r, UINT32_MAX);
+    }
+    _ctx.merged = 0;
+}
+
+static bool tag_image_merge_next(uint32_t *card)
+{
+    while (true)
+    {
+        // Find the smallest card at the head of any run. There are few runs,
+        // a linear scan is cheaper than keeping a heap.
+        int best = -1;
+        uint32_t best_card = 0;
+        for (size_t r = 0; r < _ctx.num_runs; r++)
+        {
+            if (_ctx.run_pos[r] < _ctx.run_len[r] && (best < 0 || _ctx.run_head[r] < best_card))
+            {
+                best = (int) r;
+                best_card = _ctx.run_head[r];
+            }
+        }
+        if (best < 0)
+        {
+            return false;
+        }
+        if (++_ctx.run_pos[best] < _ctx.run_len[best])
+        {
+            _ctx.run_head[best] = tag_image_run_read(best, best_card);
+        }
+
+        // Drop duplicates between runs
+        if (_ctx.merged > 0 && best_card == _ctx.merge_last)
+        {
+            continue;
+        }
+        _ctx.merge_last = best_card;
+        _ctx.merged++;
+        *card = best_card;
+        return true;
+    }
+}
+
+static uint32_t tag_image_run_read(size_t run, uint32_t prev)
+{
+    const uint8_t *start = _ctx.map + _ctx.runs->base;
+    const uint8_t *p = start + _ctx.run_off[run];
+    uint32_t card;
+    if (_ctx.build_format == TAG_IMAGE_PACKED)
+    {
+        card = tag_pack_card(prev, &p);
+    }
+    else
+    {
+        memcpy(&card, p, sizeof(card));
+        p += sizeof(card);
+    }
+    _ctx.run_off[run] = p - start;
+    return card;
+}
+
+static status_t tag_image_merge(size_t *count)
+{
+    uint32_t card;
+    size_t out = 0;
+
+    tag_image_merge_start();
+    while (tag_image_merge_next(&card))
+    {
+        _ctx.buf[out++] = card;
+        if (out == TAG_IMAGE_RUN_LEN)
+        {
+            status_t status = region_write(_ctx.scratch, (_ctx.merged - out) * sizeof(uint32_t), _ctx.buf, out * sizeof(uint32_t));
+            if (status != STATUS_OK) { return status; }
+            out = 0;
+        }
+    }
+
+    if (out > 0)
+    {
+        status_t status = region_write(_ctx.scratch, (_ctx.merged - out) * sizeof(uint32_t), _ctx.buf, out * sizeof(uint32_t));
+        if (status != STATUS_OK) { return status; }
+    }
+
+    *count = _ctx.merged;
+    return STATUS_OK;
+}
+
+static status_t tag_image_layout(size_t count, uint32_t *crc)
+{
+    const uint32_t *sorted = (const uint32_t *) (_ctx.map + _ctx.scratch->base);
+    size_t out = 0;
+
+    // The runs in the data region are merged, it can be rewritten. The array
+    // is produced in storage order so flash is written sequentially; each
+    // slot looks up which sorted card belongs there.
+    _ctx.data->erased = 0;
+    *crc = 0;
+    for (size_t k = 1; k <= count; k++)
+    {
+        _ctx.buf[out++] = sorted[eytz_rank(k, count)];
+        if (out == TAG_IMAGE_RUN_LEN || k == count)
+        {
+            size_t bytes = out * sizeof(uint32_t);
+            status_t status = region_write(_ctx.data, (k - out) * sizeof(uint32_t), _ctx.buf, bytes);
+            if (status != STATUS_OK) { return status; }
+            *crc = esp_rom_crc32_le(*crc, (const uint8_t *) _ctx.buf, bytes);
+            out = 0;
+        }
+    }
+    return STATUS_OK;
+}
+
+static status_t tag_image_layout_mphf(size_t count, tag_mphf_t *mphf, size_t *size, uint32_t *crc)
+{
+    const uint32_t *sorted = (const uint32_t *) (_ctx.map + _ctx.scratch->base);
+
+    // The build reads the merged keys straight out of flash. Its RAM is the
+    // pilots plus a bitmap of the table, a few bits per card.
+    tag_mphf_build_t build;
+    status_t status = tag_mphf_build(sorted, count, &build);
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+
+    size_t pilot_bytes = mphf_pilot_bytes(&build.params);
+    size_t remap_bytes = (build.params.table_size - count) * sizeof(uint32_t);
+    *size = pilot_bytes + remap_bytes + count * sizeof(uint32_t);
+    *mphf = build.params;
+    *crc = 0;
+
+    uint32_t *window = NULL;
+    if (*size > _ctx.data->size)
+    {
+        status = -STATUS_NOMEM;
+    }
+    else
+    {
+        window = malloc(TAG_IMAGE_WINDOW_LEN * sizeof(uint32_t));
+        if (window == NULL) { status = -STATUS_NOMEM; }
+    }
+
+    // Pilots, padded to a word, then the remap table
+    uint16_t pad = 0;
+    _ctx.data->erased = 0;
+    if (status == STATUS_OK)
+    {
+        status = region_write(_ctx.data, 0, build.pilots, build.params.num_buckets * sizeof(uint16_t));
+        *crc = esp_rom_crc32_le(*crc, (const uint8_t *) build.pilots, build.params.num_buckets * sizeof(uint16_t));
+    }
+    if (status == STATUS_OK && build.params.num_buckets & 1)
+    {
+        status = region_write(_ctx.data, pilot_bytes - sizeof(pad), &pad, sizeof(pad));
+        *crc = esp_rom_crc32_le(*crc, (const uint8_t *) &pad, sizeof(pad));
+    }
+    if (status == STATUS_OK)
+    {
+        status = region_write(_ctx.data, pilot_bytes, build.remap, remap_bytes);
+        *crc = esp_rom_crc32_le(*crc, (const uint8_t *) build.remap, remap_bytes);
+    }
+
+    // Then the slots. Each pass over the keys collects the ones that land in
+    // the next window of slots, so flash is still written in order.
+    size_t slots_offset = pilot_bytes + remap_bytes;
+    for (size_t base = 0; status == STATUS_OK && base < count; base += TAG_IMAGE_WINDOW_LEN)
+    {
+        size_t len = count - base < TAG_IMAGE_WINDOW_LEN ? count - base : TAG_IMAGE_WINDOW_LEN;
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t slot = tag_mphf_slot(&build.params, build.pilots, build.remap, sorted[i]);
+            if (slot - base < len)
+            {
+                window[slot - base] = tag_mphf_unmix(sorted[i]);
+            }
+        }
+
+        size_t bytes = len * sizeof(uint32_t);
+        status = region_write(_ctx.data, slots_offset + base * sizeof(uint32_t), window, bytes);
+        *crc = esp_rom_crc32_le(*crc, (const uint8_t *) window, bytes);
+    }
+
+    free(window);
+    tag_mphf_build_free(&build);
+    return status;
+}
+
+static status_t tag_image_layout_packed(size_t *count, size_t *size, uint32_t *crc)
+{
+    // There's no uncompressed copy of the list, the runs are merged once per
+    // pass instead: to count the cards, to build the skip index, which comes
+    // first and needs to know where every block starts, and to write the gaps.
+    uint32_t card;
+    tag_image_merge_start();
+    while (tag_image_merge_next(&card)) {}
+    *count = _ctx.merged;
+
+    size_t num_blocks = tag_pack_blocks(*count);
+    size_t skip_bytes = num_blocks * sizeof(tag_pack_skip_t);
+    tag_pack_skip_t *skips = (tag_pack_skip_t *) _ctx.buf;
+    size_t skips_per_buf = TAG_IMAGE_RUN_LEN * sizeof(uint32_t) / sizeof(tag_pack_skip_t);
+    size_t out = 0;
+    uint32_t offset = 0;
+    uint32_t prev = 0;
+    _ctx.data->erased = 0;
+    *crc = 0;
+    tag_image_merge_start();
+    for (size_t i = 0; tag_image_merge_next(&card); prev = card, i++)
+    {
+        if (i % TAG_PACK_BLOCK_LEN != 0)
+        {
+            offset += tag_pack_gap(prev, card, NULL);
+            continue;
+        }
+
+        size_t block = i / TAG_PACK_BLOCK_LEN;
+        skips[out].first = card;
+        skips[out].offset = offset;
+        out++;
+        if (out == skips_per_buf || block + 1 == num_blocks)
+        {
+            size_t bytes = out * sizeof(tag_pack_skip_t);
+            status_t status = region_write(_ctx.data, (block + 1 - out) * sizeof(tag_pack_skip_t), skips, bytes);
+            if (status != STATUS_OK) { return status; }
+            *crc = esp_rom_crc32_le(*crc, (const uint8_t *) skips, bytes);
+            out = 0;
+        }
+    }
+
+    *size = skip_bytes + offset;
+    if (*size > _ctx.data->size)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    // Then the gaps of all blocks, back to back. The first card of a block
+    // is in the skip index, so it has no gap.
+    uint8_t *gaps = (uint8_t *) _ctx.buf;
+    size_t gaps_per_buf = TAG_IMAGE_RUN_LEN * sizeof(uint32_t);
+    size_t written = 0;
+    tag_image_merge_start();
+    for (size_t i = 0; tag_image_merge_next(&card); prev = card, i++)
+    {
+        if (i % TAG_PACK_BLOCK_LEN != 0)
+        {
+            out += tag_pack_gap(prev, card, &gaps[out]);
+        }
+        if (out > gaps_per_buf - TAG_PACK_VARINT_MAX || (i + 1 == *count && out > 0))
+        {
+            status_t status = region_write(_ctx.data, skip_bytes + written, gaps, out);
+            if (status != STATUS_OK) { return status; }
+            *crc = esp_rom_crc32_le(*crc, gaps, out);
+            written += out;
+            out = 0;
+        }
+    }
+    return STATUS_OK;
+}
+
+static status_t tag_image_write_extra(const void *data, size_t bytes, size_t *size, uint32_t *crc)
+{
+    if (bytes == 0)
+    {
+        return STATUS_OK;
+    }
+
+    // 64-bit aligned after the cards. The padding is written too, so it's
+    // covered by the CRC like the rest.
+    static const uint8_t pad[sizeof(uint64_t)] = { 0 };
+    size_t pad_len = (sizeof(uint64_t) - (*size % sizeof(uint64_t))) % sizeof(uint64_t);
+    status_t status = STATUS_OK;
+    if (pad_len > 0)
+    {
+        status = region_write(_ctx.data, *size, pad, pad_len);
+        *crc = esp_rom_crc32_le(*crc, pad, pad_len);
+        *size += pad_len;
+    }
+
+    if (status == STATUS_OK) { status = region_write(_ctx.data, *size, data, bytes); }
+    *crc = esp_rom_crc32_le(*crc, (const uint8_t *) data, bytes);
+    *size += bytes;
+    return status;
+}
+
+static void tag_image_attach(uint8_t bank, const tag_image_hdr_t *hdr)
+{
+    const uint8_t *data = _ctx.map + _ctx.banks[bank].base;
+    tag_image_format_t format = hdr == NULL ? TAG_IMAGE_SORTED : hdr->format;
+    size_t count = hdr == NULL ? 0 : hdr->count;
+    const tag_mphf_t *mphf = hdr == NULL ? NULL : &hdr->mphf;
+
+    // Records are last and the wide cards before them, so they're found from
+    // the end
+    _ctx.view.num_records = hdr == NULL ? 0 : hdr->records;
+    _ctx.view.records = hdr == NULL ? NULL :
+        (const tag_record_t *) (data + hdr->size - hdr->records * sizeof(tag_record_t));
+    _ctx.view.num_wide = hdr == NULL ? 0 : hdr->wide;
+    _ctx.view.wide = hdr == NULL ? NULL :
+        (const uint64_t *) ((const uint8_t *) _ctx.view.records - hdr->wide * sizeof(uint64_t));
+
+    _ctx.bank = bank;
+    _ctx.seq = hdr == NULL ? 0 : hdr->seq;
+    _ctx.view.format = format;
+    _ctx.view.count = count;
+    _ctx.view.cards = (const uint32_t *) data;
+    if (format == TAG_IMAGE_MPHF)
+    {
+        size_t pilot_bytes = mphf_pilot_bytes(mphf);
+        size_t remap_bytes = (mphf->table_size - mphf->num_keys) * sizeof(uint32_t);
+        _ctx.view.mphf = *mphf;
+        _ctx.view.pilots = (const uint16_t *) data;
+        _ctx.view.remap = (const uint32_t *) (data + pilot_bytes);
+        _ctx.view.cards = (const uint32_t *) (data + pilot_bytes + remap_bytes);
+    }
+    if (format == TAG_IMAGE_PACKED)
+    {
+        _ctx.view.pack.skips = (const tag_pack_skip_t *) data;
+        _ctx.view.pack.gaps = data + tag_pack_blocks(count) * sizeof(tag_pack_skip_t);
+        _ctx.view.pack.count = count;
+    }
+}
+
+static const tag_image_hdr_t *tag_image_hdr(uint8_t bank)
+{
+    return (const tag_image_hdr_t *) (_ctx.map + _ctx.banks[bank].base - TAG_IMAGE_SECTOR);
+}
+
+static const tag_image_hdr_t *tag_image_valid(uint8_t bank)
+{
+    const tag_image_hdr_t *hdr = tag_image_hdr(bank);
+    if (hdr->magic != TAG_IMAGE_MAGIC)
+    {
+        return NULL;
+    }
+    if (hdr->version != TAG_IMAGE_VERSION)
+    {
+        WARN("Tag image in bank %u is version %lu, not %u", bank, hdr->version, TAG_IMAGE_VERSION);
+        return NULL;
+    }
+    if (hdr->size > _ctx.banks[bank].size ||
+        hdr->records > hdr->size / sizeof(tag_record_t) || hdr->wide > hdr->size / sizeof(uint64_t) ||
+        hdr->records * sizeof(tag_record_t) + hdr->wide * sizeof(uint64_t) > hdr->size ||
+        hdr->format > TAG_IMAGE_PACKED)
+    {
+        ERROR("Tag image header in bank %u is corrupt", bank);
+        return NULL;
+    }
+    if (esp_rom_crc32_le(0, _ctx.map + _ctx.banks[bank].base, hdr->size) != hdr->crc)
+    {
+        ERROR("Tag image in bank %u is corrupt", bank);
+        return NULL;
+    }
+    return hdr;
+}
+
+static status_t tag_image_log_erase(void)
+{
+    _ctx.log_stale = false;
+    if (_ctx.log_len == 0)
+    {
+        return STATUS_OK;
+    }
+
+    _ctx.log_len = 0;
+    esp_err_t err = esp_partition_erase_range(_ctx.part, _ctx.log_base, TAG_IMAGE_LOG_SIZE);
+    return err == ESP_OK ? STATUS_OK : -STATUS_IO;
+}
+
+static size_t mphf_pilot_bytes(const tag_mphf_t *mphf)
+{
+    // Keep the arrays after the pilots word aligned
+    return (mphf->num_buckets * sizeof(uint16_t) + 3) & ~3U;
+}
+
+static status_t region_write(tag_region_t *region, size_t offset, const void *data, size_t len)
+{
+    if (offset + len > region->size)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    // Writes are sequential, so erase just enough ahead of them
+    if (offset + len > region->erased)
+    {
+        size_t end = (offset + len + TAG_IMAGE_SECTOR - 1) & ~(TAG_IMAGE_SECTOR - 1);
+        esp_err_t err = esp_partition_erase_range(_ctx.part, region->base + region->erased, end - region->erased);
+        if (err != ESP_OK) { return -STATUS_IO; }
+        region->erased = end;
+    }
+
+    esp_err_t err = esp_partition_write(_ctx.part, region->base + offset, data, len);
+    return err == ESP_OK ? STATUS_OK : -STATUS_IO;
+}
+
+static size_t eytz_subtree(size_t node, size_t n)
+{
+    // Count the nodes under node, one tree level at a time
+    size_t size = 0;
+    size_t lo = node;
+    size_t hi = node;
+    while (lo <= n)
+    {
+        size += (hi < n ? hi : n) - lo + 1;
+        lo = 2 * lo;
+        hi = 2 * hi + 1;
+    }
+    return size;
+}
+
+static size_t eytz_rank(size_t node, size_t n)
+{
+    // Position of node in sorted order: everything in its left subtree, plus
+    // every ancestor it is right of (and that ancestor's left subtree).
+    size_t rank = eytz_subtree(2 * node, n);
+    for (; node > 1; node /= 2)
+    {
+        if (node & 1)
+        {
+            rank += eytz_subtree(node - 1, n) + 1;
+        }
+    }
+    return rank;
+}
+
+static int card_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,219 @@
+#ifndef TAG_IMAGE_H_
+#define TAG_IMAGE_H_
+
+#include "status.h"
+#include "tag_mphf.h"
+#include "tag_pack.h"
+#include "tag_record.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Flash-resident authorized card list. The cards live in their own raw data
+// partition as a sorted array in Eytzinger (breadth-first binary tree) order,
+// and the partition is memory mapped so a lookup is a cache-friendly binary
+// search straight out of flash: no file system, no parsing and no heap.
+//
+// The image is rebuilt from scratch on every sync:
+//   tag_image_begin() -> tag_image_add() for each card -> tag_image_commit()
+//   -> tag_image_switch()
+// Records of the cards that have attributes can be stored with the image, with
+// tag_image_records() before the commit, and cards too long for 32 bits with
+// tag_image_wide() (see tag_wide.h). The layouts below only hold 32-bit cards.
+// Cards can be added in any order, duplicates are dropped. The new image is
+// built in another bank of the partition, so the current one is searched
+// until the switch. Which bank is current is kept by the caller: it's passed
+// to tag_image_init(), and should be stored before tag_image_switch().
+//
+// The partition is left alone by OTA updates and by the file system image
+// flashed with the firmware, so the list outlives both and is searchable as
+// soon as the partition is mapped at boot. Each image has a versioned header,
+// an image of an older layout is ignored rather than misread. Images are
+// numbered as they're built, so the newest one is still found if the bank
+// number is lost.
+//
+// Three layouts are supported, picked when the image is built:
+//   TAG_IMAGE_SORTED: the Eytzinger array, log2(n) reads per lookup. A bank
+//                     holds about 85k cards.
+//   TAG_IMAGE_MPHF:   a minimal perfect hash (tag_mphf.h) over the cards plus
+//                     the card stored in each slot. A lookup reads one pilot
+//                     and one slot, however long the list is. The slots hold
+//                     whole cards, a door can't take a fingerprint's false
+//                     positives, and the hash adds ~3.7 bits per card: a
+//                     bank holds about 76k cards.
+//   TAG_IMAGE_PACKED: the sorted cards compressed in blocks (tag_pack.h),
+//                     usually 1-3 bytes per card instead of 4. A lookup
+//                     searches the block index and decodes one block, so it
+//                     touches a fraction of the flash cache lines. It's
+//                     built without an uncompressed copy of the list, so
+//                     a bank holds more cards than the sorted array: about
+//                     108k random 32-bit cards, and several times that for
+//                     cards handed out in batches.
+//
+// Small changes between rebuilds are recorded in an append-only log next to
+// the image. The log isn't applied to the image: the caller replays it at
+// boot and keeps the changes in RAM. Switching to a new image clears the log.
+
+typedef enum {
+    TAG_IMAGE_SORTED = 0,
+    TAG_IMAGE_MPHF,
+    TAG_IMAGE_PACKED,
+} tag_image_format_t;
+
+typedef enum {
+    TAG_IMAGE_LOG_ADD = 1,
+    TAG_IMAGE_LOG_REMOVE,
+} tag_image_op_t;
+
+typedef void (*tag_image_log_cb_t)(uint32_t card, tag_image_op_t op, void *ctx);
+typedef void (*tag_image_card_cb_t)(uint32_t card, void *ctx);
+
+// What a lookup needs to search an image. A copy stays usable after a switch
+// to a newer image, until the next tag_image_begin() reuses its bank.
+typedef struct {
+    tag_image_format_t format;
+    const uint32_t *cards;  // Card array, in Eytzinger or slot order
+                            // (not used by TAG_IMAGE_PACKED)
+    size_t count;           // Number of cards in the array
+    tag_mphf_t mphf;        // TAG_IMAGE_MPHF only
+    const uint16_t *pilots;
+    const uint32_t *remap;
+    tag_pack_t pack;        // TAG_IMAGE_PACKED only
+    const uint64_t *wide;   // Sorted, for tag_wide_contains()
+    size_t num_wide;
+    const tag_record_t *records; // Sorted by card, for tag_record_find()
+    size_t num_records;
+} tag_image_view_t;
+
+/**
+ * @brief Find and map the tags partition, and validate the stored image
+ * @param bank bank holding the current image. If it has no valid image, set
+ * to the bank of the newest valid image, which should be stored.
+ * @return -STATUS_UNAVAILABLE: the partition table has no tags partition
+ *         -STATUS_IO: couldn't map the partition
+ *          STATUS_OK: successful. The stored image may still be empty.
+ */
+status_t tag_image_init(uint8_t *bank);
+
+/**
+ * @brief Get the current image, for searching without further calls into
+ * this module
+ * @param view filled in with the current image
+ */
+void tag_image_view(tag_image_view_t *view);
+
+/**
+ * @brief Check if a card is in an image
+ * @param view image to search
+ * @param card card number
+ * @return true if the card is present, false otherwise
+ */
+bool tag_image_contains(const tag_image_view_t *view, uint32_t card);
+
+/**
+ * @brief Number of cards in the current image
+ * @return card count, 0 if the image is empty or invalid
+ */
+size_t tag_image_count(void);
+
+/**
+ * @brief Go through every card in an image, in storage order. The log isn't
+ * applied.
+ * @param view image to walk
+ * @param cb called for each card
+ * @param ctx passed to cb
+ */
+void tag_image_foreach(const tag_image_view_t *view, tag_image_card_cb_t cb, void *ctx);
+
+/**
+ * @brief Layout of the current image
+ * @return image format
+ */
+tag_image_format_t tag_image_format(void);
+
+/**
+ * @brief Bank of the current image
+ * @return bank number
+ */
+uint8_t tag_image_bank(void);
+
+/**
+ * @brief Start building a new image. The current image is unaffected.
+ * @param format layout of the new image
+ * @return -STATUS_UNAVAILABLE: no tags partition
+ *         -STATUS_NOMEM: couldn't allocate the build buffer
+ *         -STATUS_IO: flash error
+ *          STATUS_OK: successful
+ */
+status_t tag_image_begin(tag_image_format_t format);
+
+/**
+ * @brief Add a card to the image being built
+ * @param card card number
+ * @return -STATUS_NOMEM: the partition can't hold any more cards
+ *         -STATUS_IO: flash error
+ *          STATUS_OK: successful
+ */
+status_t tag_image_add(uint32_t card);
+
+/**
+ * @brief Give the wide cards to store with the image being built
+ * @param cards sorted by tag_wide_sort(). Read by tag_image_commit(), so they
+ * must stay valid until then.
+ * @param count number of cards
+ */
+void tag_image_wide(const uint64_t *cards, size_t count);
+
+/**
+ * @brief Give the records to store with the image being built
+ * @param records sorted by tag_record_sort(). Read by tag_image_commit(), so
+ * they must stay valid until then.
+ * @param count number of records
+ */
+void tag_image_records(const tag_record_t *records, size_t count);
+
+/**
+ * @brief Finish the image being built and check it was written correctly.
+ * It doesn't become the current image until tag_image_switch().
+ * @param bank bank the new image is in
+ * @return -STATUS_NOMEM: the partition (or RAM, for the hash build) can't
+ *                        hold the image
+ *         -STATUS_INVAL: no perfect hash found for the cards
+ *         -STATUS_IO: flash error, or the image didn't read back
+ *          STATUS_OK: successful
+ */
+status_t tag_image_commit(uint8_t *bank);
+
+/**
+ * @brief Make the committed image the current image. This only updates RAM,
+ * lookups can be locked out around it cheaply. The log starts over.
+ * @return -STATUS_UNAVAILABLE: no image was committed
+ *          STATUS_OK: successful
+ */
+status_t tag_image_switch(void);
+
+/**
+ * @brief Abandon the image being built, or committed but not switched to.
+ * The current image is unaffected.
+ */
+void tag_image_abort(void);
+
+/**
+ * @brief Record a change to the current image in the log
+ * @param card card number
+ * @param op change
+ * @return -STATUS_UNAVAILABLE: no tags partition, or a new image is being built
+ *         -STATUS_NOMEM: the log is full, the image must be rebuilt
+ *         -STATUS_IO: flash error
+ *          STATUS_OK: successful
+ */
+status_t tag_image_log_append(uint32_t card, tag_image_op_t op);
+
+/**
+ * @brief Go through the changes recorded since the image was built
+ * @param cb called for each change, oldest first
+ * @param ctx passed to cb
+ */
+void tag_image_log_replay(tag_image_log_cb_t cb, void *ctx);
+
+#endif /*TAG_IMAGE_H_*/
@@ -0,0 +1,250 @@
+#include "tag_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Marks an unused slot. A real card with this number is tracked separately.
+#define TAG_INDEX_EMPTY     0U
+
+// Smallest table allocated
+#define TAG_INDEX_MIN_BITS  4
+
+// Keep the table at most 3/4 full, probe sequences stay short below this
+#define TAG_INDEX_FULL(cap) (((cap) * 3U) / 4U)
+
+// Helpers
+static status_t tag_index_alloc(tag_index_t *index, int bits);
+static status_t tag_index_grow(tag_index_t *index);
+static void tag_index_insert(tag_index_t *index, uint32_t card);
+static inline size_t tag_index_hash(const tag_index_t *index, uint32_t card);
+
+status_t tag_index_init(tag_index_t *index, size_t expected)
+{
+    assert(index);
+
+    // Pick the smallest power-of-2 table that fits the expected cards
+    int bits = TAG_INDEX_MIN_BITS;
+    while (bits < 31 && TAG_INDEX_FULL((size_t) 1 << bits) < expected)
+    {
+        bits++;
+    }
+
+    index->count = 0;
+    index->has_empty = false;
+    return tag_index_alloc(index, bits);
+}
+
+status_t tag_index_add(tag_index_t *index, uint32_t card)
+{
+    assert(index);
+
+    if (card == TAG_INDEX_EMPTY)
+    {
+        index->has_empty = true;
+        return STATUS_OK;
+    }
+
+    if (index->count + 1 > TAG_INDEX_FULL(index->capacity))
+    {
+        status_t status = tag_index_grow(index);
+        if (status != STATUS_OK) { return status; }
+    }
+
+    tag_index_insert(index, card);
+    return STATUS_OK;
+}
+
+void tag_index_remove(tag_index_t *index, uint32_t card)
+{
+    assert(index);
+
+    if (card == TAG_INDEX_EMPTY)
+    {
+        index->has_empty = false;
+        return;
+    }
+
+    if (index->slots == NULL)
+    {
+        return;
+    }
+
+    size_t mask = index->capacity - 1;
+    size_t i = tag_index_hash(index, card);
+    while (index->slots[i] != card)
+    {
+        if (index->slots[i] == TAG_INDEX_EMPTY)
+        {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    // Lookups stop at the first empty slot, so a hole can't be left in the
+    // middle of a probe sequence. Pull later cards back into it, unless their
+    // home slot lies between the hole and where they are now.
+    size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (index->slots[j] == TAG_INDEX_EMPTY)
+        {
+            break;
+        }
+
+        size_t home = tag_index_hash(index, index->slots[j]);
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+
+    index->slots[i] = TAG_INDEX_EMPTY;
+    index->count--;
+}
+
+bool tag_index_contains(const tag_index_t *index, uint32_t card)
+{
+    assert(index);
+
+    if (card == TAG_INDEX_EMPTY)
+    {
+        return index->has_empty;
+    }
+
+    if (index->slots == NULL)
+    {
+        return false;
+    }
+
+    // Walk the probe sequence until the card or an empty slot is found. The
+    // table is never full, so this always terminates.
+    size_t mask = index->capacity - 1;
+    size_t i = tag_index_hash(index, card);
+    while (index->slots[i] != TAG_INDEX_EMPTY)
+    {
+        if (index->slots[i] == card)
+        {
+            return true;
+        }
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+status_t tag_index_copy(tag_index_t *dst, const tag_index_t *src)
+{
+    assert(dst && src);
+
+    // Same table size, so the cards keep their slots
+    uint32_t *slots = malloc(src->capacity * sizeof(uint32_t));
+    if (slots == NULL && src->capacity > 0)
+    {
+        return -STATUS_NOMEM;
+    }
+    memcpy(slots, src->slots, src->capacity * sizeof(uint32_t));
+
+    free(dst->slots);
+    *dst = *src;
+    dst->slots = slots;
+    return STATUS_OK;
+}
+
+void tag_index_foreach(const tag_index_t *index, tag_index_cb_t cb, void *ctx)
+{
+    assert(index);
+
+    if (index->has_empty)
+    {
+        cb(TAG_INDEX_EMPTY, ctx);
+    }
+    for (size_t i = 0; i < index->capacity; i++)
+    {
+        if (index->slots[i] != TAG_INDEX_EMPTY)
+        {
+            cb(index->slots[i], ctx);
+        }
+    }
+}
+
+void tag_index_free(tag_index_t *index)
+{
+    assert(index);
+
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+    index->has_empty = false;
+}
+
+// Private
+
+static status_t tag_index_alloc(tag_index_t *index, int bits)
+{
+    index->slots = calloc((size_t) 1 << bits, sizeof(uint32_t));
+    if (index->slots == NULL)
+    {
+        index->capacity = 0;
+        return -STATUS_NOMEM;
+    }
+
+    index->capacity = (size_t) 1 << bits;
+    index->shift = 32 - bits;
+    return STATUS_OK;
+}
+
+static status_t tag_index_grow(tag_index_t *index)
+{
+    uint32_t *old_slots = index->slots;
+    size_t old_capacity = index->capacity;
+
+    status_t status = tag_index_alloc(index, 32 - index->shift + 1);
+    if (status != STATUS_OK)
+    {
+        // Leave the existing table untouched
+        index->slots = old_slots;
+        index->capacity = old_capacity;
+        return status;
+    }
+
+    // Re-insert everything into the bigger table
+    index->count = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i] != TAG_INDEX_EMPTY)
+        {
+            tag_index_insert(index, old_slots[i]);
+        }
+    }
+
+    free(old_slots);
+    return STATUS_OK;
+}
+
+static void tag_index_insert(tag_index_t *index, uint32_t card)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = tag_index_hash(index, card);
+    while (index->slots[i] != TAG_INDEX_EMPTY)
+    {
+        if (index->slots[i] == card)
+        {
+            // Already present
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    index->slots[i] = card;
+    index->count++;
+}
+
+static inline size_t tag_index_hash(const tag_index_t *index, uint32_t card)
+{
+    // Fibonacci hashing: the top bits of the product are well mixed even when
+    // card numbers only differ in their low bits (same facility code).
+    return (size_t) ((card * 2654435769U) >> index->shift);
+}
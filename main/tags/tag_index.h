@@ -0,0 +1,82 @@
+#ifndef TAG_INDEX_H_
+#define TAG_INDEX_H_
+
+#include "status.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// In-RAM set of authorized card numbers. This is an open-addressing hash
+// table with linear probing, so a lookup is a multiply, a shift and (almost
+// always) a single slot comparison.
+typedef struct {
+    uint32_t *slots;    // Hash table, TAG_INDEX_EMPTY marks an unused slot
+    size_t capacity;    // Number of slots, always a power of 2
+    size_t count;       // Number of cards held in slots
+    int shift;          // 32 - log2(capacity), used by the hash
+    bool has_empty;     // The card number used as the empty marker is in the set
+} tag_index_t;
+
+typedef void (*tag_index_cb_t)(uint32_t card, void *ctx);
+
+/**
+ * @brief Initialize an empty index
+ * @param index index to initialize
+ * @param expected number of cards expected to be added. The index grows past
+ * this if needed, but sizing it right avoids rehashing.
+ * @return -STATUS_NOMEM: couldn't allocate the table
+ *          STATUS_OK: successful
+ */
+status_t tag_index_init(tag_index_t *index, size_t expected);
+
+/**
+ * @brief Add a card to the index. Adding a card that is already present does
+ * nothing.
+ * @param index index to add to
+ * @param card card number
+ * @return -STATUS_NOMEM: couldn't grow the table
+ *          STATUS_OK: successful
+ */
+status_t tag_index_add(tag_index_t *index, uint32_t card);
+
+/**
+ * @brief Remove a card from the index. Removing a card that isn't present does
+ * nothing.
+ * @param index index to remove from
+ * @param card card number
+ */
+void tag_index_remove(tag_index_t *index, uint32_t card);
+
+/**
+ * @brief Check if a card is in the index
+ * @param index index to search
+ * @param card card number
+ * @return true if the card is present, false otherwise
+ */
+bool tag_index_contains(const tag_index_t *index, uint32_t card);
+
+/**
+ * @brief Make dst hold the same cards as src. Whatever dst held before is
+ * released.
+ * @param dst index to overwrite, initialized or zeroed
+ * @param src index to copy
+ * @return -STATUS_NOMEM: couldn't allocate the table, dst is unchanged
+ *          STATUS_OK: successful
+ */
+status_t tag_index_copy(tag_index_t *dst, const tag_index_t *src);
+
+/**
+ * @brief Go through every card in the index, in no particular order
+ * @param index index to walk
+ * @param cb called for each card
+ * @param ctx passed to cb
+ */
+void tag_index_foreach(const tag_index_t *index, tag_index_cb_t cb, void *ctx);
+
+/**
+ * @brief Release the memory held by the index. The index is left empty.
+ * @param index index to free
+ */
+void tag_index_free(tag_index_t *index);
+
+#endif /*TAG_INDEX_H_*/
@@ -0,0 +1,206 @@
+#include "tag_mphf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Average keys per bucket. Fewer buckets means fewer pilot bits per key, but
+// bigger buckets that are harder to place.
+#define MPHF_BUCKET_KEYS    5U
+
+// The build searches a table slightly bigger than n, so the last buckets
+// still find free slots quickly. Keys that land past n are remapped.
+#define MPHF_SLACK_SHIFT    6U  // table_size = n + n/64 + 1
+
+// Largest bucket and pilot that can be stored
+#define MPHF_MAX_BUCKET     255U
+#define MPHF_MAX_PILOT      UINT16_MAX
+
+// Seeds tried before giving up
+#define MPHF_MAX_SEEDS      16U
+
+// Helpers
+static bool mphf_try_seed(tag_mphf_build_t *build, const uint32_t *mixed, const uint8_t *sizes, uint8_t max_size, uint32_t *taken);
+static void mphf_remap(tag_mphf_build_t *build, const uint32_t *taken);
+static inline uint32_t mphf_bucket(const tag_mphf_t *mphf, uint32_t mixed);
+static inline uint32_t mphf_pos(const tag_mphf_t *mphf, uint32_t mixed, uint16_t pilot);
+
+#define BIT_GET(map, i) (((map)[(i) >> 5] >> ((i) & 31)) & 1U)
+#define BIT_SET(map, i) ((map)[(i) >> 5] |= 1U << ((i) & 31))
+
+status_t tag_mphf_build(const uint32_t *mixed, size_t n, tag_mphf_build_t *build)
+{
+    memset(build, 0, sizeof(tag_mphf_build_t));
+
+    tag_mphf_t *p = &build->params;
+    p->num_keys = n;
+    p->num_buckets = (n + MPHF_BUCKET_KEYS - 1) / MPHF_BUCKET_KEYS;
+    p->table_size = n + (n >> MPHF_SLACK_SHIFT) + 1;
+    if (p->num_buckets == 0) { p->num_buckets = 1; }
+
+    uint8_t *sizes = calloc(p->num_buckets, sizeof(uint8_t));
+    uint32_t *taken = malloc(((p->table_size + 31) / 32) * sizeof(uint32_t));
+    build->pilots = malloc(p->num_buckets * sizeof(uint16_t));
+    build->remap = malloc((p->table_size - n) * sizeof(uint32_t));
+    if (sizes == NULL || taken == NULL || build->pilots == NULL || build->remap == NULL)
+    {
+        free(sizes);
+        free(taken);
+        tag_mphf_build_free(build);
+        return -STATUS_NOMEM;
+    }
+
+    // Bucket sizes don't depend on the seed. Keys are sorted, so each
+    // bucket's keys are contiguous.
+    uint8_t max_size = 0;
+    status_t status = STATUS_OK;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i > 0 && mixed[i] <= mixed[i - 1])
+        {
+            status = -STATUS_INVAL;
+            break;
+        }
+        uint32_t b = mphf_bucket(p, mixed[i]);
+        if (sizes[b] == MPHF_MAX_BUCKET)
+        {
+            status = -STATUS_INVAL;
+            break;
+        }
+        sizes[b]++;
+        if (sizes[b] > max_size) { max_size = sizes[b]; }
+    }
+
+    if (status == STATUS_OK)
+    {
+        status = -STATUS_INVAL;
+        for (uint32_t seed = 0; seed < MPHF_MAX_SEEDS; seed++)
+        {
+            p->seed = seed;
+            if (mphf_try_seed(build, mixed, sizes, max_size, taken))
+            {
+                mphf_remap(build, taken);
+                status = STATUS_OK;
+                break;
+            }
+        }
+    }
+
+    free(sizes);
+    free(taken);
+    if (status != STATUS_OK)
+    {
+        tag_mphf_build_free(build);
+    }
+    return status;
+}
+
+void tag_mphf_build_free(tag_mphf_build_t *build)
+{
+    free(build->pilots);
+    free(build->remap);
+    build->pilots = NULL;
+    build->remap = NULL;
+}
+
+uint32_t tag_mphf_slot(const tag_mphf_t *mphf, const uint16_t *pilots, const uint32_t *remap, uint32_t mixed)
+{
+    uint32_t pos = mphf_pos(mphf, mixed, pilots[mphf_bucket(mphf, mixed)]);
+    return pos < mphf->num_keys ? pos : remap[pos - mphf->num_keys];
+}
+
+// Private
+
+static bool mphf_try_seed(tag_mphf_build_t *build, const uint32_t *mixed, const uint8_t *sizes, uint8_t max_size, uint32_t *taken)
+{
+    const tag_mphf_t *p = &build->params;
+    uint32_t pos[MPHF_MAX_BUCKET];
+
+    memset(taken, 0, ((p->table_size + 31) / 32) * sizeof(uint32_t));
+
+    // Place the biggest buckets first, while the table is empty. Walking all
+    // buckets once per size keeps the running offset into the key array
+    // without having to store one per bucket.
+    for (int size = max_size; size > 0; size--)
+    {
+        size_t offset = 0;
+        for (uint32_t b = 0; b < p->num_buckets; b++)
+        {
+            if (sizes[b] != size)
+            {
+                offset += sizes[b];
+                continue;
+            }
+
+            const uint32_t *keys = &mixed[offset];
+            offset += size;
+
+            // Try pilots until every key lands in a free slot, and no two
+            // keys of the bucket share one
+            uint32_t pilot;
+            for (pilot = 0; pilot <= MPHF_MAX_PILOT; pilot++)
+            {
+                int i;
+                for (i = 0; i < size; i++)
+                {
+                    pos[i] = mphf_pos(p, keys[i], (uint16_t) pilot);
+                    if (BIT_GET(taken, pos[i])) { break; }
+
+                    int j;
+                    for (j = 0; j < i && pos[j] != pos[i]; j++);
+                    if (j < i) { break; }
+                }
+                if (i == size) { break; }
+            }
+            if (pilot > MPHF_MAX_PILOT)
+            {
+                return false;
+            }
+
+            build->pilots[b] = (uint16_t) pilot;
+            for (int i = 0; i < size; i++)
+            {
+                BIT_SET(taken, pos[i]);
+            }
+        }
+    }
+
+    // Empty buckets are never looked up by a known key
+    for (uint32_t b = 0; b < p->num_buckets; b++)
+    {
+        if (sizes[b] == 0) { build->pilots[b] = 0; }
+    }
+    return true;
+}
+
+static void mphf_remap(tag_mphf_build_t *build, const uint32_t *taken)
+{
+    const tag_mphf_t *p = &build->params;
+
+    // Exactly as many slots past n are used as are free below n. Pair them up
+    // in order, so every key ends up in [0, n).
+    uint32_t free_slot = 0;
+    for (uint32_t pos = p->num_keys; pos < p->table_size; pos++)
+    {
+        build->remap[pos - p->num_keys] = 0;
+        if (BIT_GET(taken, pos))
+        {
+            while (BIT_GET(taken, free_slot)) { free_slot++; }
+            build->remap[pos - p->num_keys] = free_slot++;
+        }
+    }
+}
+
+static inline uint32_t mphf_bucket(const tag_mphf_t *mphf, uint32_t mixed)
+{
+    // Monotonic in the mixed value, so sorted keys are grouped by bucket
+    return (uint32_t) (((uint64_t) mixed * mphf->num_buckets) >> 32);
+}
+
+static inline uint32_t mphf_pos(const tag_mphf_t *mphf, uint32_t mixed, uint16_t pilot)
+{
+    // Keys of a bucket share their top bits, so they're re-mixed together
+    // with the pilot rather than just offset by it
+    uint32_t h = tag_mphf_mix((mixed ^ (mphf->seed * 0x85ebca6bU)) + (pilot + 1U) * 0x9e3779b9U);
+    return (uint32_t) (((uint64_t) h * mphf->table_size) >> 32);
+}
@@ -0,0 +1,96 @@
+#ifndef TAG_MPHF_H_
+#define TAG_MPHF_H_
+
+#include "status.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Minimal perfect hash over a fixed set of card numbers, built in the style
+// of CHD/PTHash: keys are split into buckets, and each bucket stores a small
+// "pilot" value chosen so its keys land in free slots of the table. A lookup
+// is one pilot read plus one slot read, with no probing.
+//
+// The hash only maps known cards to distinct slots. Unknown cards map to an
+// arbitrary slot, so the caller stores the card itself in each slot and
+// compares against it to reject them.
+//
+// This module has no flash or RTOS dependencies, so it also builds on a host.
+
+// Parameters of a built function
+typedef struct {
+    uint32_t seed;          // Mixed into the slot hash, changed on a retry
+    uint32_t num_keys;      // n, slots [0, n) hold the keys
+    uint32_t num_buckets;   // Number of pilots
+    uint32_t table_size;    // Slots searched during the build, >= n
+} tag_mphf_t;
+
+// Result of a build
+typedef struct {
+    tag_mphf_t params;
+    uint16_t *pilots;       // num_buckets entries
+    uint32_t *remap;        // (table_size - num_keys) entries, slot >= n -> free slot < n
+} tag_mphf_build_t;
+
+/**
+ * @brief Mix a card number. This is a bijection, so distinct cards stay
+ * distinct. Buckets are assigned from the mixed value in increasing order, so
+ * sorting mixed values groups keys by bucket.
+ * @param card card number
+ * @return mixed card number
+ */
+static inline uint32_t tag_mphf_mix(uint32_t card)
+{
+    // murmur3 finalizer
+    card ^= card >> 16;
+    card *= 0x85ebca6bU;
+    card ^= card >> 13;
+    card *= 0xc2b2ae35U;
+    card ^= card >> 16;
+    return card;
+}
+
+/**
+ * @brief Undo tag_mphf_mix()
+ * @param mixed mixed card number
+ * @return card number
+ */
+static inline uint32_t tag_mphf_unmix(uint32_t mixed)
+{
+    mixed ^= mixed >> 16;
+    mixed *= 0x7ed1b41dU;           // inverse of 0xc2b2ae35
+    mixed ^= (mixed >> 13) ^ (mixed >> 26);
+    mixed *= 0xa5cb9243U;           // inverse of 0x85ebca6b
+    mixed ^= mixed >> 16;
+    return mixed;
+}
+
+/**
+ * @brief Build a minimal perfect hash
+ * @param mixed mixed card numbers (tag_mphf_mix()), sorted ascending with no
+ * duplicates. This can point into memory-mapped flash, it is only read.
+ * @param n number of keys
+ * @param build result. Free with tag_mphf_build_free().
+ * @return -STATUS_NOMEM: couldn't allocate build memory
+ *         -STATUS_INVAL: no function found (keys not sorted or not unique)
+ *          STATUS_OK: successful
+ */
+status_t tag_mphf_build(const uint32_t *mixed, size_t n, tag_mphf_build_t *build);
+
+/**
+ * @brief Release memory held by a build result
+ * @param build build result
+ */
+void tag_mphf_build_free(tag_mphf_build_t *build);
+
+/**
+ * @brief Find the slot of a key
+ * @param mphf function parameters
+ * @param pilots pilot array
+ * @param remap remap array
+ * @param mixed mixed card number
+ * @return slot in [0, num_keys). Only meaningful for keys the function was
+ * built from.
+ */
+uint32_t tag_mphf_slot(const tag_mphf_t *mphf, const uint16_t *pilots, const uint32_t *remap, uint32_t mixed);
+
+#endif /*TAG_MPHF_H_*/
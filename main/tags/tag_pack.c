@@ -0,0 +1,103 @@
+#include "tag_pack.h"
+
+// Helpers
+static inline uint32_t tag_pack_read(const uint8_t **p);
+static inline uint32_t tag_pack_block_len(const tag_pack_t *pack, uint32_t block);
+
+size_t tag_pack_gap(uint32_t prev, uint32_t card, uint8_t *out)
+{
+    // Cards are unique, so the gap is at least 1. Storing it minus one
+    // keeps a gap of 128 in a single byte.
+    uint32_t gap = card - prev - 1;
+    size_t len = 0;
+    do
+    {
+        uint8_t byte = gap & 0x7F;
+        gap >>= 7;
+        if (out != NULL)
+        {
+            out[len] = byte | (gap != 0 ? 0x80 : 0);
+        }
+        len++;
+    } while (gap != 0);
+    return len;
+}
+
+uint32_t tag_pack_card(uint32_t prev, const uint8_t **p)
+{
+    return prev + tag_pack_read(p) + 1;
+}
+
+bool tag_pack_contains(const tag_pack_t *pack, uint32_t card)
+{
+    // Find the last block starting at or before the card
+    uint32_t lo = 0;
+    uint32_t hi = tag_pack_blocks(pack->count);
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pack->skips[mid].first <= card)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo == 0)
+    {
+        return false;
+    }
+
+    // Then walk its gaps until the card is reached or passed
+    uint32_t block = lo - 1;
+    uint32_t len = tag_pack_block_len(pack, block);
+    uint32_t cur = pack->skips[block].first;
+    const uint8_t *p = pack->gaps + pack->skips[block].offset;
+    for (uint32_t i = 1; i < len && cur < card; i++)
+    {
+        cur += tag_pack_read(&p) + 1;
+    }
+    return cur == card;
+}
+
+void tag_pack_foreach(const tag_pack_t *pack, tag_pack_cb_t cb, void *ctx)
+{
+    uint32_t num_blocks = tag_pack_blocks(pack->count);
+    for (uint32_t block = 0; block < num_blocks; block++)
+    {
+        uint32_t len = tag_pack_block_len(pack, block);
+        uint32_t cur = pack->skips[block].first;
+        const uint8_t *p = pack->gaps + pack->skips[block].offset;
+        cb(cur, ctx);
+        for (uint32_t i = 1; i < len; i++)
+        {
+            cur += tag_pack_read(&p) + 1;
+            cb(cur, ctx);
+        }
+    }
+}
+
+// Private
+
+static inline uint32_t tag_pack_read(const uint8_t **p)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = *(*p)++;
+        value |= (uint32_t) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static inline uint32_t tag_pack_block_len(const tag_pack_t *pack, uint32_t block)
+{
+    // Only the last block can be short
+    uint32_t start = block * TAG_PACK_BLOCK_LEN;
+    return pack->count - start < TAG_PACK_BLOCK_LEN ? pack->count - start : TAG_PACK_BLOCK_LEN;
+}
@@ -0,0 +1,83 @@
+#ifndef TAG_PACK_H_
+#define TAG_PACK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Compressed sorted card list. Cards are split into blocks of
+// TAG_PACK_BLOCK_LEN; each block stores the gaps between its cards as LEB128
+// varints, and a skip index holds the first card of every block and where
+// its gaps start. A lookup is a binary search of the skip index and then
+// decoding at most one block.
+//
+// Gaps shrink as lists grow, and cards handed out in batches sit close
+// together, so most take one to three bytes instead of four.
+//
+// This module has no flash or RTOS dependencies, so it also builds on a host.
+
+// Cards per block. Bigger blocks mean a smaller skip index but more decoding
+// per lookup.
+#define TAG_PACK_BLOCK_LEN  64U
+
+// Longest varint, for a gap of 2^32 - 1
+#define TAG_PACK_VARINT_MAX 5U
+
+typedef struct {
+    uint32_t first;         // First card of the block
+    uint32_t offset;        // Where the block's gaps start in the gap data
+} tag_pack_skip_t;
+
+// A packed list, usually pointing into memory-mapped flash
+typedef struct {
+    const tag_pack_skip_t *skips;   // tag_pack_blocks(count) entries
+    const uint8_t *gaps;            // Gap data of all blocks, back to back
+    uint32_t count;                 // Number of cards
+} tag_pack_t;
+
+typedef void (*tag_pack_cb_t)(uint32_t card, void *ctx);
+
+/**
+ * @brief Number of blocks, and skip index entries, for a list
+ * @param count number of cards
+ * @return number of blocks
+ */
+static inline uint32_t tag_pack_blocks(uint32_t count)
+{
+    return (count + TAG_PACK_BLOCK_LEN - 1) / TAG_PACK_BLOCK_LEN;
+}
+
+/**
+ * @brief Encode the gap between two consecutive cards of a block
+ * @param prev previous card
+ * @param card next card, greater than prev
+ * @param out at least TAG_PACK_VARINT_MAX bytes. NULL to only get the length.
+ * @return number of bytes written
+ */
+size_t tag_pack_gap(uint32_t prev, uint32_t card, uint8_t *out);
+
+/**
+ * @brief Decode a gap written by tag_pack_gap()
+ * @param prev previous card
+ * @param p gap to read, moved past it
+ * @return next card
+ */
+uint32_t tag_pack_card(uint32_t prev, const uint8_t **p);
+
+/**
+ * @brief Check if a card is in a packed list
+ * @param pack list to search
+ * @param card card number
+ * @return true if the card is present, false otherwise
+ */
+bool tag_pack_contains(const tag_pack_t *pack, uint32_t card);
+
+/**
+ * @brief Go through every card of a packed list, in ascending order
+ * @param pack list to walk
+ * @param cb called for each card
+ * @param ctx passed to cb
+ */
+void tag_pack_foreach(const tag_pack_t *pack, tag_pack_cb_t cb, void *ctx);
+
+#endif /*TAG_PACK_H_*/
@@ -0,0 +1,86 @@
+#include "tag_record.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Helpers
+static int record_cmp(const void *a, const void *b);
+
+size_t tag_record_sort(tag_record_t *records, size_t count)
+{
+    assert(records || count == 0);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    qsort(records, count, sizeof(tag_record_t), record_cmp);
+
+    size_t out = 1;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (records[i].card != records[out - 1].card)
+        {
+            records[out++] = records[i];
+        }
+    }
+    return out;
+}
+
+const tag_record_t *tag_record_find(const tag_record_t *records, size_t count, uint64_t card)
+{
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (records[mid].card < card)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < count && records[lo].card == card ? &records[lo] : NULL;
+}
+
+bool tag_attrs_parse(const char *str, tag_attrs_t *attrs)
+{
+    assert(str && attrs);
+
+    memset(attrs, 0, sizeof(tag_attrs_t));
+    if (*str != ',')
+    {
+        return false;
+    }
+
+    // Each field is optional from the right
+    char *end;
+    attrs->valid_from = (uint32_t) strtoul(str + 1, &end, 10);
+    if (*end == ',') { attrs->valid_until = (uint32_t) strtoul(end + 1, &end, 10); }
+    if (*end == ',') { attrs->groups = (uint16_t) strtoul(end + 1, &end, 10); }
+    if (*end == ',') { attrs->flags = (uint8_t) strtoul(end + 1, &end, 10); }
+    return true;
+}
+
+int tag_attrs_format(const tag_attrs_t *attrs, char *str)
+{
+    assert(attrs && str);
+
+    return sprintf(str, ",%lu,%lu,%u,%u", (unsigned long) attrs->valid_from, (unsigned long) attrs->valid_until,
+        attrs->groups, attrs->flags);
+}
+
+// Private
+
+static int record_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const tag_record_t *) a)->card;
+    uint64_t y = ((const tag_record_t *) b)->card;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,87 @@
+#ifndef TAG_RECORD_H_
+#define TAG_RECORD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Longest output of tag_attrs_format(), with its terminator
+#define TAG_ATTRS_STR_LEN 40U
+
+// Attributes a card can carry besides its number. All zero is the default: a
+// card without attributes is valid at any time, in no group and unflagged.
+typedef struct {
+    uint32_t valid_from;    // Unix time the card becomes valid, 0 for always
+    uint32_t valid_until;   // Unix time the card stops being valid, 0 for never
+    uint16_t groups;        // Access groups the card belongs to, one bit each
+    uint8_t flags;          // Set by the server, passed on to device handlers
+    uint8_t reserved;
+} tag_attrs_t;
+
+// A card with attributes. Only cards with attributes get a record: lists are
+// mostly plain cards, so the records are kept apart from the card lookup,
+// sorted by card.
+typedef struct {
+    uint64_t card;
+    tag_attrs_t attrs;
+} tag_record_t;
+
+/**
+ * @brief Check if a card has the default attributes
+ * @param attrs attributes
+ * @return true if there is nothing to store for the card
+ */
+static inline bool tag_attrs_none(const tag_attrs_t *attrs)
+{
+    return attrs->valid_from == 0 && attrs->valid_until == 0 && attrs->groups == 0 && attrs->flags == 0;
+}
+
+/**
+ * @brief Check if a card is valid at a point in time
+ * @param attrs attributes of the card
+ * @param now Unix time
+ * @return true if now is in the card's validity period
+ */
+static inline bool tag_attrs_valid_at(const tag_attrs_t *attrs, uint32_t now)
+{
+    return (attrs->valid_from == 0 || now >= attrs->valid_from) &&
+        (attrs->valid_until == 0 || now < attrs->valid_until);
+}
+
+/**
+ * @brief Sort records by card and drop duplicates. A list shouldn't give a
+ * card twice; if it does, one of its records is kept.
+ * @param records records to sort in place
+ * @param count number of records
+ * @return number of records left
+ */
+size_t tag_record_sort(tag_record_t *records, size_t count);
+
+/**
+ * @brief Find the record of a card
+ * @param records records sorted by tag_record_sort()
+ * @param count number of records
+ * @param card card number
+ * @return the card's record, NULL if it has none
+ */
+const tag_record_t *tag_record_find(const tag_record_t *records, size_t count, uint64_t card);
+
+/**
+ * @brief Parse the attributes following a card number in a sync message or
+ * the tags file: ",valid_from,valid_until,groups,flags". Missing trailing
+ * fields are zero.
+ * @param str text after the card number
+ * @param attrs filled in with the attributes
+ * @return true if any attributes were given
+ */
+bool tag_attrs_parse(const char *str, tag_attrs_t *attrs);
+
+/**
+ * @brief Format attributes the way tag_attrs_parse() reads them
+ * @param attrs attributes
+ * @param str at least TAG_ATTRS_STR_LEN bytes
+ * @return number of characters written
+ */
+int tag_attrs_format(const tag_attrs_t *attrs, char *str);
+
+#endif /*TAG_RECORD_H_*/
@@ -0,0 +1,54 @@
+#include "tag_snap.h"
+
+#include <stdbool.h>
+
+void tag_snap_init(tag_snap_t *snap)
+{
+    atomic_store(&snap->current, 0);
+    atomic_store(&snap->refs[0], 0);
+    atomic_store(&snap->refs[1], 0);
+}
+
+uint32_t tag_snap_get(tag_snap_t *snap)
+{
+    while (true)
+    {
+        uint32_t copy = atomic_load(&snap->current);
+        atomic_fetch_add(&snap->refs[copy], 1);
+
+        // The writer only reuses a copy that isn't current and has no
+        // references. If a new one was published before the reference was
+        // taken, this one may already be changing: try again.
+        if (atomic_load(&snap->current) == copy)
+        {
+            return copy;
+        }
+        atomic_fetch_sub(&snap->refs[copy], 1);
+    }
+}
+
+void tag_snap_put(tag_snap_t *snap, uint32_t copy)
+{
+    atomic_fetch_sub(&snap->refs[copy], 1);
+}
+
+uint32_t tag_snap_current(tag_snap_t *snap)
+{
+    return atomic_load(&snap->current);
+}
+
+uint32_t tag_snap_spare(tag_snap_t *snap)
+{
+    // Already drained when it was replaced
+    return atomic_load(&snap->current) ^ 1U;
+}
+
+uint32_t tag_snap_publish(tag_snap_t *snap, tag_snap_wait_t wait)
+{
+    uint32_t old = atomic_exchange(&snap->current, atomic_load(&snap->current) ^ 1U);
+    while (atomic_load(&snap->refs[old]) != 0)
+    {
+        wait();
+    }
+    return old;
+}
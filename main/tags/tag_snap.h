@@ -0,0 +1,65 @@
+#ifndef TAG_SNAP_H_
+#define TAG_SNAP_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Two copies of a read-mostly structure, one current and one spare. Readers
+// take a reference to the current copy and never wait. The one writer fills
+// in the spare, publishes it, then waits for the readers still using the old
+// copy before that becomes the spare.
+//
+// This only counts references, the copies themselves are the caller's. It
+// has no flash or RTOS dependencies, so it also builds on a host.
+typedef struct {
+    atomic_uint current;    // Copy readers see, 0 or 1
+    atomic_int refs[2];     // Readers using each copy
+} tag_snap_t;
+
+// Gives up the writer's time while readers drain
+typedef void (*tag_snap_wait_t)(void);
+
+/**
+ * @brief Make copy 0 current, with no readers
+ * @param snap references to set up
+ */
+void tag_snap_init(tag_snap_t *snap);
+
+/**
+ * @brief Take a reference to the current copy. Never waits on the writer.
+ * @param snap references
+ * @return copy to read, 0 or 1. Give it back with tag_snap_put().
+ */
+uint32_t tag_snap_get(tag_snap_t *snap);
+
+/**
+ * @brief Give back a reference taken with tag_snap_get()
+ * @param snap references
+ * @param copy copy that was read
+ */
+void tag_snap_put(tag_snap_t *snap, uint32_t copy);
+
+/**
+ * @brief Copy readers see. Writer only: it can't change under the writer.
+ * @param snap references
+ * @return current copy
+ */
+uint32_t tag_snap_current(tag_snap_t *snap);
+
+/**
+ * @brief Copy the writer may fill in. Writer only.
+ * @param snap references
+ * @return spare copy, no reader uses it
+ */
+uint32_t tag_snap_spare(tag_snap_t *snap);
+
+/**
+ * @brief Make the spare copy current, and wait until no reader uses the one
+ * it replaces. Writer only.
+ * @param snap references
+ * @param wait called while readers are still using the old copy
+ * @return the old copy, now the spare
+ */
+uint32_t tag_snap_publish(tag_snap_t *snap, tag_snap_wait_t wait);
+
+#endif /*TAG_SNAP_H_*/
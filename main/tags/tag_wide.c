@@ -0,0 +1,57 @@
+#include "tag_wide.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+// Helpers
+static int wide_cmp(const void *a, const void *b);
+
+size_t tag_wide_sort(uint64_t *cards, size_t count)
+{
+    assert(cards || count == 0);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    qsort(cards, count, sizeof(uint64_t), wide_cmp);
+
+    size_t out = 1;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (cards[i] != cards[out - 1])
+        {
+            cards[out++] = cards[i];
+        }
+    }
+    return out;
+}
+
+bool tag_wide_contains(const uint64_t *cards, size_t count, uint64_t card)
+{
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cards[mid] < card)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < count && cards[lo] == card;
+}
+
+// Private
+
+static int wide_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
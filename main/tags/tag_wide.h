@@ -0,0 +1,40 @@
+#ifndef TAG_WIDE_H_
+#define TAG_WIDE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Cards with numbers too long for 32 bits: UIDs of contactless cards and the
+// longer Wiegand formats. Card lists are still almost all 32-bit cards, and
+// those keep the compact 32-bit image, index and filter. The few wide cards
+// are kept apart, in a sorted array searched by bisection.
+
+/**
+ * @brief Check if a card needs more than 32 bits
+ * @param card card number
+ * @return true if the card goes in the wide array
+ */
+static inline bool tag_wide(uint64_t card)
+{
+    return card > UINT32_MAX;
+}
+
+/**
+ * @brief Sort wide cards and drop duplicates
+ * @param cards cards to sort in place
+ * @param count number of cards
+ * @return number of cards left
+ */
+size_t tag_wide_sort(uint64_t *cards, size_t count);
+
+/**
+ * @brief Check if a card is in a sorted wide array
+ * @param cards cards sorted by tag_wide_sort()
+ * @param count number of cards
+ * @param card card number
+ * @return true if the card is present
+ */
+bool tag_wide_contains(const uint64_t *cards, size_t count, uint64_t card);
+
+#endif /*TAG_WIDE_H_*/
@@ -1,136 +1,1563 @@
 #include "tags.h"
+#include "tag_index.h"
+#include "tag_image.h"
+#include "tag_digest.h"
+#include "tag_bloom.h"
+#include "tag_wide.h"
+#include "tag_snap.h"
 #include "bsp.h"
 #include "client.h"
 #include "nvstate.h"
+#include "console.h"
 #include "log.h"
 
-#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <assert.h>
 
-// Filename where the authorized tags are saved
-#define TAGS_FILENAME "tags.txt"
+// Files where the authorized tags are saved when there's no tags partition
+// (the partition table can't be changed by an OTA update, so older devices
+// keep using the file system). A sync writes the file not in use, and the
+// bank in nvstate picks which one is loaded.
+#define TAGS_FILENAME   "tags.txt"
+#define TAGS_FILENAME_B "tags_b.txt"
+#define TAGS_FILE_BANKS 2U
+
+// Most cards a sync_add or sync_remove message can carry. Bigger changes are
+// better sent as a full list.
+#define TAGS_DELTA_MAX 1024U
+
+// Syncs are stored by their own task, so the websocket task only parses.
+// Flash writes and the image build used to hold up pings and pongs.
+#define TAGS_TASK_NAME      "Tags_Task"
+#define TAGS_TASK_STACK     8192U
+#define TAGS_TASK_PRIO      1U
+
+// Batches of cards waiting to be stored. When it's full the websocket task
+// waits, which holds the server back until the flash catches up.
+#define TAGS_QUEUE_LEN      8U
+
+// Cards stored between progress logs
+#define TAGS_PROGRESS_CARDS 10000U
+
+// Most RAM for the filter in front of the list. Lists of up to ~50k cards
+// get the full 10 bits per card, longer ones a few more false positives.
+#define TAGS_BLOOM_MAX_BYTES (64U * 1024U)
+
+// Records of cards with attributes, 24 bytes each, and cards longer than 32
+// bits, 8 bytes each, are gathered in RAM while a list is stored. There's no
+// fixed limit on them: they grow while the heap has this much left over for
+// the rest of the firmware.
+#define TAGS_HEAP_RESERVE   (48U * 1024U)
+
+// Damaged pages in a row before a paged sync is given up
+#define TAGS_RESEND_MAX     3U
+
+// A full list that doesn't match its hash is asked for again after this
+// long, doubling with each one in a row. The stored list is kept meanwhile.
+#define TAGS_RESEND_DELAY       5U //s
+#define TAGS_RESEND_DELAY_MAX   3600U //s
+
+// Most cards in a page of a paged sync. A page is held in RAM until its CRC
+// is checked, 20 bytes a card.
+#define TAGS_PAGE_MAX       1024U
 
 status_t tag_sync_handler(msg_t *msg);
+status_t tag_digest_handler(msg_t *msg);
+int _set_tags_format(int argc, char **argv);
+int _tags_stats(int argc, char **argv);
+void tags_task(void *params);
+static void tags_resend_timer_cb(TimerHandle_t timer);
+
+// What a lookup sees. Lookups take a reference to the current snapshot and
+// never wait. The sync task fills in the other one, publishes it, then waits
+// for the lookups still using the old one before reusing it (tag_snap.h).
+typedef struct {
+    tag_image_view_t image; // Image only
+    tag_index_t index;      // File only. Both snapshots can share a table.
+    tag_bloom_t bloom;      // Over the image or file, shared like the index
+    const tag_record_t *records; // Cards of the image or file with attributes.
+    size_t num_records;     // In the image, or RAM shared like the index.
+    const uint64_t *wide;   // Cards of the image or file too long for the
+    size_t num_wide;        // 32-bit lookup, kept like the records
+
+    // Changes made since the list was written. The image or file isn't
+    // modified in place, so lookups check these first. Each snapshot has
+    // its own copy.
+    tag_index_t added;
+    tag_index_t removed;
+} tags_snapshot_t;
+
+// Records gathered while a list is read
+typedef struct {
+    tag_record_t *records;
+    size_t count;
+    size_t capacity;
+} tags_records_t;
+
+// Wide cards gathered while a list is read
+typedef struct {
+    uint64_t *cards;
+    size_t count;
+    size_t capacity;
+} tags_wide_t;
+
+typedef void (*tags_card_cb_t)(uint64_t card, void *ctx);
+
+// Helpers
+static void tags_sync_stage(msg_type_t type, const sync_payload_t *sync);
+static void tags_sync_page_stage(const sync_payload_t *sync);
+static void tags_sync_page_end(const sync_payload_t *sync);
+static status_t tags_sync_finish(const sync_payload_t *sync);
+static void tags_sync_reply(msg_type_t type, uint32_t sync_id, uint32_t page);
+static void tags_sync_error(status_t status);
+static status_t tags_load(tag_index_t *index, tags_records_t *records, tags_wide_t *wide);
+static status_t tags_records_add(tags_records_t *records, uint64_t card, const tag_attrs_t *attrs);
+static status_t tags_wide_add(tags_wide_t *wide, uint64_t card);
+static size_t tags_grow(size_t capacity, size_t size);
+static const char *tags_filename(uint8_t bank);
+static bool tags_hash_matches(const uint8_t *hash);
+static status_t tags_sync_begin(void);
+static status_t tags_sync_add(const uint64_t *cards, const tag_attrs_t *attrs, size_t count);
+static status_t tags_sync_commit(void);
+static void tags_sync_abort(void);
+static status_t tags_delta_apply(const sync_payload_t *sync);
+static status_t tags_overlay(tags_snapshot_t *snap, uint32_t card, tag_image_op_t op, tag_digest_t *digest);
+static void tags_log_replay(uint32_t card, tag_image_op_t op, void *ctx);
+static void tags_request_sync(void);
+static tags_snapshot_t *tags_snapshot_get(void);
+static void tags_snapshot_put(tags_snapshot_t *snap);
+static tags_snapshot_t *tags_snapshot_spare(void);
+static tags_snapshot_t *tags_snapshot_publish(tags_snapshot_t *snap);
+static void tags_snapshot_wait(void);
+static bool tags_contains(const tags_snapshot_t *snap, uint32_t card, bool counted);
+static bool tags_base_contains(const tags_snapshot_t *snap, uint32_t card, bool counted);
+static void tags_foreach(const tags_snapshot_t *snap, tags_card_cb_t cb, void *ctx);
+static void tags_foreach_base(uint32_t card, void *ctx);
+static void tags_bloom_build(tags_snapshot_t *snap);
+static void tags_bloom_card(uint32_t card, void *ctx);
+static void tags_digest_rebuild(void);
+static void tags_digest_card(uint64_t card, void *ctx);
+static void tags_bucket_card(uint64_t card, void *ctx);
 
-// Open file with tags
-file_t tag_file = NULL;
+// A stage of a sync message, copied out of the parser
+typedef struct {
+    msg_type_t type;
+    uint32_t generation;    // Sync the stage belongs to
+    sync_payload_t sync;
+    uint64_t tags[MSG_SYNC_BATCH];
+    tag_attrs_t attrs[MSG_SYNC_BATCH];
+} tags_job_t;
+
+typedef struct {
+    bool use_image;         // Cards are in the tags partition, not the file
+    uint8_t bank;           // File the cards were loaded from
+    tags_snapshot_t snaps[2];
+    tag_snap_t snap;        // Which of snaps lookups see
+    atomic_uint changes;    // Snapshots published since boot
+
+    // Bucketed digest of the list, kept up to date with every change
+    SemaphoreHandle_t lock; // Guards the digest
+    tag_digest_t digest;
+    tag_digest_t new_digest; // Sync task only: digest with a change applied
+
+    // Sync in progress. The cards of a full list are stored as they arrive,
+    // a change is only applied once the base hash is known to match.
+    bool syncing;
+    msg_type_t sync_type;
+    bool skip;              // Hash matched, the cards are ignored
+    status_t sync_status;   // First error while storing the cards
+    const char *sync_error; // Why, for the server, if it's a known limit
+    int64_t sync_start;
+    tag_index_t new_index;  // File only: replaces index at the end
+    tags_records_t new_records;
+    tags_wide_t new_wide;
+    fs_writer_t new_file;   // File only: written a block at a time
+    uint64_t *delta;        // Cards of a sync_add or sync_remove
+    size_t delta_len;
+    size_t sync_cards;      // Cards of a full list stored so far
+    uint32_t resends;       // Full lists rejected in a row
+    uint32_t hash_failures; // Full lists rejected since boot
+    TimerHandle_t resend_timer;
+    bool resend_page;       // Ask for the rejected list as a paged sync
+    uint32_t resend_sync_id;
+
+    // Paged sync in progress. Pages are stored in order, each one once it's
+    // complete and intact. The pages stored so far are kept while the
+    // connection is down, the server resumes after the last one.
+    uint32_t page_sync_id;
+    uint32_t next_page;
+    uint32_t pages;
+    bool page_current;      // Page being received is next_page
+    uint32_t page_resends;  // Bad pages in a row
+    uint64_t *page_tags;
+    tag_attrs_t *page_attrs;
+    size_t page_len;
+    bool page_has_attrs;
+
+    // Hand-off from the websocket task to tags_task(). Every new sync bumps
+    // the generation, and stages of older ones still queued are dropped.
+    QueueHandle_t queue;
+    volatile uint32_t generation;
+    tags_job_t rx_job;      // Websocket task only
+    tags_job_t job;         // tags_task() only
+
+    // Lookups of cards not in the image or file, since boot
+    atomic_uint bloom_rejected;     // Turned away by the filter
+    atomic_uint bloom_false;        // Passed the filter, then not found
+} tags_ctx_t;
+
+static tags_ctx_t _ctx;
 
 status_t tags_init(void)
 {
-    // If the file doesn't exist, create it
-    if (!fs_exists(TAGS_FILENAME))
+    _ctx.lock = xSemaphoreCreateMutex();
+    if (_ctx.lock == NULL) { return -STATUS_NOMEM; }
+
+    // Nothing looks at the snapshots until init is done, the first one is
+    // filled in place
+    tag_snap_init(&_ctx.snap);
+    tags_snapshot_t *snap = &_ctx.snaps[tag_snap_current(&_ctx.snap)];
+    status_t status = tag_index_init(&snap->added, 0);
+    if (status == STATUS_OK) { status = tag_index_init(&snap->removed, 0); }
+    if (status != STATUS_OK)
     {
-        tag_file = fs_open(TAGS_FILENAME, "w");
-        fs_close(tag_file);
+        return status;
     }
 
-    tag_file = fs_open(TAGS_FILENAME, "r");
-    if (tag_file == NULL)
+    // Prefer the flash image: it's searched in place and costs no RAM
+    bool empty;
+    uint8_t bank = nvstate_tag_bank();
+    status = tag_image_init(&bank);
+    if (status == STATUS_OK && bank != nvstate_tag_bank())
     {
-        ERROR("Couldn't open %s", TAGS_FILENAME);
-        return -STATUS_NOFILE;
+        nvstate_tag_bank_set(bank);
+    }
+    if (status == STATUS_OK || status == -STATUS_NOFILE)
+    {
+        _ctx.use_image = true;
+        empty = status == -STATUS_NOFILE;
+        tag_image_view(&snap->image);
+        snap->records = snap->image.records;
+        snap->num_records = snap->image.num_records;
+        snap->wide = snap->image.wide;
+        snap->num_wide = snap->image.num_wide;
+
+        // Reapply the changes made since the image was built
+        tag_image_log_replay(tags_log_replay, snap);
+        if (snap->added.count > 0 || snap->removed.count > 0)
+        {
+            INFO("%u cards added, %u removed since the image was built",
+                snap->added.count + snap->added.has_empty, snap->removed.count + snap->removed.has_empty);
+        }
     }
+    else
+    {
+        _ctx.use_image = false;
+        _ctx.bank = nvstate_tag_bank() % TAGS_FILE_BANKS;
+        WARN("No tags partition, falling back to %s", tags_filename(_ctx.bank));
+
+        // If the file doesn't exist, create it
+        if (!fs_exists(tags_filename(_ctx.bank)))
+        {
+            file_t tag_file = fs_open(tags_filename(_ctx.bank), "w");
+            fs_close(tag_file);
+        }
 
-    // When new firmware is written the tags file is lost, but the nvstate 
-    // partition is usually untouched (unless the flash is explicitly erased). 
-    // In this case, a sync message with the same tags list will be rejected 
-    // until a change is made to the list (and thus changing the hash).
+        // The file is only the persistent copy of the list. Swipes are
+        // checked against the index built here.
+        tags_records_t records = { 0 };
+        tags_wide_t wide = { 0 };
+        status = tags_load(&snap->index, &records, &wide);
+        if (status != STATUS_OK)
+        {
+            free(records.records);
+            free(wide.cards);
+            return status;
+        }
+        snap->records = records.records;
+        snap->num_records = tag_record_sort(records.records, records.count);
+        snap->wide = wide.cards;
+        snap->num_wide = tag_wide_sort(wide.cards, wide.count);
+        INFO("Loaded %u authorized cards, %u with attributes, %u over 32 bits",
+            snap->index.count + snap->index.has_empty + snap->num_wide, snap->num_records, snap->num_wide);
+        empty = snap->index.count == 0 && !snap->index.has_empty && snap->num_wide == 0;
+    }
+    tags_bloom_build(snap);
+
+    // Flashing a file system image loses the tags file (the tags partition
+    // isn't touched), but the nvstate partition is usually untouched (unless
+    // the flash is explicitly erased). In this case, a sync message with the
+    // same tags list will be rejected until a change is made to the list (and
+    // thus changing the hash).
     //
-    // Here we check if the tag file is empty. If so, the hash is cleared so 
-    // the sync message can populate the tags list here.
-    char card_str[16];
-    if (fs_readline(tag_file, card_str) == -STATUS_EOF)
+    // Here we check if the stored list is missing. If so, the hash is cleared
+    // so the sync message can populate the tags list here.
+    if (empty)
     {
         uint8_t tag_hash[TAG_HASH_LEN];
         memset(tag_hash, 0, TAG_HASH_LEN);
         nvstate_tag_hash_set(tag_hash, TAG_HASH_LEN);
     }
-    fs_rewind(tag_file);
 
-    // Register a handler with the client to handle incoming sync messages
-    return client_handler_register(tag_sync_handler);
+    tags_digest_rebuild();
+
+    _ctx.resend_timer = xTimerCreate("Resend_Timer", pdMS_TO_TICKS(1000 * TAGS_RESEND_DELAY), false, NULL,
+        tags_resend_timer_cb);
+    if (_ctx.resend_timer == NULL) { return -STATUS_NOMEM; }
+
+    _ctx.queue = xQueueCreate(TAGS_QUEUE_LEN, sizeof(tags_job_t));
+    if (_ctx.queue == NULL) { return -STATUS_NOMEM; }
+    if (xTaskCreate(tags_task, TAGS_TASK_NAME, TAGS_TASK_STACK, NULL, TAGS_TASK_PRIO, NULL) != pdPASS)
+    {
+        return -STATUS_NOMEM;
+    }
+
+    console_register("tags_format", "set tag db layout (sorted, mphf or packed), applied on next sync", NULL, _set_tags_format);
+    console_register("tags_stats", "show tag lookup filter stats", NULL, _tags_stats);
+
+    // Register handlers with the client to handle incoming sync messages, and
+    // digest requests from the server
+    status = client_handler_register(tag_sync_handler);
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+    status = client_handler_register(tag_digest_handler);
+
+    // Swipes are checked from here on, whether or not the server is reachable
+    INFO("Card list ready %lld ms after boot", esp_timer_get_time() / 1000);
+    return status;
 }
 
-status_t tags_verify(uint32_t card)
+status_t tags_verify(uint64_t card, tag_record_t *record)
 {
-    // Go line-by-line through the file, reading card data and comparing 
-    // against card. If EOF is reached before a match is found, no match 
-    // exists.
-    char card_str[16];
-    status_t status = fs_readline(tag_file, card_str);
-    while (status != -STATUS_EOF) 
+    // 32-bit cards take the compact lookup, the rare longer ones a search of
+    // their own array
+    tags_snapshot_t *snap = tags_snapshot_get();
+    bool found = tag_wide(card) ?
+        tag_wide_contains(snap->wide, snap->num_wide, card) :
+        tags_contains(snap, (uint32_t) card, true);
+    if (found && record != NULL)
     {
-        uint32_t db_card = atoi(card_str);
-        if (db_card == card)
-        {
-            // Be kind
-            fs_rewind(tag_file);
-            return STATUS_OK;
-        }
-        status = fs_readline(tag_file, card_str);
+        // Copied out, the image or file may be replaced once it's released
+        const tag_record_t *stored = tag_record_find(snap->records, snap->num_records, card);
+        memset(record, 0, sizeof(tag_record_t));
+        record->card = card;
+        if (stored != NULL) { record->attrs = stored->attrs; }
     }
+    tags_snapshot_put(snap);
 
-    fs_rewind(tag_file);
-    return -STATUS_INVALID;
+    return found ? STATUS_OK : -STATUS_INVALID;
+}
+
+uint32_t tags_changes(void)
+{
+    return atomic_load(&_ctx.changes);
 }
 
 status_t tag_sync_handler(msg_t *msg)
 {
     assert(msg);
 
+    tags_job_t *job = &_ctx.rx_job;
+    if (msg->type == MSG_AUTHORISED && msg->authorised.authorised)
+    {
+        // Back online: a paged sync that was cut off resumes. The client
+        // handles the message too.
+        job->type = MSG_AUTHORISED;
+        job->generation = _ctx.generation;
+        xQueueSend(_ctx.queue, job, portMAX_DELAY);
+        return -STATUS_UNAVAILABLE;
+    }
+
     // Only handle sync messages
-    if (msg->type == MSG_SYNC)
+    if (msg->type != MSG_SYNC && msg->type != MSG_SYNC_ADD && msg->type != MSG_SYNC_REMOVE &&
+        msg->type != MSG_SYNC_PAGE)
+    {
+        return -STATUS_UNAVAILABLE;
+    }
+
+    // A newer sync cancels the one being stored. Pages after the first go
+    // on with it.
+    if (msg->sync.stage == SYNC_BEGIN && (msg->type != MSG_SYNC_PAGE || msg->sync.page == 0))
     {
-        // Get the existing hash
+        _ctx.generation++;
+    }
+
+    // The cards point into the parser's buffer, so they're copied
+    job->type = msg->type;
+    job->generation = _ctx.generation;
+    job->sync = msg->sync;
+    job->sync.tags = NULL;
+    memcpy(job->tags, msg->sync.tags, msg->sync.num_tags * sizeof(uint64_t));
+    if (msg->sync.attrs != NULL)
+    {
+        // Left non-NULL, so the task knows to point it at the copy
+        memcpy(job->attrs, msg->sync.attrs, msg->sync.num_tags * sizeof(tag_attrs_t));
+    }
+    xQueueSend(_ctx.queue, job, portMAX_DELAY);
+    return STATUS_OK;
+}
+
+void tags_task(void *params)
+{
+    tags_job_t *job = &_ctx.job;
+    while (1)
+    {
+        xQueueReceive(_ctx.queue, job, portMAX_DELAY);
+        job->sync.tags = job->tags;
+        job->sync.attrs = job->sync.attrs != NULL ? job->attrs : NULL;
+
+        if (job->generation != _ctx.generation)
+        {
+            // Superseded. The rest of it is skipped rather than written, the
+            // newer sync starts once it's drained.
+            if (_ctx.syncing)
+            {
+                WARN("Card list replaced by a newer one, not saved");
+                _ctx.syncing = false;
+                tags_sync_abort();
+            }
+            continue;
+        }
+
+        if (job->type == MSG_AUTHORISED)
+        {
+            if (_ctx.syncing && _ctx.sync_type == MSG_SYNC_PAGE)
+            {
+                INFO("Resuming card list at page %lu of %lu", _ctx.next_page, _ctx.pages);
+                tags_sync_reply(MSG_SYNC_RESUME, _ctx.page_sync_id, _ctx.next_page);
+            }
+            continue;
+        }
+        tags_sync_stage(job->type, &job->sync);
+    }
+}
+
+status_t tag_digest_handler(msg_t *msg)
+{
+    assert(msg);
+
+    if (msg->type == MSG_TAG_DIGEST)
+    {
+        // The server walks down the tree: the root and groups first, then
+        // the buckets of the groups that differ
+        int32_t group = msg->tag_digest.group;
+        if (group >= (int32_t) TAG_DIGEST_GROUPS) { group = -1; }
+
+        msg_t reply = {
+            .type = MSG_TAG_DIGEST,
+            .tag_digest.group = group,
+        };
         size_t hash_len;
-        uint8_t cur_hash[TAG_HASH_LEN];
-        nvstate_tag_hash(cur_hash, &hash_len);
+        nvstate_tag_hash(reply.tag_digest.hash, &hash_len);
+
+        xSemaphoreTake(_ctx.lock, portMAX_DELAY);
+        reply.tag_digest.count = _ctx.digest.count;
+        reply.tag_digest.root = tag_digest_root(&_ctx.digest);
+        for (uint32_t i = 0; i < TAG_DIGEST_FANOUT; i++)
+        {
+            reply.tag_digest.digests[i] = group < 0 ?
+                tag_digest_group(&_ctx.digest, i) :
+                _ctx.digest.bucket[group * TAG_DIGEST_FANOUT + i];
+        }
+        xSemaphoreGive(_ctx.lock);
+
+        client_send_msg(&reply);
+        return STATUS_OK;
+    }
 
-        INFO("New authorized card list received");
+    if (msg->type == MSG_TAG_BUCKET)
+    {
+        // The server compares the cards and sends sync_add/sync_remove
+        // messages for the difference
+        msg_t reply = {
+            .type = MSG_TAG_BUCKET,
+            .tag_bucket.bucket = msg->tag_bucket.bucket & (TAG_DIGEST_BUCKETS - 1),
+        };
 
-        // Only update the tags if the hashes are different
-        if (memcmp(cur_hash, msg->sync.hash, TAG_HASH_LEN) != 0)
+        tags_snapshot_t *snap = tags_snapshot_get();
+        tags_foreach(snap, tags_bucket_card, &reply.tag_bucket);
+        tags_snapshot_put(snap);
+        if (reply.tag_bucket.status != STATUS_OK)
         {
-            WARN("saving...");
-            char file_line[16];
+            // A partial bucket would look like cards missing from the list
+            ERROR("Couldn't gather the cards of bucket %lu: %ld", reply.tag_bucket.bucket, reply.tag_bucket.status);
+        }
 
-            // Close and delete the old file. We'll create a new file and 
-            // rewrite it.
-            fs_close(tag_file);
-            fs_rm(TAGS_FILENAME);
-            file_t new_file = fs_open(TAGS_FILENAME, "w");
-            if (new_file == 0)
+        client_send_msg(&reply);
+        free((uint64_t *) reply.tag_bucket.tags);
+        return STATUS_OK;
+    }
+
+    return -STATUS_UNAVAILABLE;
+}
+
+int _set_tags_format(int argc, char **argv)
+{
+    if (argc == 2)
+    {
+        static const char *const names[] = { "sorted", "mphf", "packed" };
+        tag_image_format_t format = TAG_IMAGE_SORTED;
+        for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        {
+            if (strcmp(argv[1], names[i]) == 0)
+            {
+                format = (tag_image_format_t) i;
+            }
+        }
+        printf("Setting tag db format to %s\n", names[format]);
+        nvstate_tag_format_set((uint8_t) format);
+
+        // Forget the list hash, so the next sync rebuilds the db
+        uint8_t tag_hash[TAG_HASH_LEN];
+        memset(tag_hash, 0, TAG_HASH_LEN);
+        nvstate_tag_hash_set(tag_hash, TAG_HASH_LEN);
+    }
+    return 0;
+}
+
+int _tags_stats(int argc, char **argv)
+{
+    tags_snapshot_t *snap = tags_snapshot_get();
+    size_t bytes = tag_bloom_bytes(&snap->bloom);
+    printf("Filter: %u cards, %u bytes, k=%u, expected false positives %lu ppm\n",
+        snap->bloom.count, bytes, snap->bloom.k, tag_bloom_fp_ppm(&snap->bloom));
+    tags_snapshot_put(snap);
+
+    // Measured on unknown cards swiped since boot
+    uint32_t rejected = atomic_load(&_ctx.bloom_rejected);
+    uint32_t passed = atomic_load(&_ctx.bloom_false);
+    uint32_t unknown = rejected + passed;
+    printf("Unknown cards: %lu, rejected by filter %lu, false positives %lu (%lu ppm)\n",
+        unknown, rejected, passed, unknown == 0 ? 0 : (uint32_t) ((uint64_t) passed * 1000000U / unknown));
+    printf("Card lists rejected for their hash: %lu since boot, %lu in a row\n", _ctx.hash_failures, _ctx.resends);
+    return 0;
+}
+
+// Private
+
+static void tags_sync_stage(msg_type_t type, const sync_payload_t *sync)
+{
+    if (type == MSG_SYNC_PAGE)
+    {
+        tags_sync_page_stage(sync);
+        return;
+    }
+
+    switch (sync->stage)
+    {
+        case SYNC_BEGIN:
+            if (_ctx.syncing)
+            {
+                tags_sync_abort();
+            }
+            _ctx.syncing = true;
+            _ctx.sync_type = type;
+            _ctx.skip = false;
+
+            if (type != MSG_SYNC)
+            {
+                // Changes are small, they're held until the base hash can be
+                // checked
+                _ctx.delta_len = 0;
+                _ctx.delta = malloc(TAGS_DELTA_MAX * sizeof(uint64_t));
+                _ctx.sync_status = _ctx.delta == NULL ? -STATUS_NOMEM : STATUS_OK;
+                break;
+            }
+
+            INFO("New authorized card list received");
+
+            // Only update the tags if the hashes are different. The hash
+            // may only come after the cards, then they're always stored.
+            _ctx.skip = sync->has_hash && tags_hash_matches(sync->hash);
+            _ctx.sync_cards = 0;
+            _ctx.sync_status = _ctx.skip ? STATUS_OK : tags_sync_begin();
+            if (!_ctx.skip) { WARN("saving..."); }
+            break;
+
+        case SYNC_TAGS:
+            if (!_ctx.syncing || _ctx.skip || _ctx.sync_status != STATUS_OK)
+            {
+                break;
+            }
+            if (_ctx.sync_type != MSG_SYNC)
+            {
+                if (_ctx.delta_len + sync->num_tags > TAGS_DELTA_MAX)
+                {
+                    _ctx.sync_status = -STATUS_NOMEM;
+                    break;
+                }
+                memcpy(&_ctx.delta[_ctx.delta_len], sync->tags, sync->num_tags * sizeof(uint64_t));
+                _ctx.delta_len += sync->num_tags;
+                break;
+            }
+            _ctx.sync_status = tags_sync_add(sync->tags, sync->attrs, sync->num_tags);
+
+            size_t prev = _ctx.sync_cards;
+            _ctx.sync_cards += sync->num_tags;
+            if (_ctx.sync_cards / TAGS_PROGRESS_CARDS != prev / TAGS_PROGRESS_CARDS)
+            {
+                INFO("%u cards stored, %u batches queued", _ctx.sync_cards, uxQueueMessagesWaiting(_ctx.queue));
+            }
+            break;
+
+        case SYNC_END: {
+            if (!_ctx.syncing)
+            {
+                WARN("Sync message without a card list");
+                break;
+            }
+            _ctx.syncing = false;
+
+            if (_ctx.sync_type != MSG_SYNC)
+            {
+                status_t status = _ctx.sync_status;
+                if (status == STATUS_OK)
+                {
+                    status = tags_delta_apply(sync);
+                }
+                free(_ctx.delta);
+                _ctx.delta = NULL;
+
+                if (status != STATUS_OK)
+                {
+                    // None of the change is live, but some of it may be on
+                    // flash. The stored hash is cleared so no further change
+                    // applies on top of it, and the full list replaces both.
+                    ERROR("Couldn't apply card list change: %ld, requesting full list", status);
+                    uint8_t tag_hash[TAG_HASH_LEN];
+                    memset(tag_hash, 0, TAG_HASH_LEN);
+                    nvstate_tag_hash_set(tag_hash, TAG_HASH_LEN);
+                    tags_request_sync();
+                    break;
+                }
+                nvstate_tag_hash_set((uint8_t *) sync->hash, TAG_HASH_LEN);
+                INFO("%u cards %s", _ctx.delta_len, _ctx.sync_type == MSG_SYNC_ADD ? "added" : "removed");
+                break;
+            }
+
+            tags_sync_finish(sync);
+            break;
+        }
+
+        case SYNC_ABORT:
+            if (_ctx.syncing)
             {
-                ERROR("Couldn't save new cards");
-                return STATUS_OK;
+                ERROR("Card list incomplete, not saved");
+                _ctx.syncing = false;
+                tags_sync_abort();
             }
-    
-            // Parse the Received JSON. The tags are provided in an array, and 
-            // we can iterate over it.
-            cJSON *tag;
-            cJSON_ArrayForEach(tag, msg->sync.tags)
+            break;
+    }
+}
+
+static void tags_sync_page_stage(const sync_payload_t *sync)
+{
+    switch (sync->stage)
+    {
+        case SYNC_BEGIN:
+            if (sync->page == 0)
+            {
+                // A new list, whatever was in progress is dropped
+                if (_ctx.syncing)
+                {
+                    tags_sync_abort();
+                }
+                _ctx.syncing = true;
+                _ctx.sync_type = MSG_SYNC_PAGE;
+                _ctx.page_sync_id = sync->sync_id;
+                _ctx.next_page = 0;
+                _ctx.pages = sync->pages;
+                _ctx.page_resends = 0;
+                INFO("New authorized card list received, %lu pages", sync->pages);
+
+                _ctx.skip = sync->has_hash && tags_hash_matches(sync->hash);
+                _ctx.sync_cards = 0;
+                _ctx.sync_status = _ctx.skip ? STATUS_OK : tags_sync_begin();
+                _ctx.page_tags = malloc(TAGS_PAGE_MAX * sizeof(uint64_t));
+                _ctx.page_attrs = malloc(TAGS_PAGE_MAX * sizeof(tag_attrs_t));
+                if (_ctx.page_tags == NULL || _ctx.page_attrs == NULL)
+                {
+                    _ctx.sync_status = -STATUS_NOMEM;
+                }
+                if (!_ctx.skip) { WARN("saving..."); }
+            }
+
+            _ctx.page_len = 0;
+            _ctx.page_has_attrs = false;
+            _ctx.page_current = _ctx.syncing && _ctx.sync_type == MSG_SYNC_PAGE &&
+                sync->sync_id == _ctx.page_sync_id && sync->page == _ctx.next_page;
+            break;
+
+        case SYNC_TAGS:
+            if (!_ctx.page_current || _ctx.sync_status != STATUS_OK)
+            {
+                break;
+            }
+            if (_ctx.page_len + sync->num_tags > TAGS_PAGE_MAX)
+            {
+                ERROR("Card list page over %u cards", TAGS_PAGE_MAX);
+                _ctx.sync_status = -STATUS_NOMEM;
+                break;
+            }
+            memcpy(&_ctx.page_tags[_ctx.page_len], sync->tags, sync->num_tags * sizeof(uint64_t));
+            if (sync->attrs != NULL)
+            {
+                memcpy(&_ctx.page_attrs[_ctx.page_len], sync->attrs, sync->num_tags * sizeof(tag_attrs_t));
+            }
+            else
             {
-                // We're reformatting: each card is delimited with a line feed.
-                int len = sprintf(file_line, "%d\n", atoi(tag->valuestring));
-                fs_write(new_file, file_line, len);
+                memset(&_ctx.page_attrs[_ctx.page_len], 0, sync->num_tags * sizeof(tag_attrs_t));
             }
+            _ctx.page_has_attrs |= sync->attrs != NULL;
+            _ctx.page_len += sync->num_tags;
+            break;
+
+        case SYNC_END:
+            tags_sync_page_end(sync);
+            break;
 
-            // Reopen the file as read-only
-            fs_close(new_file);
-            tag_file = fs_open(TAGS_FILENAME, "r");
+        case SYNC_ABORT:
+            // Cut off mid-page. Only the page is lost, the sync resumes
+            // from it once the server is back.
+            _ctx.page_current = false;
+            break;
+    }
+}
 
-            // Store the curernt hash
-            nvstate_tag_hash_set(msg->sync.hash, TAG_HASH_LEN);
+static void tags_sync_page_end(const sync_payload_t *sync)
+{
+    if (!_ctx.page_current)
+    {
+        // Not the page that comes next. Ask for it, or for the whole list
+        // if there's no sync to go on with.
+        if (_ctx.syncing && _ctx.sync_type == MSG_SYNC_PAGE)
+        {
+            tags_sync_reply(MSG_SYNC_RESUME, _ctx.page_sync_id, _ctx.next_page);
+        }
+        else
+        {
+            tags_sync_reply(MSG_SYNC_RESUME, sync->sync_id, 0);
+        }
+        return;
+    }
+    _ctx.page_current = false;
+
+    if (_ctx.sync_status != STATUS_OK)
+    {
+        ERROR("Couldn't save new cards: %ld", _ctx.sync_status);
+        tags_sync_error(_ctx.sync_status);
+        _ctx.syncing = false;
+        tags_sync_abort();
+        return;
+    }
 
-            WARN("Done saving cards");
+    if (!sync->page_ok)
+    {
+        if (_ctx.page_resends++ < TAGS_RESEND_MAX)
+        {
+            WARN("Page %lu of the card list is damaged, requesting it again", sync->page);
+            tags_sync_reply(MSG_SYNC_RESUME, _ctx.page_sync_id, _ctx.next_page);
         }
         else
         {
-            INFO("Hash matches stored, skip write");
+            ERROR("Page %lu of the card list is damaged, not saved", sync->page);
+            _ctx.syncing = false;
+            tags_sync_abort();
+        }
+        return;
+    }
+    _ctx.page_resends = 0;
+
+    if (!_ctx.skip)
+    {
+        status_t status = tags_sync_add(_ctx.page_tags, _ctx.page_has_attrs ? _ctx.page_attrs : NULL, _ctx.page_len);
+        if (status != STATUS_OK)
+        {
+            ERROR("Couldn't save new cards: %ld", status);
+            tags_sync_error(status);
+            _ctx.syncing = false;
+            tags_sync_abort();
+            return;
         }
+    }
+
+    size_t prev = _ctx.sync_cards;
+    _ctx.sync_cards += _ctx.page_len;
+    if (_ctx.sync_cards / TAGS_PROGRESS_CARDS != prev / TAGS_PROGRESS_CARDS)
+    {
+        INFO("%u cards stored, page %lu of %lu", _ctx.sync_cards, sync->page + 1, _ctx.pages);
+    }
+
+    _ctx.next_page++;
+    if (_ctx.next_page < _ctx.pages)
+    {
+        tags_sync_reply(MSG_SYNC_ACK, _ctx.page_sync_id, sync->page);
+        return;
+    }
+
+    // Last page, the list is complete
+    _ctx.syncing = false;
+    free(_ctx.page_tags);
+    _ctx.page_tags = NULL;
+    free(_ctx.page_attrs);
+    _ctx.page_attrs = NULL;
+    if (tags_sync_finish(sync) == STATUS_OK)
+    {
+        tags_sync_reply(MSG_SYNC_ACK, _ctx.page_sync_id, sync->page);
+    }
+}
+
+static status_t tags_sync_finish(const sync_payload_t *sync)
+{
+    if (_ctx.skip)
+    {
+        INFO("Hash matches stored, skip write");
         return STATUS_OK;
     }
-    return -STATUS_UNAVAILABLE;
-}
\ No newline at end of file
+
+    // Only a list that hashes to what the portal sent replaces the stored
+    // one. A list that can't be checked is treated the same.
+    if (sync->has_hash && (!sync->has_digest || memcmp(sync->hash, sync->digest, TAG_HASH_LEN) != 0))
+    {
+        tags_sync_abort();
+        _ctx.hash_failures++;
+
+        uint32_t delay = TAGS_RESEND_DELAY;
+        for (uint32_t i = 0; i < _ctx.resends && delay < TAGS_RESEND_DELAY_MAX; i++)
+        {
+            delay *= 2;
+        }
+        if (delay > TAGS_RESEND_DELAY_MAX) { delay = TAGS_RESEND_DELAY_MAX; }
+        _ctx.resends++;
+
+        ERROR("Card list %s its hash, not saved (%lu in a row, %lu since boot). Requesting it again in %lu s.",
+            sync->has_digest ? "doesn't match" : "couldn't be checked against", _ctx.resends, _ctx.hash_failures,
+            delay);
+        _ctx.resend_page = _ctx.sync_type == MSG_SYNC_PAGE;
+        _ctx.resend_sync_id = _ctx.page_sync_id;
+        xTimerChangePeriod(_ctx.resend_timer, pdMS_TO_TICKS(1000 * delay), portMAX_DELAY);
+        return -STATUS_INVALID;
+    }
+
+    status_t status = _ctx.sync_status;
+    if (status == STATUS_OK)
+    {
+        status = tags_sync_commit();
+    }
+    else
+    {
+        tags_sync_abort();
+    }
+
+    if (status != STATUS_OK)
+    {
+        // Leave the hash alone so the list is sent again
+        ERROR("Couldn't save new cards: %ld", status);
+        tags_sync_error(status);
+        _ctx.resends = 0;
+        return status;
+    }
+
+    // Store the curernt hash
+    if (sync->has_hash)
+    {
+        nvstate_tag_hash_set((uint8_t *) sync->hash, TAG_HASH_LEN);
+    }
+    _ctx.resends = 0;
+    xTimerStop(_ctx.resend_timer, portMAX_DELAY);
+    WARN("Done saving cards");
+    return STATUS_OK;
+}
+
+static void tags_sync_reply(msg_type_t type, uint32_t sync_id, uint32_t page)
+{
+    msg_t msg = {
+        .type = type,
+        .sync_page.sync_id = sync_id,
+        .sync_page.page = page,
+    };
+    client_send_msg(&msg);
+}
+
+static void tags_sync_error(status_t status)
+{
+    msg_t msg = {
+        .type = MSG_SYNC_ERROR,
+        .sync_error.sync_id = _ctx.sync_type == MSG_SYNC_PAGE ? _ctx.page_sync_id : 0,
+        .sync_error.status = status,
+        .sync_error.reason = _ctx.sync_error != NULL ? _ctx.sync_error : "couldn't store the list",
+    };
+    client_send_msg(&msg);
+}
+
+static bool tags_hash_matches(const uint8_t *hash)
+{
+    size_t hash_len;
+    uint8_t cur_hash[TAG_HASH_LEN];
+    nvstate_tag_hash(cur_hash, &hash_len);
+    return memcmp(cur_hash, hash, TAG_HASH_LEN) == 0;
+}
+
+static status_t tags_sync_begin(void)
+{
+    _ctx.sync_start = esp_timer_get_time();
+    _ctx.sync_error = NULL;
+    memset(&_ctx.new_records, 0, sizeof(tags_records_t));
+    memset(&_ctx.new_wide, 0, sizeof(tags_wide_t));
+
+    if (_ctx.use_image)
+    {
+        // The new image goes in another bank, swipes are checked against the
+        // current one (and its changes) until it's complete
+        return tag_image_begin((tag_image_format_t) nvstate_tag_format());
+    }
+
+    // Build the new index next to the current one, so swipes keep being
+    // checked against the old list until the new one is ready. The list
+    // length isn't known up front, the index grows as cards arrive.
+    status_t status = tag_index_init(&_ctx.new_index, 0);
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+
+    // Rewrite the file not in use. The current one is kept until the new
+    // one is complete, in case of a reset.
+    const char *filename = tags_filename((_ctx.bank + 1) % TAGS_FILE_BANKS);
+    fs_rm(filename);
+    status = fs_writer_open(&_ctx.new_file, filename, "w");
+    if (status != STATUS_OK)
+    {
+        tag_index_free(&_ctx.new_index);
+    }
+    return status;
+}
+
+static status_t tags_sync_add(const uint64_t *cards, const tag_attrs_t *attrs, size_t count)
+{
+    char file_line[24 + TAG_ATTRS_STR_LEN];
+    status_t status = STATUS_OK;
+
+    for (size_t i = 0; i < count && status == STATUS_OK; i++)
+    {
+        // Most cards have no attributes, and get no record
+        bool has_attrs = attrs != NULL && !tag_attrs_none(&attrs[i]);
+        if (has_attrs)
+        {
+            status = tags_records_add(&_ctx.new_records, cards[i], &attrs[i]);
+            if (status != STATUS_OK) { break; }
+        }
+
+        // Wide cards are gathered and stored at the end, apart from the
+        // 32-bit lookup
+        if (tag_wide(cards[i]))
+        {
+            status = tags_wide_add(&_ctx.new_wide, cards[i]);
+        }
+        else if (_ctx.use_image)
+        {
+            status = tag_image_add((uint32_t) cards[i]);
+        }
+        else
+        {
+            status = tag_index_add(&_ctx.new_index, (uint32_t) cards[i]);
+        }
+
+        if (!_ctx.use_image)
+        {
+            // We're reformatting: each card is delimited with a line feed,
+            // its attributes follow it on the line.
+            int len = sprintf(file_line, "%llu", (unsigned long long) cards[i]);
+            if (has_attrs) { len += tag_attrs_format(&attrs[i], &file_line[len]); }
+            file_line[len++] = '\n';
+            file_line[len] = '\0';
+            fs_writer_write(&_ctx.new_file, file_line, len);
+        }
+    }
+    return status;
+}
+
+static status_t tags_records_add(tags_records_t *records, uint64_t card, const tag_attrs_t *attrs)
+{
+    if (records->count == records->capacity)
+    {
+        size_t capacity = tags_grow(records->capacity, sizeof(tag_record_t));
+        if (capacity == 0)
+        {
+            ERROR("No room for more than %u cards with attributes", records->capacity);
+            _ctx.sync_error = "too many cards with attributes";
+            return -STATUS_NO_RESOURCE;
+        }
+
+        tag_record_t *grown = realloc(records->records, capacity * sizeof(tag_record_t));
+        if (grown == NULL)
+        {
+            return -STATUS_NOMEM;
+        }
+        records->records = grown;
+        records->capacity = capacity;
+    }
+
+    tag_record_t *record = &records->records[records->count++];
+    memset(record, 0, sizeof(tag_record_t));
+    record->card = card;
+    record->attrs = *attrs;
+    return STATUS_OK;
+}
+
+static status_t tags_wide_add(tags_wide_t *wide, uint64_t card)
+{
+    if (wide->count == wide->capacity)
+    {
+        size_t capacity = tags_grow(wide->capacity, sizeof(uint64_t));
+        if (capacity == 0)
+        {
+            ERROR("No room for more than %u cards over 32 bits", wide->capacity);
+            _ctx.sync_error = "too many cards over 32 bits";
+            return -STATUS_NO_RESOURCE;
+        }
+
+        uint64_t *grown = realloc(wide->cards, capacity * sizeof(uint64_t));
+        if (grown == NULL)
+        {
+            return -STATUS_NOMEM;
+        }
+        wide->cards = grown;
+        wide->capacity = capacity;
+    }
+
+    wide->cards[wide->count++] = card;
+    return STATUS_OK;
+}
+
+// New capacity of an array gathered while a list is stored, or 0 if the heap
+// can't spare any more. It doubles while there's room, then grows by less.
+// realloc may have to move it, so the whole array has to fit in one block.
+static size_t tags_grow(size_t capacity, size_t size)
+{
+    for (size_t step = capacity == 0 ? 64 : capacity; step >= 64; step /= 2)
+    {
+        if (heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) >= (capacity + step) * size &&
+            heap_caps_get_free_size(MALLOC_CAP_8BIT) >= step * size + TAGS_HEAP_RESERVE)
+        {
+            return capacity + step;
+        }
+    }
+    return 0;
+}
+
+static status_t tags_sync_commit(void)
+{
+    // The new list has no changes on top of it yet
+    tags_snapshot_t *snap = tags_snapshot_spare();
+    tag_index_free(&snap->added);
+    tag_index_free(&snap->removed);
+    status_t status = tag_index_init(&snap->added, 0);
+    if (status == STATUS_OK) { status = tag_index_init(&snap->removed, 0); }
+    size_t num_records = tag_record_sort(_ctx.new_records.records, _ctx.new_records.count);
+    size_t num_wide = tag_wide_sort(_ctx.new_wide.cards, _ctx.new_wide.count);
+
+    if (_ctx.use_image)
+    {
+        // The new image is checked by tag_image_commit(). Storing its bank
+        // is what switches over: a reset before that boots the old image.
+        uint8_t bank;
+        tag_image_records(_ctx.new_records.records, num_records);
+        tag_image_wide(_ctx.new_wide.cards, num_wide);
+        if (status == STATUS_OK) { status = tag_image_commit(&bank); }
+        free(_ctx.new_records.records);
+        memset(&_ctx.new_records, 0, sizeof(tags_records_t));
+        free(_ctx.new_wide.cards);
+        memset(&_ctx.new_wide, 0, sizeof(tags_wide_t));
+        if (status == STATUS_OK) { status = nvstate_tag_bank_set(bank); }
+        if (status != STATUS_OK)
+        {
+            tag_image_abort();
+            return status;
+        }
+
+        tag_image_switch();
+        tag_image_view(&snap->image);
+        snap->records = snap->image.records;
+        snap->num_records = snap->image.num_records;
+        snap->wide = snap->image.wide;
+        snap->num_wide = snap->image.num_wide;
+        tags_bloom_build(snap);
+        tags_snapshot_t *old = tags_snapshot_publish(snap);
+        tag_bloom_free(&old->bloom);
+        tags_digest_rebuild();
+
+        INFO("%u cards in tag image bank %u, built in %lld ms", tag_image_count() + snap->num_wide, bank,
+            (esp_timer_get_time() - _ctx.sync_start) / 1000);
+        return STATUS_OK;
+    }
+
+    // Same for the file: it's complete once it's on flash and reads back the
+    // way it was written, then the bank is switched over. Write errors are
+    // only reported here.
+    uint8_t bank = (_ctx.bank + 1) % TAGS_FILE_BANKS;
+    uint32_t crc;
+    uint32_t read_crc;
+    status_t close_status = fs_writer_close(&_ctx.new_file, &crc);
+    if (status == STATUS_OK) { status = close_status; }
+    if (status == STATUS_OK) { status = fs_crc(tags_filename(bank), &read_crc); }
+    if (status == STATUS_OK && read_crc != crc)
+    {
+        ERROR("New tags file doesn't match what was written");
+        status = -STATUS_IO;
+    }
+    if (status == STATUS_OK) { status = nvstate_tag_bank_set(bank); }
+    if (status != STATUS_OK)
+    {
+        tag_index_free(&_ctx.new_index);
+        free(_ctx.new_records.records);
+        memset(&_ctx.new_records, 0, sizeof(tags_records_t));
+        free(_ctx.new_wide.cards);
+        memset(&_ctx.new_wide, 0, sizeof(tags_wide_t));
+        return status;
+    }
+    _ctx.bank = bank;
+
+    // The old index is freed once no lookup uses it
+    snap->index = _ctx.new_index;
+    snap->records = _ctx.new_records.records;
+    snap->num_records = num_records;
+    snap->wide = _ctx.new_wide.cards;
+    snap->num_wide = num_wide;
+    memset(&_ctx.new_index, 0, sizeof(tag_index_t));
+    memset(&_ctx.new_records, 0, sizeof(tags_records_t));
+    memset(&_ctx.new_wide, 0, sizeof(tags_wide_t));
+    tags_bloom_build(snap);
+    tags_snapshot_t *old = tags_snapshot_publish(snap);
+    tag_index_free(&old->index);
+    tag_bloom_free(&old->bloom);
+    free((tag_record_t *) old->records);
+    old->records = NULL;
+    free((uint64_t *) old->wide);
+    old->wide = NULL;
+    tags_digest_rebuild();
+
+    INFO("%u cards indexed from %s, written in %lld ms", snap->index.count + snap->index.has_empty + snap->num_wide,
+        tags_filename(bank), (esp_timer_get_time() - _ctx.sync_start) / 1000);
+    return STATUS_OK;
+}
+
+static void tags_sync_abort(void)
+{
+    free(_ctx.page_tags);
+    _ctx.page_tags = NULL;
+    free(_ctx.page_attrs);
+    _ctx.page_attrs = NULL;
+
+    if (_ctx.sync_type == MSG_SYNC_ADD || _ctx.sync_type == MSG_SYNC_REMOVE)
+    {
+        free(_ctx.delta);
+        _ctx.delta = NULL;
+        return;
+    }
+    if (_ctx.skip)
+    {
+        return;
+    }
+
+    free(_ctx.new_records.records);
+    memset(&_ctx.new_records, 0, sizeof(tags_records_t));
+    free(_ctx.new_wide.cards);
+    memset(&_ctx.new_wide, 0, sizeof(tags_wide_t));
+    if (_ctx.use_image)
+    {
+        tag_image_abort();
+        return;
+    }
+
+    // The file may be incomplete, the list hash isn't stored so the next
+    // sync rewrites it
+    if (_ctx.new_file.file != NULL)
+    {
+        fs_writer_abort(&_ctx.new_file);
+    }
+    tag_index_free(&_ctx.new_index);
+}
+
+static status_t tags_delta_apply(const sync_payload_t *sync)
+{
+    // A change only makes sense on top of the list it was made from
+    if (!sync->has_base_hash || !sync->has_hash || !tags_hash_matches(sync->base_hash))
+    {
+        WARN("Card list change doesn't apply to the stored list");
+        return -STATUS_INVALID;
+    }
+
+    // Wide cards are only stored with a full list: the change log and the
+    // added and removed sets hold 32-bit cards
+    for (size_t i = 0; i < _ctx.delta_len; i++)
+    {
+        if (tag_wide(_ctx.delta[i]))
+        {
+            WARN("Card list change has cards over 32 bits");
+            return -STATUS_UNIMPL;
+        }
+    }
+
+    // The changes go into a copy of the current snapshot and of the digest,
+    // and both are only published once every change is in. If one fails,
+    // the spare snapshot is left as it is: it's overwritten before it's
+    // used again.
+    tags_snapshot_t *cur = &_ctx.snaps[tag_snap_current(&_ctx.snap)];
+    tags_snapshot_t *snap = tags_snapshot_spare();
+    snap->image = cur->image;
+    snap->index = cur->index;
+    snap->bloom = cur->bloom;
+    snap->records = cur->records;
+    snap->num_records = cur->num_records;
+    snap->wide = cur->wide;
+    snap->num_wide = cur->num_wide;
+    status_t status = tag_index_copy(&snap->added, &cur->added);
+    if (status == STATUS_OK) { status = tag_index_copy(&snap->removed, &cur->removed); }
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+
+    // Only the sync task changes the digest, it can be read without the lock
+    _ctx.new_digest = _ctx.digest;
+
+    // In RAM first, where a failure leaves nothing behind
+    tag_image_op_t op = _ctx.sync_type == MSG_SYNC_ADD ? TAG_IMAGE_LOG_ADD : TAG_IMAGE_LOG_REMOVE;
+    for (size_t i = 0; i < _ctx.delta_len && status == STATUS_OK; i++)
+    {
+        status = tags_overlay(snap, (uint32_t) _ctx.delta[i], op, &_ctx.new_digest);
+    }
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+
+    // Then on flash. The image keeps a log of changes, applied on top of it
+    // at boot. The file is appended to: removed cards get a line of their
+    // own, and are dropped when the file is loaded. A failure here may
+    // leave part of the change on flash, the caller then makes sure only a
+    // full list replaces it.
+    if (_ctx.use_image)
+    {
+        for (size_t i = 0; i < _ctx.delta_len && status == STATUS_OK; i++)
+        {
+            status = tag_image_log_append((uint32_t) _ctx.delta[i], op);
+        }
+    }
+    else
+    {
+        fs_writer_t tag_file;
+        status = fs_writer_open(&tag_file, tags_filename(_ctx.bank), "a");
+        if (status == STATUS_OK)
+        {
+            char file_line[16];
+            for (size_t i = 0; i < _ctx.delta_len; i++)
+            {
+                int len = sprintf(file_line, "%s%lu\n", op == TAG_IMAGE_LOG_ADD ? "" : "-", (uint32_t) _ctx.delta[i]);
+                fs_writer_write(&tag_file, file_line, len);
+            }
+            status = fs_writer_close(&tag_file, NULL);
+        }
+    }
+    if (status != STATUS_OK)
+    {
+        return status;
+    }
+
+    tags_snapshot_publish(snap);
+    xSemaphoreTake(_ctx.lock, portMAX_DELAY);
+    _ctx.digest = _ctx.new_digest;
+    xSemaphoreGive(_ctx.lock);
+    return STATUS_OK;
+}
+
+// digest: updated with the change, if it's not NULL
+static status_t tags_overlay(tags_snapshot_t *snap, uint32_t card, tag_image_op_t op, tag_digest_t *digest)
+{
+    bool present = tags_contains(snap, card, false);
+
+    // Each card is in at most one of the sets, and only when that changes
+    // what the image or file says
+    status_t status;
+    if (op == TAG_IMAGE_LOG_ADD)
+    {
+        tag_index_remove(&snap->removed, card);
+        status = tags_base_contains(snap, card, false) ? STATUS_OK : tag_index_add(&snap->added, card);
+        if (status == STATUS_OK && !present && digest != NULL)
+        {
+            tag_digest_add(digest, card);
+        }
+        return status;
+    }
+
+    tag_index_remove(&snap->added, card);
+    status = tags_base_contains(snap, card, false) ? tag_index_add(&snap->removed, card) : STATUS_OK;
+    if (status == STATUS_OK && present && digest != NULL)
+    {
+        tag_digest_remove(digest, card);
+    }
+    return status;
+}
+
+static void tags_log_replay(uint32_t card, tag_image_op_t op, void *ctx)
+{
+    // The digest is built once the changes are all in
+    if (tags_overlay((tags_snapshot_t *) ctx, card, op, NULL) != STATUS_OK)
+    {
+        ERROR("Not enough memory to replay card list changes");
+    }
+}
+
+static void tags_resend_timer_cb(TimerHandle_t timer)
+{
+    // Paged syncs start over from the first page
+    if (_ctx.resend_page)
+    {
+        tags_sync_reply(MSG_SYNC_RESUME, _ctx.resend_sync_id, 0);
+    }
+    else
+    {
+        tags_request_sync();
+    }
+}
+
+static void tags_request_sync(void)
+{
+    // The server answers with the full list
+    msg_t msg = {
+        .type = MSG_SYNC,
+    };
+    client_send_msg(&msg);
+}
+
+static tags_snapshot_t *tags_snapshot_get(void)
+{
+    return &_ctx.snaps[tag_snap_get(&_ctx.snap)];
+}
+
+static void tags_snapshot_put(tags_snapshot_t *snap)
+{
+    tag_snap_put(&_ctx.snap, snap - _ctx.snaps);
+}
+
+static tags_snapshot_t *tags_snapshot_spare(void)
+{
+    return &_ctx.snaps[tag_snap_spare(&_ctx.snap)];
+}
+
+static tags_snapshot_t *tags_snapshot_publish(tags_snapshot_t *snap)
+{
+    assert(snap == tags_snapshot_spare());
+    tags_snapshot_t *old = &_ctx.snaps[tag_snap_publish(&_ctx.snap, tags_snapshot_wait)];
+
+    // Only after the switch: a result cached along with the old count might
+    // still come from the old snapshot
+    atomic_fetch_add(&_ctx.changes, 1);
+    return old;
+}
+
+static void tags_snapshot_wait(void)
+{
+    // Lookups hold a reference for microseconds, a digest bucket reply for a
+    // few milliseconds
+    vTaskDelay(1);
+}
+
+// counted: the lookup goes into the filter stats. Only swipes are counted,
+// lookups made while changing the list would skew the false positive rate.
+static bool tags_contains(const tags_snapshot_t *snap, uint32_t card, bool counted)
+{
+    return tag_index_contains(&snap->added, card) ||
+        (tags_base_contains(snap, card, counted) && !tag_index_contains(&snap->removed, card));
+}
+
+static bool tags_base_contains(const tags_snapshot_t *snap, uint32_t card, bool counted)
+{
+    // Most unknown cards stop here, without searching the flash
+    if (!tag_bloom_maybe(&snap->bloom, card))
+    {
+        if (counted) { atomic_fetch_add_explicit(&_ctx.bloom_rejected, 1, memory_order_relaxed); }
+        return false;
+    }
+
+    bool found = _ctx.use_image ?
+        tag_image_contains(&snap->image, card) :
+        tag_index_contains(&snap->index, card);
+    if (counted && !found && snap->bloom.bits != NULL)
+    {
+        atomic_fetch_add_explicit(&_ctx.bloom_false, 1, memory_order_relaxed);
+    }
+    return found;
+}
+
+typedef struct {
+    const tags_snapshot_t *snap;
+    tags_card_cb_t cb;
+    void *ctx;
+} tags_foreach_ctx_t;
+
+static void tags_foreach(const tags_snapshot_t *snap, tags_card_cb_t cb, void *ctx)
+{
+    // Image or file cards that weren't removed since, then the added ones.
+    // No card is in both sets, so the added ones pass the same filter.
+    tags_foreach_ctx_t filter = {
+        .snap = snap,
+        .cb = cb,
+        .ctx = ctx,
+    };
+    if (_ctx.use_image)
+    {
+        tag_image_foreach(&snap->image, tags_foreach_base, &filter);
+    }
+    else
+    {
+        tag_index_foreach(&snap->index, tags_foreach_base, &filter);
+    }
+    tag_index_foreach(&snap->added, tags_foreach_base, &filter);
+
+    for (size_t i = 0; i < snap->num_wide; i++)
+    {
+        cb(snap->wide[i], ctx);
+    }
+}
+
+static void tags_foreach_base(uint32_t card, void *ctx)
+{
+    tags_foreach_ctx_t *filter = (tags_foreach_ctx_t *) ctx;
+    if (!tag_index_contains(&filter->snap->removed, card))
+    {
+        filter->cb(card, filter->ctx);
+    }
+}
+
+static void tags_bloom_build(tags_snapshot_t *snap)
+{
+    // Only cards of the image or file: added cards are checked before the
+    // filter, and removed ones after the image or file
+    size_t count = _ctx.use_image ? snap->image.count : snap->index.count + snap->index.has_empty;
+    if (tag_bloom_init(&snap->bloom, count, TAGS_BLOOM_MAX_BYTES) != STATUS_OK)
+    {
+        WARN("Not enough memory for the card filter, every lookup searches the list");
+        return;
+    }
+
+    if (_ctx.use_image)
+    {
+        tag_image_foreach(&snap->image, tags_bloom_card, &snap->bloom);
+    }
+    else
+    {
+        tag_index_foreach(&snap->index, tags_bloom_card, &snap->bloom);
+    }
+    INFO("Card filter: %u bytes, k=%u, %lu ppm false positives", tag_bloom_bytes(&snap->bloom),
+        snap->bloom.k, tag_bloom_fp_ppm(&snap->bloom));
+}
+
+static void tags_bloom_card(uint32_t card, void *ctx)
+{
+    tag_bloom_add((tag_bloom_t *) ctx, card);
+}
+
+static void tags_digest_rebuild(void)
+{
+    // Only the sync task publishes, so the current snapshot can't change
+    // under it
+    xSemaphoreTake(_ctx.lock, portMAX_DELAY);
+    tag_digest_clear(&_ctx.digest);
+    tags_foreach(&_ctx.snaps[tag_snap_current(&_ctx.snap)], tags_digest_card, &_ctx.digest);
+    xSemaphoreGive(_ctx.lock);
+}
+
+static void tags_digest_card(uint64_t card, void *ctx)
+{
+    tag_digest_add((tag_digest_t *) ctx, card);
+}
+
+static void tags_bucket_card(uint64_t card, void *ctx)
+{
+    tag_bucket_payload_t *bucket = (tag_bucket_payload_t *) ctx;
+    if (bucket->status != STATUS_OK || tag_digest_bucket_of(card) != bucket->bucket)
+    {
+        return;
+    }
+
+    // Grow by doubling. A bucket holds about 1/256 of the list.
+    size_t num_tags = bucket->num_tags;
+    if ((num_tags & (num_tags - 1)) == 0)
+    {
+        uint64_t *tags = realloc((uint64_t *) bucket->tags, (num_tags ? 2 * num_tags : 16) * sizeof(uint64_t));
+        if (tags == NULL)
+        {
+            bucket->status = -STATUS_NOMEM;
+            return;
+        }
+        bucket->tags = tags;
+    }
+    ((uint64_t *) bucket->tags)[bucket->num_tags++] = card;
+}
+
+static status_t tags_load(tag_index_t *index, tags_records_t *records, tags_wide_t *wide)
+{
+    const char *filename = tags_filename(_ctx.bank);
+    file_t tag_file = fs_open(filename, "r");
+    if (tag_file == NULL)
+    {
+        ERROR("Couldn't open %s", filename);
+        return -STATUS_NOFILE;
+    }
+
+    status_t status = tag_index_init(index, 0);
+    if (status != STATUS_OK)
+    {
+        fs_close(tag_file);
+        return status;
+    }
+
+    // One card per line with its attributes if it has any, or a removed
+    // card
+    char card_str[24 + TAG_ATTRS_STR_LEN];
+    while (fs_read(tag_file, card_str, sizeof(card_str)) == STATUS_OK)
+    {
+        // Cards removed by a change since the file was written
+        if (card_str[0] == '-')
+        {
+            tag_index_remove(index, (uint32_t) strtoul(&card_str[1], NULL, 10));
+            continue;
+        }
+
+        char *end;
+        tag_attrs_t attrs;
+        uint64_t card = (uint64_t) strtoull(card_str, &end, 10);
+        status = tag_wide(card) ? tags_wide_add(wide, card) : tag_index_add(index, (uint32_t) card);
+        if (status == STATUS_OK && tag_attrs_parse(end, &attrs) && !tag_attrs_none(&attrs))
+        {
+            status = tags_records_add(records, card, &attrs);
+        }
+        if (status != STATUS_OK)
+        {
+            ERROR("Not enough memory to index %s", filename);
+            break;
+        }
+    }
+
+    fs_close(tag_file);
+    return status;
+}
+
+static const char *tags_filename(uint8_t bank)
+{
+    return bank == 0 ? TAGS_FILENAME : TAGS_FILENAME_B;
+}
@@ -2,6 +2,8 @@
 #define TAGS_H_
 
 #include "status.h"
+#include "tag_record.h"
+#include <stdint.h>
 #include <stddef.h>
 
 /**
@@ -13,11 +15,23 @@
 status_t tags_init(void);
 
 /**
- * @brief Verify if the provided card is preset in the card database
- * @param card data to find
+ * @brief Verify if the provided card is preset in the card database. Safe to
+ * call from any task, and never waits for a sync in progress. 32-bit cards are
+ * looked up as fast as ever, longer ones (see tag_wide.h) by a short search.
+ * @param card data to find, up to 64 bits
+ * @param record filled in with the card and its attributes when it's found,
+ * all zero if it has none. May be NULL. The validity period isn't checked
+ * here: the caller has the time.
  * @return -STATUS_INVALID: card unauthorized, not in database
  *          STATUS_OK: card authorized
  */
-status_t tags_verify(uint32_t card);
+status_t tags_verify(uint64_t card, tag_record_t *record);
+
+/**
+ * @brief Number of changes to the card database since boot. Results of
+ * tags_verify() are stale once this changes: read it before verifying.
+ * @return change count
+ */
+uint32_t tags_changes(void);
 
 #endif /*TAGS_H_*/
\ No newline at end of file
@@ -1,75 +1,198 @@
 #include "wiegand.h"
 #include "wiegand_fmt.h"
+#include "wiegand_rmt.h"
 #include "log.h"
+#include "console.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "driver/rmt_rx.h"
+#include "driver/pulse_cnt.h"
+#include "esp_timer.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <assert.h>
 
 // Max number of event handlers allowed
 #define WIEG_MAX_HANDLERS   10U
 
-// If the parsing logic is waiting longer than this time, the card data is 
-// considered an error and thrown out
-#define WIEG_TIMEOUT        20U //ms
-
-// Task config
+// A gap this long after a bit ends the frame. Frames are told apart by their
+// length, so the end has to be found from the timing. Readers send bits 1-2 ms
+// apart, but the spec allows up to 20 ms, so slow readers need it raised with
+// wieg_gap. With RMT capture the gap is the channels' idle threshold, which
+// is at most 32767 ticks.
+#ifndef WIEG_GAP
+#define WIEG_GAP            5U //ms
+#endif /*WIEG_GAP*/
+#define WIEG_GAP_MAX        30U //ms
+
+// RMT capture
+#define WIEG_RMT_RESOLUTION 1000000U    // 1 us ticks
+#define WIEG_RMT_FILTER     3000U //ns, the channel filter takes up to 255 ticks of its 80 MHz clock
+#define WIEG_RMT_MEM        48U         // Symbols of channel memory, one block
+#define WIEG_RMT_SYMBOLS    96U         // Received on a line during one frame
+#define WIEG_RMT_BURSTS     16U         // Buffers received on a line during one frame
+#define WIEG_RMT_SETTLE     1000U //us, for the last buffers to come in
+#define WIEG_PCNT_FILTER    1000U //ns
+
+// Burst times are taken in the RX done callback, which must run on time
+#if !CONFIG_RMT_RX_ISR_CACHE_SAFE || !CONFIG_RMT_RECV_FUNC_IN_IRAM || !CONFIG_PCNT_CTRL_FUNC_IN_IRAM
+#error "RMT capture needs CONFIG_RMT_RX_ISR_CACHE_SAFE, CONFIG_RMT_RECV_FUNC_IN_IRAM and CONFIG_PCNT_CTRL_FUNC_IN_IRAM"
+#endif
+
+// Timing histogram buckets. Bucket n counts times of 2^n to 2^(n+1) us, and
+// the last one everything longer.
+#define WIEG_HIST_BUCKETS   24U
+
+// Complete frames waiting for the task. Power of 2.
+#define WIEG_FRAMES         4U
+
+// Cards waiting for the swipe handlers
+#define WIEG_EVENTS         8U
+
+// Task config. Swipe handlers run on the event task, so the decode task
+// never waits on them. The decode task still logs bad frames, and logging
+// needs most of its stack.
 #define WIEGAND_TASK_NAME   "Wiegand_Task" 
 #define WIEGAND_TASK_STACK  4096U
 #define WIEGAND_TASK_PRIO   2U
 
+#define WIEGAND_EVT_TASK_NAME   "Wiegand_Evt"
+#define WIEGAND_EVT_TASK_STACK  4096U
+#define WIEGAND_EVT_TASK_PRIO   1U
+
 typedef struct {
-    int num_swipes;     // Number of ttoal swipes. This counts swipes with bad parity, but not timeouts.
+    int num_swipes;     // Number of ttoal swipes. This counts swipes with bad parity or length.
     int num_bad_parity; // Number of swipes with a bad parity calculation
-    int num_timeout;    // Number of times the parsing logic times out waiting for another bit
+    int num_unknown;    // Number of swipes no enabled format is this long
+    int num_overrun;    // Frames dropped because the task fell behind, or too long to capture
+    int num_filtered;   // Pulses too short or long to be bits, RMT capture only
+    int num_dropped;    // Cards dropped because the handlers fell behind
+    int num_fmt[WIEG_NUM_ENCODINGS]; // Good swipes of each format
+    uint32_t hist_bit[WIEG_HIST_BUCKETS];   // Times between bits of a frame
+    uint32_t hist_gap[WIEG_HIST_BUCKETS];   // Times between frames
+    int64_t latency_last;   // Last bit to the handlers returning, us
+    int64_t latency_max;
 } wiegand_stats_t;
 
-typedef enum {
-    PARITY_EVEN,        // Total number of set bits is even (including parity)      
-    PARITY_ODD,         // Total number of set bits is odd (including parity)
-} parity_t;
+// Bits of one card, assembled by the ISR
+typedef struct {
+    uint64_t bits;      // The first bit received is the most significant
+    uint32_t num_bits;
+    int64_t start;      // Times of the first and last edge, us since boot
+    int64_t end;
+} wieg_frame_t;
 
 typedef struct {
     void *ctx;
     wieg_evt_t event;
     wieg_evt_cb_t cb;
+    uint32_t num_calls;
+    int64_t time_last;      // Time spent in the handler, us
+    int64_t time_max;
+    int64_t time_total;
 } handlers_t;
 
+// A card waiting for the handlers
+typedef struct {
+    card_t card;
+    int64_t end;            // Last bit of the frame, us since boot
+} wieg_event_t;
+
+// Buffers an RMT RX channel received during a frame, one after another
+typedef struct {
+    uint32_t used;                          // Symbols received
+    uint32_t num;
+    uint32_t len[WIEG_RMT_BURSTS];
+    int64_t end[WIEG_RMT_BURSTS];           // Last rising edge of each, us since boot
+    bool overflow;
+} wieg_rmt_bursts_t;
+
+// One line captured by an RMT RX channel. The channel stops each time the
+// line idles for the gap, so a frame comes in as one or more bursts.
+typedef struct {
+    rmt_channel_handle_t chan;
+    rmt_symbol_word_t syms[WIEG_RMT_SYMBOLS];
+    wieg_rmt_bursts_t bursts;               // Guarded by the lock
+    uint32_t idle_us;                       // Threshold the channel was started with
+} wieg_rmt_rx_t;
+
 typedef struct {
     handlers_t handlers[WIEG_MAX_HANDLERS];
-    const wieg_fmt_desc_t *fmt;
-    QueueHandle_t pin_q;
+    uint32_t encodings;     // Formats to detect, WIEG_ENCODING() bits
     wiegand_stats_t stats;
+    TaskHandle_t task;
+    TaskHandle_t evt_task;
+    QueueHandle_t events;
+
+    // Frame being received. The ISR adds bits, and whoever sees the gap after
+    // the last one closes it: the gap timer, or the ISR at the next frame's
+    // first edge if the timer runs late.
+    portMUX_TYPE lock;      // Guards rx and closing frames
+    wieg_frame_t rx;
+    int64_t last_end;       // Last bit of the previous frame, 0 before any
+    uint32_t gap_us;
+    esp_timer_handle_t timer;
+    wieg_capture_t capture;
+
+    // RMT capture, indexed by the bit of each line. The channels only say
+    // when a burst ends, so a PCNT unit counts the falling edges of both
+    // lines to tell if either is still receiving. Frames are put together on
+    // the gap timer, once neither line has had an edge for the gap.
+    wieg_rmt_rx_t rmt[2];
+    pcnt_unit_handle_t pcnt;
+    int rmt_edges;                          // Edge count when last looked at
+    wieg_rmt_line_t lines[2];
+    int64_t rmt_times[WIEG_RMT_PULSES_MAX];
+
+    // Hand-off of complete frames. Frames are only added under the lock and
+    // only the task moves tail, so the task never waits on the ISR.
+    wieg_frame_t frames[WIEG_FRAMES];
+    atomic_uint head;
+    atomic_uint tail;
 } wieg_ctx_t;
 
 static wieg_ctx_t _ctx;
 
-static const int bit_0 = 0;
-static const int bit_1 = 1;
-
 // Helpers
 void wieg_task(void *params);
-
-static bool wieg_is_parity_good(const wieg_fmt_desc_t *fmt, uint32_t bits);
-static void bits_to_card(const wieg_fmt_desc_t *fmt, uint32_t bits, card_t *card);
-static bool parity(parity_t parity, uint32_t num);
+void wieg_evt_task(void *params);
+int _wieg_stats(int argc, char **argv);
+int _wieg_gap(int argc, char **argv);
+
+static void wieg_frame(wieg_ctx_t *ctx, const wieg_frame_t *frame);
+static void wieg_gap_timer(void *arg);
+static bool wieg_close(wieg_ctx_t *ctx, int64_t now);
+static void wieg_push(wieg_ctx_t *ctx, const wieg_frame_t *frame);
+static void wieg_capture_gpio(int d0, int d1);
+static status_t wieg_capture_rmt(wieg_ctx_t *ctx, int d0, int d1);
+static esp_err_t wieg_rmt_receive(wieg_ctx_t *ctx, wieg_rmt_rx_t *rx, uint32_t offset);
+static bool wieg_rmt_done(rmt_channel_handle_t chan, const rmt_rx_done_event_data_t *edata, void *user_ctx);
+static void wieg_rmt_timer(void *arg);
+static void wieg_hist_add(uint32_t *hist, int64_t us);
+static void wieg_hist_print(const char *name, const uint32_t *hist);
 static void gpio_interrupt_handler(void *args);
 
-status_t wieg_init(int d0, int d1, wieg_encoding_t encode)
+status_t wieg_init(int d0, int d1, uint32_t encodings, wieg_capture_t capture)
 {
-    // TODO: Implement 32-bit mode
-    if (encode == WIEG_32_BIT)
+    if (encodings == 0 || encodings >= WIEG_ENCODING(WIEG_NUM_ENCODINGS) || capture > WIEG_CAPTURE_RMT)
     {
-        ERROR("wiegand 32-bit mode not supported");
-        return -STATUS_UNIMPL;
+        return -STATUS_INVAL;
     }
 
-    _ctx.fmt = encode == WIEG_24_BIT ? &wieg_fmt_24bit : &wieg_fmt_32bit;
+    _ctx.encodings = encodings;
+    _ctx.capture = capture;
+    for (int i = 0; i < WIEG_NUM_ENCODINGS; i++)
+    {
+        if (encodings & WIEG_ENCODING(i)) { INFO("Reading %s cards", wieg_fmts[i].name); }
+    }
 
     for (int i=0; i<WIEG_MAX_HANDLERS; i++)
     {
@@ -78,35 +201,60 @@ status_t wieg_init(int d0, int d1, wieg_encoding_t encode)
 
     memset(&_ctx.stats, 0, sizeof(wiegand_stats_t));
 
-    // Set up gpio. Wiegand signals begin with a negative edge, so detect those 
-    // for new bits
-    gpio_set_direction(d0, GPIO_MODE_INPUT);
-    gpio_set_pull_mode(d0, GPIO_FLOATING);
-    gpio_set_intr_type(d0, GPIO_INTR_NEGEDGE);
-
-    gpio_set_direction(d1, GPIO_MODE_INPUT);
-    gpio_set_pull_mode(d1, GPIO_FLOATING);
-    gpio_set_intr_type(d1, GPIO_INTR_NEGEDGE);
+    portMUX_INITIALIZE(&_ctx.lock);
+    _ctx.gap_us = WIEG_GAP * 1000U;
+    _ctx.last_end = 0;
+
+    // The ISR arms the timer as a frame starts. It runs on the esp_timer
+    // task, so the end of a frame is seen within a few us of the gap rather
+    // than at the next tick.
+    const esp_timer_create_args_t timer_args = {
+        .callback = capture == WIEG_CAPTURE_RMT ? wieg_rmt_timer : wieg_gap_timer,
+        .arg = &_ctx,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wieg_gap",
+    };
+    if (esp_timer_create(&timer_args, &_ctx.timer) != ESP_OK)
+    {
+        return -STATUS_NOMEM;
+    }
 
-    // Set up the pin ISRs. The ctx provided defines the bit that each ISR adds 
-    // to the card data.
-    gpio_install_isr_service(0);
-    gpio_isr_handler_add(d0, gpio_interrupt_handler, (void *)&bit_0);
-    gpio_isr_handler_add(d1, gpio_interrupt_handler, (void *)&bit_1);
+    // Cards are queued for the handlers, so a handler that blocks can only
+    // drop cards once the queue fills. Capture and decode carry on.
+    _ctx.events = xQueueCreate(WIEG_EVENTS, sizeof(wieg_event_t));
+    if (_ctx.events == NULL) { return -STATUS_NOMEM; }
+    if (xTaskCreate(wieg_evt_task, WIEGAND_EVT_TASK_NAME, WIEGAND_EVT_TASK_STACK, &_ctx,
+        WIEGAND_EVT_TASK_PRIO, &_ctx.evt_task) != pdPASS)
+    {
+        return -STATUS_NOMEM;
+    }
 
-    // Set up queue for new bits and start task
-    _ctx.pin_q = xQueueCreate(_ctx.fmt->total_bits, sizeof(int));
-    
-    // Make task
+    // The task is notified as frames end, so it has to exist before the
+    // first edge
     xTaskCreate(
         wieg_task, 
         WIEGAND_TASK_NAME, 
         WIEGAND_TASK_STACK, 
         &_ctx, 
         WIEGAND_TASK_PRIO, 
-        NULL
+        &_ctx.task
     );
 
+    if (capture == WIEG_CAPTURE_RMT)
+    {
+        status_t status = wieg_capture_rmt(&_ctx, d0, d1);
+        if (status != STATUS_OK)
+        {
+            return status;
+        }
+    }
+    else
+    {
+        wieg_capture_gpio(d0, d1);
+    }
+
+    console_register("wieg_stats", "show card reader stats", NULL, _wieg_stats);
+    console_register("wieg_gap", "show or set the gap that ends a card, ms", NULL, _wieg_gap);
     return STATUS_OK;
 }
 
@@ -124,8 +272,12 @@ wieg_evt_handle_t wieg_evt_handler_reg(wieg_evt_t event, wieg_evt_cb_t cb, void
         if (_ctx.handlers[i].cb == NULL)
         {
             _ctx.handlers[i].event = event;
-            _ctx.handlers[i].cb = cb;
             _ctx.handlers[i].ctx = ctx;
+            _ctx.handlers[i].num_calls = 0;
+            _ctx.handlers[i].time_last = 0;
+            _ctx.handlers[i].time_max = 0;
+            _ctx.handlers[i].time_total = 0;
+            _ctx.handlers[i].cb = cb;
             return (void *) &_ctx.handlers[i];
         }
     }
@@ -148,115 +300,532 @@ void wieg_task(void *params)
     assert(params);
 
     wieg_ctx_t *ctx = (wieg_ctx_t *) params;
-    int ptr = ctx->fmt->total_bits - 1;
-    uint32_t bits = 0;
-    int bit = 0;
-    card_t card;
 
     while (1)
     {
-        bit = 0;
-        if (xQueueReceive(ctx->pin_q, &bit, pdMS_TO_TICKS(WIEG_TIMEOUT)))
+        // Notified whenever a frame is closed
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        unsigned int tail = atomic_load_explicit(&ctx->tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&ctx->head, memory_order_acquire))
         {
-            // Record new bit to data
-            bits |= (bit << ptr);
+            wieg_frame_t frame = ctx->frames[tail % WIEG_FRAMES];
+            atomic_store_explicit(&ctx->tail, ++tail, memory_order_release);
+            wieg_frame(ctx, &frame);
+        }
+    }
+}
 
-            // Check if we have complete card data yet
-            if (ptr == 0)
-            {
-                // Track swipes
-                ctx->stats.num_swipes++;
+void wieg_evt_task(void *params)
+{
+    assert(params);
 
-                // Verify card data
-                if (wieg_is_parity_good(ctx->fmt, bits))
-                {
-                    // Card data is valid, format bits into readable card data
-                    bits_to_card(ctx->fmt, bits, &card);
-
-                    // Fire NEWCARD events
-                    for (int i=0; i<WIEG_MAX_HANDLERS; i++)
-                    {
-                        if(ctx->handlers[i].cb != NULL && ctx->handlers[i].event == WIEG_EVT_NEWCARD)
-                        {
-                            ctx->handlers[i].cb(
-                                WIEG_EVT_NEWCARD,
-                                &card,
-                                ctx->handlers[i].ctx
-                            );
-                        }
-                    }
-                }
-                else
+    wieg_ctx_t *ctx = (wieg_ctx_t *) params;
+    wieg_event_t evt;
+
+    while (1)
+    {
+        xQueueReceive(ctx->events, &evt, portMAX_DELAY);
+
+        // Fire NEWCARD events
+        for (int i=0; i<WIEG_MAX_HANDLERS; i++)
+        {
+            handlers_t *handler = &ctx->handlers[i];
+            if(handler->cb != NULL && handler->event == WIEG_EVT_NEWCARD)
+            {
+                int64_t start = esp_timer_get_time();
+                handler->cb(
+                    WIEG_EVT_NEWCARD,
+                    &evt.card,
+                    handler->ctx
+                );
+                handler->time_last = esp_timer_get_time() - start;
+                handler->time_total += handler->time_last;
+                handler->num_calls++;
+                if (handler->time_last > handler->time_max)
                 {
-                    // Parity check failed, report bad scan
-                    ctx->stats.num_bad_parity++;
-                    ERROR("New swipe fails parity check: %lu", bits);
+                    handler->time_max = handler->time_last;
                 }
-
-                // Clear data to prepare for new card
-                bits = 0;
-                ptr = ctx->fmt->total_bits;
             }
-            
-            ptr--;
         }
-        else
+
+        ctx->stats.latency_last = esp_timer_get_time() - evt.end;
+        if (ctx->stats.latency_last > ctx->stats.latency_max)
         {
-            // Timeout before we got all the bits. Clear and start over
-            bits = 0;
-            ptr = ctx->fmt->total_bits - 1;
+            ctx->stats.latency_max = ctx->stats.latency_last;
         }
     }
 }
 
-static void bits_to_card(const wieg_fmt_desc_t *fmt, uint32_t bits, card_t *card)
+static void wieg_frame(wieg_ctx_t *ctx, const wieg_frame_t *frame)
 {
-    assert(card);
+    wieg_event_t evt;
+
+    // Track swipes
+    ctx->stats.num_swipes++;
+
+    // The format is the first enabled one of this length with good parity
+    const wieg_fmt_desc_t *fmt = NULL;
+    bool known_len = false;
+    for (int i = 0; i < WIEG_NUM_ENCODINGS && fmt == NULL; i++)
+    {
+        if ((ctx->encodings & WIEG_ENCODING(i)) == 0 || wieg_fmts[i].total_bits != frame->num_bits)
+        {
+            continue;
+        }
+        known_len = true;
+        if (wieg_fmt_parity_good(&wieg_fmts[i], frame->bits))
+        {
+            fmt = &wieg_fmts[i];
+            ctx->stats.num_fmt[i]++;
+        }
+    }
 
-    card->raw = 0;
-    card->user_id = (uint16_t) ((bits & fmt->uid_mask) >> fmt->uid_offset);
-    card->facility = (uint16_t) ((bits & fmt->fac_mask) >> fmt->fac_offset);
+    if (!known_len)
+    {
+        ctx->stats.num_unknown++;
+        WARN("New swipe has %lu bits, no format matches", frame->num_bits);
+        return;
+    }
+    if (fmt == NULL)
+    {
+        // Parity check failed, report bad scan
+        ctx->stats.num_bad_parity++;
+        ERROR("New swipe fails parity check: 0x%llx", frame->bits);
+        return;
+    }
+
+    // Card data is valid, format bits into readable card data and hand it
+    // to the event task
+    wieg_fmt_decode(fmt, frame->bits, &evt.card);
+    evt.end = frame->end;
+    if (xQueueSend(ctx->events, &evt, 0) != pdTRUE)
+    {
+        ctx->stats.num_dropped++;
+        ERROR("Swipe handlers are behind, card dropped");
+    }
 }
 
-static bool wieg_is_parity_good(const wieg_fmt_desc_t *fmt, uint32_t bits)
+static void wieg_gap_timer(void *arg)
 {
-    assert(fmt);
+    wieg_ctx_t *ctx = (wieg_ctx_t *) arg;
+    int64_t now = esp_timer_get_time();
+    int64_t left = 0;
+
+    // The timer is armed once per frame, when it starts. If bits came in
+    // since, it's armed again for what remains of the gap after the last one.
+    portENTER_CRITICAL(&ctx->lock);
+    bool closed = wieg_close(ctx, now);
+    if (ctx->rx.num_bits > 0)
+    {
+        left = ctx->rx.end + ctx->gap_us - now;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
 
-    // Calc high parity (which is always even)
-    uint64_t high = bits & fmt->high_mask;
-    bool high_parity = parity(PARITY_EVEN, high);
-    if (WIEG_HIGH_PARITY_BIT(fmt, bits) != high_parity) { return false; }
+    // Fails if the ISR has already armed it for a new frame, which is fine
+    if (left > 0)
+    {
+        esp_timer_start_once(ctx->timer, (uint64_t) left);
+    }
+    if (closed)
+    {
+        xTaskNotifyGive(ctx->task);
+    }
+}
 
-    // calc low parity (which is always odd)
-    uint64_t low = bits & fmt->low_mask;
-    bool low_parity = parity(PARITY_ODD, low);
-    if (WIEG_LOW_PARITY_BIT(fmt, bits) != low_parity) { return false; }
+static void wieg_capture_gpio(int d0, int d1)
+{
+    // Set up gpio. Wiegand signals begin with a negative edge, so detect those 
+    // for new bits
+    gpio_set_direction(d0, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(d0, GPIO_FLOATING);
+    gpio_set_intr_type(d0, GPIO_INTR_NEGEDGE);
 
-    return true;
+    gpio_set_direction(d1, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(d1, GPIO_FLOATING);
+    gpio_set_intr_type(d1, GPIO_INTR_NEGEDGE);
+
+    // Set up the pin ISRs. The ctx provided is the bit that each ISR adds to
+    // the card data.
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add(d0, gpio_interrupt_handler, (void *) 0);
+    gpio_isr_handler_add(d1, gpio_interrupt_handler, (void *) 1);
 }
 
-static bool parity(parity_t parity, uint32_t num)
+static status_t wieg_capture_rmt(wieg_ctx_t *ctx, int d0, int d1)
 {
-    // By setting the initial value, the parity calculation can be either:
-    // - even: initialize with 0
-    // - odd: initialize with 1
-    bool p = (bool) parity;
-    for (int i=0; i<32; i++)
+    const int pins[2] = { d0, d1 };
+
+    // Edges of both lines are counted together, only changes matter
+    const pcnt_unit_config_t unit_cfg = {
+        .low_limit = -1,
+        .high_limit = INT16_MAX,
+    };
+    const pcnt_glitch_filter_config_t filter_cfg = {
+        .max_glitch_ns = WIEG_PCNT_FILTER,
+    };
+    if (pcnt_new_unit(&unit_cfg, &ctx->pcnt) != ESP_OK)
     {
-        p ^= (num >> i) & 1;
+        ERROR("Couldn't get a PCNT unit");
+        return -STATUS_NO_RESOURCE;
     }
-    return p;
+    pcnt_unit_set_glitch_filter(ctx->pcnt, &filter_cfg);
+
+    for (int i = 0; i < 2; i++)
+    {
+        wieg_rmt_rx_t *rx = &ctx->rmt[i];
+        const rmt_rx_channel_config_t chan_cfg = {
+            .gpio_num = pins[i],
+            .clk_src = RMT_CLK_SRC_DEFAULT,
+            .resolution_hz = WIEG_RMT_RESOLUTION,
+            .mem_block_symbols = WIEG_RMT_MEM,
+        };
+        const rmt_rx_event_callbacks_t cbs = {
+            .on_recv_done = wieg_rmt_done,
+        };
+        const pcnt_chan_config_t pcnt_cfg = {
+            .edge_gpio_num = pins[i],
+            .level_gpio_num = -1,
+        };
+        pcnt_channel_handle_t pcnt_chan;
+
+        if (rmt_new_rx_channel(&chan_cfg, &rx->chan) != ESP_OK ||
+            pcnt_new_channel(ctx->pcnt, &pcnt_cfg, &pcnt_chan) != ESP_OK)
+        {
+            ERROR("Couldn't get RMT and PCNT channels for gpio %d", pins[i]);
+            return -STATUS_NO_RESOURCE;
+        }
+        pcnt_channel_set_edge_action(pcnt_chan, PCNT_CHANNEL_EDGE_ACTION_HOLD, PCNT_CHANNEL_EDGE_ACTION_INCREASE);
+
+        memset(&rx->bursts, 0, sizeof(wieg_rmt_bursts_t));
+        if (rmt_rx_register_event_callbacks(rx->chan, &cbs, rx) != ESP_OK ||
+            rmt_enable(rx->chan) != ESP_OK ||
+            wieg_rmt_receive(ctx, rx, 0) != ESP_OK)
+        {
+            return -STATUS_IO;
+        }
+    }
+
+    if (pcnt_unit_enable(ctx->pcnt) != ESP_OK ||
+        pcnt_unit_clear_count(ctx->pcnt) != ESP_OK ||
+        pcnt_unit_start(ctx->pcnt) != ESP_OK)
+    {
+        return -STATUS_IO;
+    }
+    return STATUS_OK;
+}
+
+// Start receiving into the line's buffer from offset
+static esp_err_t IRAM_ATTR wieg_rmt_receive(wieg_ctx_t *ctx, wieg_rmt_rx_t *rx, uint32_t offset)
+{
+    rx->idle_us = ctx->gap_us;
+    const rmt_receive_config_t cfg = {
+        .signal_range_min_ns = WIEG_RMT_FILTER,
+        .signal_range_max_ns = rx->idle_us * 1000U,
+    };
+    return rmt_receive(
+        rx->chan,
+        &rx->syms[offset],
+        (WIEG_RMT_SYMBOLS - offset) * sizeof(rmt_symbol_word_t),
+        &cfg
+    );
+}
+
+// Runs in the RMT ISR, once a line has been idle for the gap. That's an
+// interrupt per burst of bits on a line, rather than one per bit.
+//
+// The burst's end is worked out from when this runs, so it has to run on
+// time. The RX ISR is cache safe (CONFIG_RMT_RX_ISR_CACHE_SAFE), and this and
+// everything it calls is in IRAM (CONFIG_RMT_RECV_FUNC_IN_IRAM,
+// CONFIG_PCNT_CTRL_FUNC_IN_IRAM, CONFIG_ESP_TIMER_IN_IRAM): a flash write or
+// erase doesn't hold it back, and put the bursts of two lines out of order.
+static bool IRAM_ATTR wieg_rmt_done(rmt_channel_handle_t chan, const rmt_rx_done_event_data_t *edata, void *user_ctx)
+{
+    wieg_rmt_rx_t *rx = (wieg_rmt_rx_t *) user_ctx;
+    wieg_rmt_bursts_t *bursts = &rx->bursts;
+    int64_t now = esp_timer_get_time();
+    int edges = 0;
+    pcnt_unit_get_count(_ctx.pcnt, &edges);
+
+    // The channel stopped when the idle threshold ran out, so the last edge
+    // was that long ago
+    portENTER_CRITICAL_ISR(&_ctx.lock);
+    if (bursts->num < WIEG_RMT_BURSTS && bursts->used + edata->num_symbols < WIEG_RMT_SYMBOLS)
+    {
+        bursts->len[bursts->num] = edata->num_symbols;
+        bursts->end[bursts->num] = now - rx->idle_us;
+        bursts->num++;
+        bursts->used += edata->num_symbols;
+    }
+    else
+    {
+        bursts->overflow = true;
+    }
+    uint32_t offset = bursts->used;
+    _ctx.rmt_edges = edges;
+    portEXIT_CRITICAL_ISR(&_ctx.lock);
+
+    // Listen for the rest of the frame straight away, and look for the end
+    // of the frame once this line could have gone quiet for the gap
+    wieg_rmt_receive(&_ctx, rx, offset);
+    esp_timer_stop(_ctx.timer);
+    esp_timer_start_once(_ctx.timer, _ctx.gap_us + WIEG_RMT_SETTLE);
+    return false;
+}
+
+static void wieg_rmt_timer(void *arg)
+{
+    wieg_ctx_t *ctx = (wieg_ctx_t *) arg;
+    wieg_rmt_bursts_t bursts[2];
+    int edges = 0;
+    pcnt_unit_get_count(ctx->pcnt, &edges);
+
+    // An edge since the last look means a line is still in a burst, and its
+    // buffer only comes in once it has been idle for the gap. With no edge
+    // for that long, every burst of the frame has come in, and nothing is
+    // written to the buffers below used until the channels are restarted.
+    portENTER_CRITICAL(&ctx->lock);
+    bool quiet = edges == ctx->rmt_edges;
+    ctx->rmt_edges = edges;
+    for (int i = 0; i < 2 && quiet; i++)
+    {
+        bursts[i] = ctx->rmt[i].bursts;
+        memset(&ctx->rmt[i].bursts, 0, sizeof(wieg_rmt_bursts_t));
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+
+    if (!quiet)
+    {
+        esp_timer_start_once(ctx->timer, ctx->gap_us + WIEG_RMT_SETTLE);
+        return;
+    }
+
+    bool overflow = false;
+    memset(ctx->lines, 0, sizeof(ctx->lines));
+    for (int i = 0; i < 2; i++)
+    {
+        wieg_rmt_rx_t *rx = &ctx->rmt[i];
+        uint32_t offset = 0;
+        for (uint32_t b = 0; b < bursts[i].num; b++)
+        {
+            wieg_rmt_line_add(&ctx->lines[i], &rx->syms[offset].val, bursts[i].len[b], bursts[i].end[b],
+                WIEG_RMT_RESOLUTION);
+            offset += bursts[i].len[b];
+        }
+        overflow |= bursts[i].overflow || ctx->lines[i].overflow;
+        ctx->stats.num_filtered += (int) ctx->lines[i].num_filtered;
+
+        // Start over at the beginning of the buffer. Stopping the channel
+        // drops its pending receive.
+        rmt_disable(rx->chan);
+        rmt_enable(rx->chan);
+        wieg_rmt_receive(ctx, rx, 0);
+    }
+
+    // An edge while the channels were restarted was missed, and the frame it
+    // starts will be cut short
+    pcnt_unit_get_count(ctx->pcnt, &edges);
+    portENTER_CRITICAL(&ctx->lock);
+    if (edges != ctx->rmt_edges)
+    {
+        ctx->stats.num_overrun++;
+        ctx->rmt_edges = edges;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+
+    wieg_frame_t frame;
+    frame.num_bits = wieg_rmt_merge(&ctx->lines[0], &ctx->lines[1], &frame.bits, ctx->rmt_times,
+        WIEG_RMT_PULSES_MAX);
+    if (frame.num_bits == 0)
+    {
+        // Only glitches
+        return;
+    }
+    frame.start = ctx->rmt_times[0];
+    frame.end = ctx->rmt_times[(frame.num_bits < WIEG_RMT_PULSES_MAX ? frame.num_bits : WIEG_RMT_PULSES_MAX) - 1];
+
+    for (uint32_t i = 1; i < frame.num_bits && i < WIEG_RMT_PULSES_MAX; i++)
+    {
+        wieg_hist_add(ctx->stats.hist_bit, ctx->rmt_times[i] - ctx->rmt_times[i - 1]);
+    }
+
+    portENTER_CRITICAL(&ctx->lock);
+    if (ctx->last_end != 0)
+    {
+        wieg_hist_add(ctx->stats.hist_gap, frame.start - ctx->last_end);
+    }
+    if (overflow)
+    {
+        ctx->stats.num_overrun++;
+    }
+    else
+    {
+        wieg_push(ctx, &frame);
+    }
+    ctx->last_end = frame.end;
+    portEXIT_CRITICAL(&ctx->lock);
+
+    if (!overflow)
+    {
+        xTaskNotifyGive(ctx->task);
+    }
+}
+
+static void wieg_hist_print(const char *name, const uint32_t *hist)
+{
+    printf("%s:\n", name);
+    for (int i = 0; i < WIEG_HIST_BUCKETS; i++)
+    {
+        if (hist[i] == 0)
+        {
+            continue;
+        }
+        if (i == WIEG_HIST_BUCKETS - 1)
+        {
+            printf("    %9lu us and over: %lu\n", 1UL << i, hist[i]);
+        }
+        else
+        {
+            printf("    %9lu - %9lu us: %lu\n", 1UL << i, (1UL << (i + 1)) - 1, hist[i]);
+        }
+    }
+}
+
+int _wieg_stats(int argc, char **argv)
+{
+    // The high water marks cover the deepest decode seen so far, and the
+    // deepest swipe handler
+    printf("Capture: %s\n", _ctx.capture == WIEG_CAPTURE_RMT ? "RMT" : "GPIO interrupts");
+    printf("Swipes: %d, bad parity %d, unknown length %d, overruns %d, filtered pulses %d\n",
+        _ctx.stats.num_swipes, _ctx.stats.num_bad_parity, _ctx.stats.num_unknown,
+        _ctx.stats.num_overrun, _ctx.stats.num_filtered);
+    printf("Cards waiting for handlers: %u of %u, dropped %d\n",
+        (unsigned int) uxQueueMessagesWaiting(_ctx.events), WIEG_EVENTS, _ctx.stats.num_dropped);
+    for (int i = 0; i < WIEG_NUM_ENCODINGS; i++)
+    {
+        if (_ctx.encodings & WIEG_ENCODING(i))
+        {
+            printf("    %-24s %d\n", wieg_fmts[i].name, _ctx.stats.num_fmt[i]);
+        }
+    }
+    printf("Frame gap: %lu ms, last bit to decision: last %lld us, max %lld us\n",
+        _ctx.gap_us / 1000U, _ctx.stats.latency_last, _ctx.stats.latency_max);
+    wieg_hist_print("Between bits", _ctx.stats.hist_bit);
+    wieg_hist_print("Between cards", _ctx.stats.hist_gap);
+    for (int i = 0; i < WIEG_MAX_HANDLERS; i++)
+    {
+        const handlers_t *handler = &_ctx.handlers[i];
+        if (handler->cb != NULL && handler->num_calls > 0)
+        {
+            printf("Handler %p: %lu calls, last %lld us, max %lld us, mean %lld us\n", handler->cb,
+                handler->num_calls, handler->time_last, handler->time_max,
+                handler->time_total / handler->num_calls);
+        }
+    }
+    printf("Task stack: %u of %u bytes never used\n", uxTaskGetStackHighWaterMark(_ctx.task), WIEGAND_TASK_STACK);
+    printf("Event task stack: %u of %u bytes never used\n", uxTaskGetStackHighWaterMark(_ctx.evt_task),
+        WIEGAND_EVT_TASK_STACK);
+    return 0;
+}
+
+int _wieg_gap(int argc, char **argv)
+{
+    if (argc == 2)
+    {
+        int gap = atoi(argv[1]);
+        if (gap < 1 || gap > WIEG_GAP_MAX)
+        {
+            printf("Gap must be 1 to %u ms\n", WIEG_GAP_MAX);
+            return 1;
+        }
+        printf("Setting frame gap\n");
+        _ctx.gap_us = (uint32_t) gap * 1000U;
+    }
+    printf("Frame gap: %lu ms\n", _ctx.gap_us / 1000U);
+    return 0;
 }
 
 // IRAM keeps this ISR clear from flash, which lets this ISR fire when flash 
-// reads/writes happen
+// reads/writes happen. Nothing it touches may be in flash either.
 static void IRAM_ATTR gpio_interrupt_handler(void *args)
 {
-    assert(args);
+    // The context tells us whether the bit was triggered from d0 or d1. Bits
+    // are shifted in here, and the task is only woken once a frame ends.
+    int64_t now = esp_timer_get_time();
+    wieg_frame_t *rx = &_ctx.rx;
+    bool start = false;
+
+    portENTER_CRITICAL_ISR(&_ctx.lock);
+    bool wake = wieg_close(&_ctx, now);
+    if (rx->num_bits == 0)
+    {
+        if (_ctx.last_end != 0)
+        {
+            wieg_hist_add(_ctx.stats.hist_gap, now - _ctx.last_end);
+        }
+        rx->bits = 0;
+        rx->start = now;
+        start = true;
+    }
+    else
+    {
+        wieg_hist_add(_ctx.stats.hist_bit, now - rx->end);
+    }
+
+    // Frames over 64 bits are counted but match no format
+    rx->bits = (rx->bits << 1) | (uintptr_t) args;
+    rx->num_bits++;
+    rx->end = now;
+    portEXIT_CRITICAL_ISR(&_ctx.lock);
+
+    if (start)
+    {
+        esp_timer_start_once(_ctx.timer, _ctx.gap_us);
+    }
+    if (wake)
+    {
+        BaseType_t wake_high_prio = pdFALSE;
+        vTaskNotifyGiveFromISR(_ctx.task, &wake_high_prio);
+        portYIELD_FROM_ISR(wake_high_prio);
+    }
+}
+
+// Called with the lock held, from the ISR or the gap timer
+static bool IRAM_ATTR wieg_close(wieg_ctx_t *ctx, int64_t now)
+{
+    wieg_frame_t *rx = &ctx->rx;
+    if (rx->num_bits == 0 || now - rx->end < ctx->gap_us)
+    {
+        return false;
+    }
+
+    wieg_push(ctx, rx);
+    ctx->last_end = rx->end;
+    rx->num_bits = 0;
+    return true;
+}
+
+// Called with the lock held
+static void IRAM_ATTR wieg_push(wieg_ctx_t *ctx, const wieg_frame_t *frame)
+{
+    // If the task is that far behind, the frame is dropped
+    unsigned int head = atomic_load_explicit(&ctx->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ctx->tail, memory_order_acquire) < WIEG_FRAMES)
+    {
+        ctx->frames[head % WIEG_FRAMES] = *frame;
+        atomic_store_explicit(&ctx->head, head + 1, memory_order_release);
+    }
+    else
+    {
+        ctx->stats.num_overrun++;
+    }
+}
 
-    // The context tells us whether the bit was triggered from d0 or d1, and 
-    // this which bit to add. Since the bit is encpded in args, pass it through 
-    // the queue to the parsing task.
-    BaseType_t wake_high_prio = pdFALSE;
-    xQueueSendFromISR(_ctx.pin_q, args, &wake_high_prio);
+static void IRAM_ATTR wieg_hist_add(uint32_t *hist, int64_t us)
+{
+    // Clamped to 32 bits, clz is an instruction there but a libgcc call, in
+    // flash, for 64
+    uint32_t t = us < 1 ? 1U : (us > UINT32_MAX ? UINT32_MAX : (uint32_t) us);
+    uint32_t bucket = 31U - (uint32_t) __builtin_clz(t);
+    hist[bucket < WIEG_HIST_BUCKETS ? bucket : WIEG_HIST_BUCKETS - 1U]++;
 }
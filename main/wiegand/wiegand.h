@@ -12,16 +12,42 @@ typedef enum {
 } wieg_evt_t;
 
 typedef enum {
-    WIEG_24_BIT,        // 8 bit facility + 16 bit user id     
-    WIEG_32_BIT,        // 16 bit facility + 16 bit user id
+    WIEG_24_BIT,        // 8 bit facility + 16 bit user id, 26-bit H10301
+    WIEG_32_BIT,        // 16 bit facility + 16 bit user id, 34-bit
+    WIEG_CORP1000,      // 12 bit company id + 20 bit card number, 35-bit HID Corporate 1000
+    WIEG_H10304,        // 16 bit facility + 19 bit card number, 37-bit H10304
+    WIEG_NUM_ENCODINGS,
 } wieg_encoding_t;
 
-typedef union {
-    uint32_t raw;           // Unparsed card data. This is how membermatters reports cards.
-    struct __attribute__((packed)) {
-        uint16_t user_id;
-        uint16_t facility;  // If 24-bit mode is selected, this value won't exceed 0xFF  
-    };
+// How the d0 and d1 pulses are captured
+typedef enum {
+    WIEG_CAPTURE_GPIO,      // A GPIO interrupt per bit
+    WIEG_CAPTURE_RMT,       // RMT RX channels record the pulses, an interrupt per burst of bits. Also takes a PCNT unit.
+} wieg_capture_t;
+
+// Set of encodings to detect
+#define WIEG_ENCODING(encode)   (1U << (encode))
+#define WIEG_ENCODINGS_ALL      (WIEG_ENCODING(WIEG_NUM_ENCODINGS) - 1U)
+
+// How a card number was read. Readers report Wiegand frames or the UID of a
+// contactless card, and the same number can mean different cards in each.
+typedef enum {
+    CARD_FMT_WIEG_26,   // 26-bit Wiegand, 8 bit facility + 16 bit user id
+    CARD_FMT_WIEG_34,   // 34-bit Wiegand, 16 bit facility + 16 bit user id
+    CARD_FMT_WIEG_35,   // 35-bit Wiegand, 12 bit company id + 20 bit card number
+    CARD_FMT_WIEG_37,   // 37-bit Wiegand, 16 bit facility + 19 bit card number
+    CARD_FMT_UID,       // Contactless card UID, 4 or 7 bytes
+} card_format_t;
+
+typedef struct {
+    uint64_t raw;           // Unparsed card data. This is how membermatters reports cards.
+                            // For Wiegand cards it's the facility followed by the
+                            // user id, (facility << 16) | user_id for 26 and 34 bits.
+                            // UIDs are big endian.
+    card_format_t format;
+    uint32_t facility;      // Wiegand only. If 24-bit mode is selected, this value won't exceed 0xFF.
+                            // The company id for Corporate 1000.
+    uint32_t user_id;       // Wiegand only
 } card_t;
 
 // Event handle, necessary for deregistering the event
@@ -37,17 +63,25 @@ typedef void *wieg_evt_handle_t;
 typedef void (*wieg_evt_cb_t)(wieg_evt_t event, card_t *card, void *ctx);
 
 /**
- * @brief Initialize the wiegand reader
+ * @brief Initialize the wiegand reader. Each frame is decoded with the first
+ * of the encodings that has its length and parity, so readers sending
+ * different formats can share a device.
  * @param d0 GPIO number (not physical pin number) of the d0 signal. This pin does not have to be configured.
  * @param d1 GPIO number (not physical pin number) of the d1 signal. This pin does not have to be configured.
- * @param encode card encoding to parse
- * @return -STATUS_UNIMPL: Implemented config was selected
+ * @param encodings card encodings to parse, WIEG_ENCODING() bits
+ * @param capture how the pulses are captured
+ * @return -STATUS_INVAL: No or unknown encodings, or unknown capture
+ *         -STATUS_NOMEM: Couldn't create the frame gap timer, event queue or event task
+ *         -STATUS_NO_RESOURCE: No RMT RX channels free
+ *         -STATUS_IO: Couldn't start the RMT channels
  *          STATUS_OK: Successful
  */
-status_t wieg_init(int d0, int d1, wieg_encoding_t encode);
+status_t wieg_init(int d0, int d1, uint32_t encodings, wieg_capture_t capture);
 
 /**
- * @brief Register an event handler for one of the wiegand events
+ * @brief Register an event handler for one of the wiegand events. Handlers
+ * run on the reader's event task, so a slow one delays the handlers after it
+ * but not reading cards. The card passed is only valid during the call.
  * @param event cb called for all occurrences of the event specified here
  * @param cb 
  * @param ctx context to pass to the callback
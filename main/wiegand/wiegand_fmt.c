@@ -1,27 +1,99 @@
 #include "wiegand_fmt.h"
 
-// 24-bit format descriptor
-const wieg_fmt_desc_t wieg_fmt_24bit = {
-    .high_mask       = WIEG_24BIT_HIGH_MASK,
-    .low_mask        = WIEG_24BIT_LOW_MASK,
-    .fac_mask        = WIEG_24BIT_FAC_MASK,
-    .uid_mask        = WIEG_24BIT_UID_MASK,
-    .total_bits      = WIEG_24BIT_TOTAL_BITS,
-    .fac_offset      = WIEG_24BIT_FAC_OFFSET,
-    .uid_offset      = WIEG_24BIT_UID_OFFSET,
-    .high_parity_idx = WIEG_24BIT_HIGH_PARITY_IDX,
-    .low_parity_idx  = WIEG_24BIT_LOW_PARITY_IDX,
+#include <assert.h>
+
+const wieg_fmt_desc_t wieg_fmts[WIEG_NUM_ENCODINGS] = {
+    // H10301: P | 8 bit facility | 16 bit user id | P
+    [WIEG_24_BIT] = {
+        .name       = "26-bit H10301",
+        .total_bits = 26,
+        .fac_mask   = 0x1FE0000,
+        .uid_mask   = 0x001FFFE,
+        .fac_offset = 17,
+        .uid_offset = 1,
+        .num_parity = 2,
+        .parity     = {
+            { .mask = 0x1FFE000, .idx = 25, .odd = false },
+            { .mask = 0x0001FFE, .idx = 0,  .odd = true },
+        },
+        .format     = CARD_FMT_WIEG_26,
+    },
+
+    // P | 16 bit facility | 16 bit user id | P
+    [WIEG_32_BIT] = {
+        .name       = "34-bit",
+        .total_bits = 34,
+        .fac_mask   = 0x1FFFE0000ULL,
+        .uid_mask   = 0x00001FFFEULL,
+        .fac_offset = 17,
+        .uid_offset = 1,
+        .num_parity = 2,
+        .parity     = {
+            { .mask = 0x1FFFE0000ULL, .idx = 33, .odd = false },
+            { .mask = 0x00001FFFEULL, .idx = 0,  .odd = true },
+        },
+        .format     = CARD_FMT_WIEG_34,
+    },
+
+    // HID Corporate 1000: P | P | 12 bit company id | 20 bit card number | P.
+    // The first bit covers the whole frame, the other two alternate pairs
+    // of bits.
+    [WIEG_CORP1000] = {
+        .name       = "35-bit Corporate 1000",
+        .total_bits = 35,
+        .fac_mask   = 0x1FFE00000ULL,
+        .uid_mask   = 0x0001FFFFEULL,
+        .fac_offset = 21,
+        .uid_offset = 1,
+        .num_parity = 3,
+        .parity     = {
+            { .mask = 0x3FFFFFFFFULL, .idx = 34, .odd = true },
+            { .mask = 0x1B6DB6DB6ULL, .idx = 33, .odd = false },
+            { .mask = 0x36DB6DB6CULL, .idx = 0,  .odd = true },
+        },
+        .format     = CARD_FMT_WIEG_35,
+    },
+
+    // H10304: P | 16 bit facility | 19 bit card number | P. The parity
+    // ranges share the middle bit.
+    [WIEG_H10304] = {
+        .name       = "37-bit H10304",
+        .total_bits = 37,
+        .fac_mask   = 0xFFFF00000ULL,
+        .uid_mask   = 0x0000FFFFEULL,
+        .fac_offset = 20,
+        .uid_offset = 1,
+        .num_parity = 2,
+        .parity     = {
+            { .mask = 0xFFFFC0000ULL, .idx = 36, .odd = false },
+            { .mask = 0x00007FFFEULL, .idx = 0,  .odd = true },
+        },
+        .format     = CARD_FMT_WIEG_37,
+    },
 };
 
-// 32-bit format descriptor
-const wieg_fmt_desc_t wieg_fmt_32bit = {
-    .high_mask       = WIEG_32BIT_HIGH_MASK,
-    .low_mask        = WIEG_32BIT_LOW_MASK,
-    .fac_mask        = WIEG_32BIT_FAC_MASK,
-    .uid_mask        = WIEG_32BIT_UID_MASK,
-    .total_bits      = WIEG_32BIT_TOTAL_BITS,
-    .fac_offset      = WIEG_32BIT_FAC_OFFSET,
-    .uid_offset      = WIEG_32BIT_UID_OFFSET,
-    .high_parity_idx = WIEG_32BIT_HIGH_PARITY_IDX,
-    .low_parity_idx  = WIEG_32BIT_LOW_PARITY_IDX,
-};
\ No newline at end of file
+bool wieg_fmt_parity_good(const wieg_fmt_desc_t *fmt, uint64_t bits)
+{
+    assert(fmt);
+
+    for (int i = 0; i < fmt->num_parity; i++)
+    {
+        const wieg_parity_t *parity = &fmt->parity[i];
+        uint64_t covered = bits & (parity->mask | (1ULL << parity->idx));
+        if ((__builtin_popcountll(covered) & 1) != parity->odd)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void wieg_fmt_decode(const wieg_fmt_desc_t *fmt, uint64_t bits, card_t *card)
+{
+    assert(fmt && card);
+
+    card->facility = (uint32_t) ((bits & fmt->fac_mask) >> fmt->fac_offset);
+    card->user_id = (uint32_t) ((bits & fmt->uid_mask) >> fmt->uid_offset);
+    card->raw = ((uint64_t) card->facility << __builtin_popcountll(fmt->uid_mask)) | card->user_id;
+    card->format = fmt->format;
+}
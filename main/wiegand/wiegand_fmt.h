@@ -1,52 +1,53 @@
-#ifndef WIEGANT_FMT_H_
+#ifndef WIEGAND_FMT_H_
 #define WIEGAND_FMT_H_
 
+#include "wiegand.h"
 #include <stdint.h>
+#include <stdbool.h>
 
-// 24-bit wiegand format
-#define WIEG_24BIT_TOTAL_BITS      26U
-#define WIEG_24BIT_HIGH_MASK       0x01FFE000
-#define WIEG_24BIT_LOW_MASK        0x00001FFE
-#define WIEG_24BIT_FAC_MASK        0x01FE0000
-#define WIEG_24BIT_FAC_OFFSET      17U
-#define WIEG_24BIT_UID_MASK        0x0001FFFE
-#define WIEG_24BIT_UID_OFFSET      1U
-#define WIEG_24BIT_HIGH_PARITY_IDX 25U
-#define WIEG_24BIT_LOW_PARITY_IDX  0U
-
-// TODO: 32-bit format is broken. As-is, 32-bit mode requires the use of 
-// uint64_t, which causes stack crashing in the door task. Implementing 32-bit 
-// mode may require a refactor.
-// 32-bit wiegand format
-#define WIEG_32BIT_TOTAL_BITS      34U
-#define WIEG_32BIT_HIGH_MASK       0xFFFE0000 
-#define WIEG_32BIT_LOW_MASK        0x0001FFFE
-#define WIEG_32BIT_FAC_MASK        0xFFFE0000
-#define WIEG_32BIT_FAC_OFFSET      17U
-#define WIEG_32BIT_UID_MASK        0x0001FFFE
-#define WIEG_32BIT_UID_OFFSET      1U
-#define WIEG_32BIT_HIGH_PARITY_IDX 33U
-#define WIEG_32BIT_LOW_PARITY_IDX  0U
-
-// High- and low-parity bit getters
-#define WIEG_HIGH_PARITY_BIT(fmt, x)   ((x >> fmt->high_parity_idx) & 1)
-#define WIEG_LOW_PARITY_BIT(fmt, x)    ((x >> fmt->low_parity_idx)  & 1)
+// Bits of a frame are numbered from the last one received, bit 0, up to the
+// first one, bit total_bits - 1. Frames are up to 64 bits.
+
+// Most parity bits in a format
+#define WIEG_PARITY_MAX     3U
+
+// A parity bit and the bits it covers
+typedef struct {
+    uint64_t mask;          // Bits covered, not including the parity bit
+    uint8_t idx;            // Bit index of the parity bit
+    bool odd;               // Set bits, counting the parity bit, are odd. Else even.
+} wieg_parity_t;
 
 // Format descriptor
 typedef struct {
-    uint32_t high_mask;     // Bits included in the high parity bit calculation
-    uint32_t low_mask;      // Bits included in the low parity bit calculation
-    uint32_t fac_mask;      // Bits included in facility
-    uint32_t uid_mask;      // Bits included in the user id
+    const char *name;
     int total_bits;         // Total bits in card data (including parity)
+    uint64_t fac_mask;      // Bits included in facility
+    uint64_t uid_mask;      // Bits included in the user id
     int fac_offset;         // Bit offset of facility code
     int uid_offset;         // Bit offset of user id
-    int high_parity_idx;    // Bit index of high parity bit
-    int low_parity_idx;     // Bit index of low parity bit
+    int num_parity;
+    wieg_parity_t parity[WIEG_PARITY_MAX];
+    card_format_t format;   // Reported with the cards
 } wieg_fmt_desc_t;
 
-// 26 and 34 bit formats
-extern const wieg_fmt_desc_t wieg_fmt_24bit;
-extern const wieg_fmt_desc_t wieg_fmt_32bit;
+// Formats, indexed by encoding
+extern const wieg_fmt_desc_t wieg_fmts[WIEG_NUM_ENCODINGS];
+
+/**
+ * @brief Check the parity bits of a frame
+ * @param fmt format of the frame
+ * @param bits frame, first bit received most significant
+ * @return true if every parity bit is right
+ */
+bool wieg_fmt_parity_good(const wieg_fmt_desc_t *fmt, uint64_t bits);
+
+/**
+ * @brief Split a frame into its facility and user id
+ * @param fmt format of the frame
+ * @param bits frame, first bit received most significant
+ * @param card filled in with the card
+ */
+void wieg_fmt_decode(const wieg_fmt_desc_t *fmt, uint64_t bits, card_t *card);
 
-#endif /*WIEGAND_FMT_H_*/
\ No newline at end of file
+#endif /*WIEGAND_FMT_H_*/
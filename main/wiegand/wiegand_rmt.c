@@ -0,0 +1,86 @@
+#include "wiegand_rmt.h"
+
+#include <assert.h>
+
+// Bits are 20-100 us pulses. The channel's own filter only goes up to a few
+// us, so anything far outside that is dropped here.
+#define WIEG_RMT_PULSE_MIN      10U //us
+#define WIEG_RMT_PULSE_MAX      500U //us
+
+void wieg_rmt_line_add(wieg_rmt_line_t *line, const uint32_t *syms, size_t num_syms,
+    int64_t end, uint32_t resolution_hz)
+{
+    assert(line);
+    assert(syms || num_syms == 0);
+    assert(resolution_hz);
+
+    // Pulse starts are kept in ticks from the first edge until the last
+    // rising edge is known, then moved back from end
+    uint32_t first = line->num;
+    uint64_t t = 0;
+    uint64_t last = 0;
+
+    // Each symbol is two levels with their durations
+    for (size_t i = 0; i < num_syms * 2; i++)
+    {
+        uint32_t sym = syms[i / 2];
+        uint32_t dur = (i & 1) ? WIEG_RMT_DURATION1(sym) : WIEG_RMT_DURATION0(sym);
+        uint32_t level = (i & 1) ? WIEG_RMT_LEVEL1(sym) : WIEG_RMT_LEVEL0(sym);
+        if (dur == 0)
+        {
+            break;
+        }
+
+        if (level == 0)
+        {
+            uint64_t width = (uint64_t) dur * 1000000U / resolution_hz;
+            if (width < WIEG_RMT_PULSE_MIN || width > WIEG_RMT_PULSE_MAX)
+            {
+                line->num_filtered++;
+            }
+            else if (line->num < WIEG_RMT_PULSES_MAX)
+            {
+                line->start[line->num++] = (int64_t) t;
+            }
+            else
+            {
+                line->overflow = true;
+            }
+            last = t + dur;
+        }
+        t += dur;
+    }
+
+    for (uint32_t i = first; i < line->num; i++)
+    {
+        line->start[i] = end - (int64_t) ((last - (uint64_t) line->start[i]) * 1000000U / resolution_hz);
+    }
+}
+
+uint32_t wieg_rmt_merge(const wieg_rmt_line_t *d0, const wieg_rmt_line_t *d1, uint64_t *bits,
+    int64_t *times, uint32_t max_times)
+{
+    assert(d0);
+    assert(d1);
+    assert(bits);
+
+    uint32_t i0 = 0;
+    uint32_t i1 = 0;
+    uint32_t num_bits = 0;
+
+    *bits = 0;
+    while (i0 < d0->num || i1 < d1->num)
+    {
+        // Take whichever line pulsed first
+        bool one = i0 == d0->num || (i1 < d1->num && d1->start[i1] < d0->start[i0]);
+        int64_t start = one ? d1->start[i1++] : d0->start[i0++];
+
+        *bits = (*bits << 1) | (one ? 1U : 0U);
+        if (times && num_bits < max_times)
+        {
+            times[num_bits] = start;
+        }
+        num_bits++;
+    }
+    return num_bits;
+}
@@ -0,0 +1,59 @@
+#ifndef WIEGAND_RMT_H_
+#define WIEGAND_RMT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Turns what an RMT RX channel recorded on d0 and d1 back into the bits of a
+// frame. This only uses plain C types, so it builds on the host and can be
+// fed symbol buffers made up there.
+//
+// Each line is captured by its own channel, idle high, and a bit is a low
+// pulse on one of them. A channel stops once its line has been idle for its
+// threshold, so a frame arrives as one or more buffers per line. The order of
+// the bits comes from when the pulses started.
+
+// Most pulses kept per line, as frames are up to 64 bits
+#define WIEG_RMT_PULSES_MAX     64U
+
+// RMT symbol words, as the RX channel stores them: two levels, each with a
+// 15-bit duration in ticks. This is rmt_symbol_word_t's val.
+#define WIEG_RMT_DURATION0(sym)    ((sym) & 0x7FFFU)
+#define WIEG_RMT_LEVEL0(sym)       (((sym) >> 15) & 1U)
+#define WIEG_RMT_DURATION1(sym)    (((sym) >> 16) & 0x7FFFU)
+#define WIEG_RMT_LEVEL1(sym)       (((sym) >> 31) & 1U)
+
+// Pulses seen on one line during a frame
+typedef struct {
+    int64_t start[WIEG_RMT_PULSES_MAX];     // Falling edges, us since boot, in order
+    uint32_t num;
+    uint32_t num_filtered;  // Pulses too short or long to be a bit
+    bool overflow;          // Pulses were dropped, there were too many
+} wieg_rmt_line_t;
+
+/**
+ * @brief Add the pulses of one received buffer to a line
+ * @param line pulses of the line so far
+ * @param syms symbol words as the RX channel stored them. A zero duration ends them.
+ * @param num_syms number of symbols
+ * @param end time of the last rising edge in the buffer, us since boot
+ * @param resolution_hz tick rate of the channel
+ */
+void wieg_rmt_line_add(wieg_rmt_line_t *line, const uint32_t *syms, size_t num_syms,
+    int64_t end, uint32_t resolution_hz);
+
+/**
+ * @brief Put the pulses of both lines in order to make the frame
+ * @param d0 pulses of the d0 line, each a 0 bit
+ * @param d1 pulses of the d1 line, each a 1 bit
+ * @param bits filled in with the frame, first bit received most significant.
+ *        Only the last 64 bits of longer frames are kept.
+ * @param times filled in with the start of each bit, us since boot. Can be NULL.
+ * @param max_times size of times
+ * @return number of bits in the frame
+ */
+uint32_t wieg_rmt_merge(const wieg_rmt_line_t *d0, const wieg_rmt_line_t *d1, uint64_t *bits,
+    int64_t *times, uint32_t max_times);
+
+#endif /*WIEGAND_RMT_H_*/
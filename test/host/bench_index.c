@@ -0,0 +1,118 @@
+// Swipe lookups against the in-RAM index, and against the scan of tags.txt
+// that tags_verify() used to do, at a few list sizes.
+//
+// The scan reads the file from the host's page cache here, so on the device,
+// reading LittleFS on flash, it's slower still.
+
+#include "tag_index.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BENCH_FILE          "bench_index.txt"
+#define BENCH_INDEX_LOOKUPS 1000000U
+
+// Lines read by the scans of each list size, about
+#define BENCH_SCAN_LINES    4000000U
+
+// The old tags_verify(), line by line through the file
+static status_t scan_verify(file_t tag_file, uint32_t card)
+{
+    char card_str[16];
+    status_t status = fs_readline(tag_file, card_str);
+    while (status != -STATUS_EOF)
+    {
+        uint32_t db_card = atoi(card_str);
+        if (db_card == card)
+        {
+            fs_rewind(tag_file);
+            return STATUS_OK;
+        }
+        status = fs_readline(tag_file, card_str);
+    }
+
+    fs_rewind(tag_file);
+    return -STATUS_INVALID;
+}
+
+static void bench(size_t count)
+{
+    uint32_t seed = 0x1234567U + count;
+    uint32_t *cards = malloc(count * sizeof(uint32_t));
+    tag_index_t index;
+    assert(cards != NULL);
+    assert(tag_index_init(&index, count) == STATUS_OK);
+
+    // atoi() stops at INT_MAX on the device, keep the cards below it
+    file_t file = fs_open(BENCH_FILE, "w");
+    assert(file != NULL);
+    for (size_t i = 0; i < count; )
+    {
+        uint32_t card = bench_rand(&seed) & 0x7FFFFFFFU;
+        if (tag_index_contains(&index, card))
+        {
+            continue;
+        }
+        char line[16];
+        sprintf(line, "%lu\n", (unsigned long) card);
+        fs_write(file, line, strlen(line));
+        tag_index_add(&index, card);
+        cards[i++] = card;
+    }
+    fs_close(file);
+
+    // Half the swipes are of cards in the list. The rest are almost surely
+    // not, which is the slow case of the scan.
+    uint32_t found = 0;
+    int64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < BENCH_INDEX_LOOKUPS; i++)
+    {
+        uint32_t r = bench_rand(&seed);
+        uint32_t card = (i & 1) ? cards[r % count] : (r & 0x7FFFFFFFU);
+        found += tag_index_contains(&index, card);
+    }
+    double index_ns = (double) (bench_now_ns() - start) / BENCH_INDEX_LOOKUPS;
+    assert(found >= BENCH_INDEX_LOOKUPS / 2);
+
+    uint32_t scans = BENCH_SCAN_LINES / count;
+    if (scans < 20) { scans = 20; }
+    file = fs_open(BENCH_FILE, "r");
+    assert(file != NULL);
+    double scan_ns[2];
+    for (int hit = 0; hit < 2; hit++)
+    {
+        found = 0;
+        start = bench_now_ns();
+        for (uint32_t i = 0; i < scans; i++)
+        {
+            uint32_t r = bench_rand(&seed);
+            uint32_t card = hit ? cards[r % count] : (r & 0x7FFFFFFFU);
+            found += scan_verify(file, card) == STATUS_OK;
+        }
+        scan_ns[hit] = (double) (bench_now_ns() - start) / scans;
+        assert(hit ? found == scans : found < scans);
+    }
+    fs_close(file);
+
+    printf("%6zu cards: index %6.1f ns/lookup, %4zu KB | scan %9.1f us/hit %9.1f us/miss | %7.0fx faster on a miss\n",
+        count, index_ns, index.capacity * sizeof(uint32_t) / 1024, scan_ns[1] / 1000, scan_ns[0] / 1000,
+        scan_ns[0] / index_ns);
+
+    tag_index_free(&index);
+    free(cards);
+    fs_rm(BENCH_FILE);
+}
+
+int main(void)
+{
+    const size_t counts[] = { 1000, 10000, 50000 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        bench(counts[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Build time of the minimal perfect hash over 75k cards, as a sync into the
+// tag image does it, and a check that every card gets its own slot. 75k is
+// about as many as a bank of the image holds in the MPHF layout (see
+// tag_image.h), test_image builds an image that size.
+
+#include "tag_mphf.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BENCH_KEYS      75000U
+#define BENCH_LISTS     5U
+#define BENCH_LOOKUPS   1000000U
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Mixed, sorted and unique, the way the image hands them over
+static size_t make_keys(uint32_t *mixed, size_t n, uint32_t seed)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        mixed[i] = tag_mphf_mix(bench_rand(&seed));
+    }
+    qsort(mixed, n, sizeof(uint32_t), cmp_u32);
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (out == 0 || mixed[i] != mixed[out - 1]) { mixed[out++] = mixed[i]; }
+    }
+    return out;
+}
+
+int main(void)
+{
+    uint32_t *mixed = malloc(BENCH_KEYS * sizeof(uint32_t));
+    uint8_t *seen = malloc(BENCH_KEYS);
+    assert(mixed != NULL && seen != NULL);
+
+    double total_ms = 0;
+    double worst_ms = 0;
+    for (uint32_t list = 0; list < BENCH_LISTS; list++)
+    {
+        size_t n = make_keys(mixed, BENCH_KEYS, 0x9E3779B9U * (list + 1));
+
+        tag_mphf_build_t build;
+        int64_t start = bench_now_ns();
+        status_t status = tag_mphf_build(mixed, n, &build);
+        double ms = (double) (bench_now_ns() - start) / 1e6;
+        assert(status == STATUS_OK);
+        total_ms += ms;
+        if (ms > worst_ms) { worst_ms = ms; }
+
+        // Minimal and perfect: every slot of [0, n) taken exactly once
+        memset(seen, 0, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t slot = tag_mphf_slot(&build.params, build.pilots, build.remap, mixed[i]);
+            assert(slot < n && !seen[slot]);
+            seen[slot] = 1;
+        }
+
+        uint32_t seed = list + 1;
+        volatile uint32_t sink = 0;
+        start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            sink = tag_mphf_slot(&build.params, build.pilots, build.remap, mixed[bench_rand(&seed) % n]);
+        }
+        double lookup_ns = (double) (bench_now_ns() - start) / BENCH_LOOKUPS;
+        (void) sink;
+
+        size_t bytes = build.params.num_buckets * sizeof(uint16_t) +
+            (build.params.table_size - build.params.num_keys) * sizeof(uint32_t);
+        printf("%zu keys: built in %6.1f ms, seed %lu, %5.2f bits/key of pilots and remap, %4.1f ns/lookup\n",
+            n, ms, (unsigned long) build.params.seed, 8.0 * bytes / n, lookup_ns);
+        tag_mphf_build_free(&build);
+    }
+    printf("%u lists of %u keys: %.1f ms average build, %.1f ms worst\n",
+        BENCH_LISTS, BENCH_KEYS, total_ms / BENCH_LISTS, worst_ms);
+
+    free(seen);
+    free(mixed);
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Time to write a 10k-card tags file the way a sync used to, one fputs() per
+// card, and through the block-buffered writer it uses now.
+//
+// The host's file system isn't LittleFS on flash, so the times only compare
+// the two ways of writing. The number of writes the file system sees is what
+// carries over to the device: newlib there gives each FILE a 128-byte buffer,
+// which the old way is given here too.
+
+#include "fs.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BENCH_FILE      "bench_writer.txt"
+#define BENCH_CARDS     10000U
+#define BENCH_RUNS      21U
+#define BENCH_STDIO_BUF 128U
+
+static uint32_t _cards[BENCH_CARDS];
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Before: a line at a time through stdio, then closed
+static size_t write_before(void)
+{
+    static char stdio_buf[BENCH_STDIO_BUF];
+    size_t bytes = 0;
+    file_t file = fs_open(BENCH_FILE, "w");
+    assert(file != NULL);
+    setvbuf((FILE *) file, stdio_buf, _IOFBF, sizeof(stdio_buf));
+
+    char file_line[16];
+    for (uint32_t i = 0; i < BENCH_CARDS; i++)
+    {
+        sprintf(file_line, "%lu\n", (unsigned long) _cards[i]);
+        assert(fs_write(file, file_line, strlen(file_line)) == STATUS_OK);
+        bytes += strlen(file_line);
+    }
+    assert(fs_close(file) == STATUS_OK);
+    return bytes;
+}
+
+// After: through the writer, synced and closed, then read back and checked
+// like tags_sync_commit() does. Times each step.
+static void write_after(int64_t *write_ns, int64_t *close_ns, int64_t *check_ns)
+{
+    int64_t start = bench_now_ns();
+    fs_writer_t writer;
+    assert(fs_writer_open(&writer, BENCH_FILE, "w") == STATUS_OK);
+
+    char file_line[16];
+    for (uint32_t i = 0; i < BENCH_CARDS; i++)
+    {
+        int len = sprintf(file_line, "%lu\n", (unsigned long) _cards[i]);
+        fs_writer_write(&writer, file_line, len);
+    }
+
+    int64_t now = bench_now_ns();
+    *write_ns = now - start;
+    start = now;
+
+    uint32_t crc;
+    uint32_t read_crc;
+    assert(fs_writer_close(&writer, &crc) == STATUS_OK);
+    now = bench_now_ns();
+    *close_ns = now - start;
+    start = now;
+
+    assert(fs_crc(BENCH_FILE, &read_crc) == STATUS_OK);
+    assert(read_crc == crc);
+    *check_ns = bench_now_ns() - start;
+}
+
+static double median_ms(int64_t *times)
+{
+    qsort(times, BENCH_RUNS, sizeof(int64_t), cmp_i64);
+    return times[BENCH_RUNS / 2] / 1e6;
+}
+
+int main(void)
+{
+    uint32_t seed = 0xC0FFEEU;
+    for (uint32_t i = 0; i < BENCH_CARDS; i++)
+    {
+        _cards[i] = bench_rand(&seed);
+    }
+
+    int64_t before[BENCH_RUNS];
+    int64_t after[BENCH_RUNS];
+    int64_t after_write[BENCH_RUNS];
+    int64_t after_close[BENCH_RUNS];
+    int64_t after_check[BENCH_RUNS];
+    size_t bytes = 0;
+    for (uint32_t run = 0; run < BENCH_RUNS; run++)
+    {
+        int64_t start = bench_now_ns();
+        bytes = write_before();
+        before[run] = bench_now_ns() - start;
+
+        write_after(&after_write[run], &after_close[run], &after_check[run]);
+        after[run] = after_write[run] + after_close[run] + after_check[run];
+    }
+    fs_rm(BENCH_FILE);
+
+    printf("%u cards, %zu bytes, median of %u runs\n", BENCH_CARDS, bytes, BENCH_RUNS);
+    printf("  before: %7.2f ms, %u stdio calls, %zu file system writes, no sync\n",
+        median_ms(before), BENCH_CARDS, (bytes + BENCH_STDIO_BUF - 1) / BENCH_STDIO_BUF);
+    printf("  after:  %7.2f ms, %zu file system writes, synced and read back\n",
+        median_ms(after), (bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+    printf("          %7.2f ms writing, %.2f ms to sync and close, %.2f ms to read back\n",
+        median_ms(after_write), median_ms(after_close), median_ms(after_check));
+    return 0;
+}
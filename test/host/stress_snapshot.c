@@ -0,0 +1,150 @@
+// Swipes and syncs at the same time. Reader threads look cards up the way
+// swipes do, against whichever list is current, while a writer thread keeps
+// building new lists into the spare copy and publishing them, the way the
+// sync task does.
+//
+// Every list holds a known range of cards, so a reader can tell if a copy
+// changed while it held a reference. The writer frees the old tables before
+// it builds the new ones, so reading a copy after it was given up is also
+// caught by the thread sanitizer the Makefile builds this with.
+
+#include "tag_snap.h"
+#include "tag_index.h"
+#include "tag_bloom.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#define STRESS_READERS      4U
+#define STRESS_SECONDS      3U
+#define STRESS_LIST_LEN     2000U
+#define STRESS_BLOOM_BYTES  (64U * 1024U)
+
+// List g holds cards [g * STEP, g * STEP + LEN), so each list shares half of
+// its cards with the one before
+#define STRESS_LIST_STEP    (STRESS_LIST_LEN / 2U)
+
+#define STRESS_GEN_NONE     UINT32_MAX
+
+typedef struct {
+    uint32_t seed;
+    uint64_t swipes;        // Done when the reader stopped
+} stress_reader_t;
+
+typedef struct {
+    uint32_t gen;           // List held, STRESS_GEN_NONE while it's rebuilt
+    tag_index_t index;
+    tag_bloom_t bloom;
+} stress_copy_t;
+
+static tag_snap_t _snap;
+static stress_copy_t _copies[2];
+static atomic_bool _stop;
+static atomic_uint _failures;
+
+static void stress_build(stress_copy_t *copy, uint32_t gen)
+{
+    copy->gen = STRESS_GEN_NONE;
+    tag_index_free(&copy->index);
+    tag_bloom_free(&copy->bloom);
+
+    status_t status = tag_index_init(&copy->index, STRESS_LIST_LEN);
+    assert(status == STATUS_OK);
+    status = tag_bloom_init(&copy->bloom, STRESS_LIST_LEN, STRESS_BLOOM_BYTES);
+    assert(status == STATUS_OK);
+    for (uint32_t i = 0; i < STRESS_LIST_LEN; i++)
+    {
+        tag_index_add(&copy->index, gen * STRESS_LIST_STEP + i);
+        tag_bloom_add(&copy->bloom, gen * STRESS_LIST_STEP + i);
+    }
+    copy->gen = gen;
+}
+
+static bool stress_contains(const stress_copy_t *copy, uint32_t card)
+{
+    return tag_bloom_maybe(&copy->bloom, card) && tag_index_contains(&copy->index, card);
+}
+
+static void *stress_reader(void *arg)
+{
+    stress_reader_t *reader = (stress_reader_t *) arg;
+    uint32_t seed = reader->seed;
+    uint64_t count = 0;
+
+    while (!atomic_load_explicit(&_stop, memory_order_relaxed))
+    {
+        uint32_t i = tag_snap_get(&_snap);
+        const stress_copy_t *copy = &_copies[i];
+        uint32_t gen = copy->gen;
+        uint32_t r = bench_rand(&seed) % STRESS_LIST_LEN;
+
+        // A card of the list, and one of the list after next, which shares
+        // none of its cards
+        bool ok = gen != STRESS_GEN_NONE &&
+            stress_contains(copy, gen * STRESS_LIST_STEP + r) &&
+            !stress_contains(copy, (gen + 2) * STRESS_LIST_STEP + STRESS_LIST_STEP + r) &&
+            copy->gen == gen;
+        tag_snap_put(&_snap, i);
+
+        if (!ok) { atomic_fetch_add(&_failures, 1); }
+        count++;
+    }
+    reader->swipes = count;
+    return NULL;
+}
+
+static void stress_wait(void)
+{
+    sched_yield();
+}
+
+int main(void)
+{
+    tag_snap_init(&_snap);
+    stress_build(&_copies[tag_snap_current(&_snap)], 0);
+
+    pthread_t threads[STRESS_READERS];
+    stress_reader_t readers[STRESS_READERS];
+    for (uint32_t i = 0; i < STRESS_READERS; i++)
+    {
+        readers[i].seed = 0x2545F491U * (i + 1);
+        pthread_create(&threads[i], NULL, stress_reader, &readers[i]);
+    }
+
+    // Syncs back to back, as fast as lists can be built
+    uint32_t gen = 0;
+    int64_t end = bench_now_ns() + STRESS_SECONDS * 1000000000LL;
+    int64_t worst_wait = 0;
+    while (bench_now_ns() < end)
+    {
+        stress_build(&_copies[tag_snap_spare(&_snap)], ++gen);
+        int64_t start = bench_now_ns();
+        tag_snap_publish(&_snap, stress_wait);
+        int64_t waited = bench_now_ns() - start;
+        if (waited > worst_wait) { worst_wait = waited; }
+    }
+    atomic_store(&_stop, true);
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < STRESS_READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        total += readers[i].swipes;
+    }
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        tag_index_free(&_copies[i].index);
+        tag_bloom_free(&_copies[i].bloom);
+    }
+
+    unsigned failures = atomic_load(&_failures);
+    printf("%u readers, %u s: %llu swipes, %lu syncs of %u cards, longest drain %.1f us, %u bad lookups\n",
+        STRESS_READERS, STRESS_SECONDS, (unsigned long long) total, (unsigned long) gen, STRESS_LIST_LEN,
+        worst_wait / 1000.0, failures);
+    return failures == 0 ? 0 : 1;
+}
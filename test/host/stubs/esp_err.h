@@ -0,0 +1,13 @@
+#ifndef ESP_ERR_H_
+#define ESP_ERR_H_
+
+// Host stand-in: the error codes the modules check for
+typedef int esp_err_t;
+#define ESP_OK              0
+#define ESP_FAIL            -1
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_NOT_FOUND   0x105
+
+static inline const char *esp_err_to_name(esp_err_t err) { return err == ESP_OK ? "ESP_OK" : "ESP_FAIL"; }
+
+#endif /*ESP_ERR_H_*/
@@ -0,0 +1,21 @@
+#ifndef ESP_LITTLEFS_H_
+#define ESP_LITTLEFS_H_
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Host stand-in: there's nothing to mount, files go to FS_BASE_PATH on the
+// host's file system
+typedef struct {
+    const char *base_path;
+    const char *partition_label;
+    bool format_if_mount_failed;
+    bool dont_mount;
+} esp_vfs_littlefs_conf_t;
+
+static inline esp_err_t esp_vfs_littlefs_register(const esp_vfs_littlefs_conf_t *conf) { return ESP_OK; }
+static inline esp_err_t esp_littlefs_info(const char *label, size_t *total, size_t *used) { return ESP_OK; }
+static inline esp_err_t esp_littlefs_format(const char *label) { return ESP_OK; }
+
+#endif /*ESP_LITTLEFS_H_*/
@@ -0,0 +1,150 @@
+// Builds of the tag image in a partition the size of the real one, in every
+// layout. The packed layout has to hold lists that are too long for the
+// sorted array, so it's built with more cards than the sorted one can take.
+
+#include "tag_image.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define TEST_RANDOM     100000U // More than the sorted array's bank can hold
+#define TEST_BATCHES    250000U
+#define TEST_SMALL      50000U
+#define TEST_MPHF       75000U  // As many as bench_mphf builds
+#define TEST_PROBES     200000U
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Sorted and unique, to check the image against
+static size_t make_ref(const uint32_t *cards, size_t n, uint32_t *ref)
+{
+    memcpy(ref, cards, n * sizeof(uint32_t));
+    qsort(ref, n, sizeof(uint32_t), cmp_u32);
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (out == 0 || ref[i] != ref[out - 1]) { ref[out++] = ref[i]; }
+    }
+    return out;
+}
+
+static status_t build(tag_image_format_t format, const uint32_t *cards, size_t n)
+{
+    uint8_t bank;
+    status_t status = tag_image_begin(format);
+    for (size_t i = 0; i < n && status == STATUS_OK; i++)
+    {
+        status = tag_image_add(cards[i]);
+    }
+    if (status == STATUS_OK) { status = tag_image_commit(&bank); }
+    if (status != STATUS_OK)
+    {
+        tag_image_abort();
+        return status;
+    }
+    return tag_image_switch();
+}
+
+static void count_card(uint32_t card, void *ctx)
+{
+    (*(size_t *) ctx)++;
+}
+
+static void check(const char *name, tag_image_format_t format, const uint32_t *cards, size_t n, uint32_t *ref)
+{
+    size_t unique = make_ref(cards, n, ref);
+    int64_t start = bench_now_ns();
+    status_t status = build(format, cards, n);
+    double ms = (double) (bench_now_ns() - start) / 1e6;
+    if (status != STATUS_OK)
+    {
+        printf("%s: build of %zu cards failed (%d)\n", name, unique, status);
+        exit(1);
+    }
+
+    tag_image_view_t view;
+    tag_image_view(&view);
+    assert(view.format == format && tag_image_count() == unique);
+    for (size_t i = 0; i < unique; i++)
+    {
+        assert(tag_image_contains(&view, ref[i]));
+    }
+
+    // Cards that aren't stored, near stored ones and anywhere
+    uint32_t seed = 7;
+    for (uint32_t i = 0; i < TEST_PROBES; i++)
+    {
+        uint32_t card = i & 1 ? bench_rand(&seed) : ref[bench_rand(&seed) % unique] + 1;
+        bool present = bsearch(&card, ref, unique, sizeof(uint32_t), cmp_u32) != NULL;
+        assert(tag_image_contains(&view, card) == present);
+    }
+
+    size_t walked = 0;
+    tag_image_foreach(&view, count_card, &walked);
+    assert(walked == unique);
+    printf("%s: %zu cards built in %.1f ms\n", name, unique, ms);
+}
+
+int main(void)
+{
+    uint32_t *cards = malloc(TEST_BATCHES * sizeof(uint32_t));
+    uint32_t *ref = malloc(TEST_BATCHES * sizeof(uint32_t));
+    assert(cards != NULL && ref != NULL);
+
+    uint8_t bank = 0;
+    status_t status = tag_image_init(&bank);
+    assert(status == STATUS_OK || status == -STATUS_NOFILE);
+
+    // Anywhere in 32 bits, with some cards twice
+    uint32_t seed = 1;
+    for (size_t i = 0; i < TEST_RANDOM; i++)
+    {
+        cards[i] = i % 100 == 99 ? cards[i / 2] : bench_rand(&seed);
+    }
+    check("sorted, small", TAG_IMAGE_SORTED, cards, TEST_SMALL, ref);
+    check("mphf, small", TAG_IMAGE_MPHF, cards, TEST_SMALL, ref);
+    check("mphf, full", TAG_IMAGE_MPHF, cards, TEST_MPHF, ref);
+    check("packed, small", TAG_IMAGE_PACKED, cards, TEST_SMALL, ref);
+
+    // Too long for the sorted array, and the image that was there is kept
+    status = build(TAG_IMAGE_SORTED, cards, TEST_RANDOM);
+    assert(status == -STATUS_NOMEM);
+    assert(tag_image_format() == TAG_IMAGE_PACKED && tag_image_count() > 0);
+    printf("sorted: %zu cards don't fit\n", make_ref(cards, TEST_RANDOM, ref));
+    check("packed, random", TAG_IMAGE_PACKED, cards, TEST_RANDOM, ref);
+
+    // Cards handed out in batches: runs of numbers under a few facility
+    // codes, added out of order
+    seed = 2;
+    size_t n = 0;
+    while (n < TEST_BATCHES)
+    {
+        uint32_t next = (bench_rand(&seed) % 256) << 16 | (bench_rand(&seed) % 0x10000);
+        uint32_t len = 100 + bench_rand(&seed) % 1000;
+        for (uint32_t i = 0; i < len && n < TEST_BATCHES; i++)
+        {
+            cards[n++] = next;
+            next += 1 + (bench_rand(&seed) % 4 == 0);
+        }
+    }
+    for (size_t i = n - 1; i > 0; i--)
+    {
+        size_t j = bench_rand(&seed) % (i + 1);
+        uint32_t card = cards[i];
+        cards[i] = cards[j];
+        cards[j] = card;
+    }
+    check("packed, batches", TAG_IMAGE_PACKED, cards, TEST_BATCHES, ref);
+
+    free(ref);
+    free(cards);
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Frames of every format, made up from the published layouts rather than
+// from the masks in wiegand_fmt.c: 10k random cards per format have to decode
+// to their facility and user id, and flipping any one bit of them has to fail
+// the parity check.
+
+#include "wiegand_fmt.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+#define TEST_CARDS      10000U
+
+// A layout, with bits numbered by position as the format documents do: 1 is
+// the first bit received
+typedef struct {
+    wieg_encoding_t encoding;
+    card_format_t format;
+    int total_bits;
+    int fac_first, fac_bits;
+    int uid_first, uid_bits;
+} test_layout_t;
+
+static const test_layout_t layouts[] = {
+    { WIEG_24_BIT,   CARD_FMT_WIEG_26, 26, 2, 8,  10, 16 },
+    { WIEG_32_BIT,   CARD_FMT_WIEG_34, 34, 2, 16, 18, 16 },
+    { WIEG_CORP1000, CARD_FMT_WIEG_35, 35, 3, 12, 15, 20 },
+    { WIEG_H10304,   CARD_FMT_WIEG_37, 37, 2, 16, 18, 19 },
+};
+
+static int get(uint64_t frame, int total, int pos)
+{
+    return (frame >> (total - pos)) & 1;
+}
+
+static uint64_t put(uint64_t frame, int total, int pos, int value)
+{
+    return frame | (uint64_t) value << (total - pos);
+}
+
+// Parity over positions first..last, skipping those where (pos % 3) == skip.
+// skip -1 skips none.
+static int parity(uint64_t frame, int total, int first, int last, int skip)
+{
+    int ones = 0;
+    for (int pos = first; pos <= last; pos++)
+    {
+        if (pos % 3 != skip) { ones += get(frame, total, pos); }
+    }
+    return ones & 1;
+}
+
+static uint64_t encode(const test_layout_t *layout, uint32_t fac, uint32_t uid)
+{
+    int n = layout->total_bits;
+    uint64_t frame = 0;
+    for (int i = 0; i < layout->fac_bits; i++)
+    {
+        frame = put(frame, n, layout->fac_first + i, (fac >> (layout->fac_bits - 1 - i)) & 1);
+    }
+    for (int i = 0; i < layout->uid_bits; i++)
+    {
+        frame = put(frame, n, layout->uid_first + i, (uid >> (layout->uid_bits - 1 - i)) & 1);
+    }
+
+    if (layout->encoding == WIEG_CORP1000)
+    {
+        // Bit 2 is even parity over 3-4, 6-7 ... 33-34, bit 35 is odd parity
+        // over 2-3, 5-6 ... 32-33, then bit 1 is odd parity over 2-35
+        frame = put(frame, n, 2, parity(frame, n, 3, 34, 2));
+        frame = put(frame, n, 35, !parity(frame, n, 2, 33, 1));
+        return put(frame, n, 1, !parity(frame, n, 2, 35, -1));
+    }
+
+    // Even parity over the first half, odd over the second. For 37 bits the
+    // halves share bit 19.
+    int half = n == 37 ? 19 : n / 2;
+    frame = put(frame, n, 1, parity(frame, n, 2, half, -1));
+    return put(frame, n, n, !parity(frame, n, n == 37 ? 19 : half + 1, n - 1, -1));
+}
+
+int main(void)
+{
+    uint32_t seed = 1;
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+    {
+        const test_layout_t *layout = &layouts[l];
+        const wieg_fmt_desc_t *fmt = &wieg_fmts[layout->encoding];
+        assert(fmt->total_bits == layout->total_bits);
+
+        for (uint32_t i = 0; i < TEST_CARDS; i++)
+        {
+            uint32_t fac = bench_rand(&seed) & ((1U << layout->fac_bits) - 1);
+            uint32_t uid = bench_rand(&seed) & ((1U << layout->uid_bits) - 1);
+            uint64_t frame = encode(layout, fac, uid);
+
+            card_t card;
+            bool good = wieg_fmt_parity_good(fmt, frame);
+            wieg_fmt_decode(fmt, frame, &card);
+            if (!good || card.facility != fac || card.user_id != uid ||
+                card.raw != ((uint64_t) fac << layout->uid_bits | uid) || card.format != layout->format)
+            {
+                printf("%s: facility %lu user %lu, frame %llx: parity %s, decoded as facility %lu user %lu\n",
+                    fmt->name, (unsigned long) fac, (unsigned long) uid, (unsigned long long) frame,
+                    good ? "good" : "bad", (unsigned long) card.facility, (unsigned long) card.user_id);
+                return 1;
+            }
+
+            for (int bit = 0; bit < layout->total_bits; bit++)
+            {
+                if (wieg_fmt_parity_good(fmt, frame ^ (1ULL << bit)))
+                {
+                    printf("%s: frame %llx passes parity with bit %d flipped\n", fmt->name,
+                        (unsigned long long) frame, layout->total_bits - bit);
+                    return 1;
+                }
+            }
+        }
+        printf("%s: %u cards decoded, every single bit error caught\n", fmt->name, TEST_CARDS);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+// Decodes 20,000 made-up frames the way the RMT capture receives them: each
+// line in its own buffers, split wherever the line idles for the gap, with
+// short glitches in some of them and the end of each buffer stamped a little
+// off, as the RX done callback does.
+
+#include "wiegand_rmt.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define TEST_FRAMES     20000U
+#define TEST_GAP        5000U   // us, the channels' idle threshold
+#define TEST_JITTER     30U     // us, either way, on the end of each buffer
+#define TEST_GLITCH     2U      // us, shorter than any bit
+#define TEST_SYMS       (2 * WIEG_RMT_PULSES_MAX)
+
+// One buffer of symbol words, as a channel hands it over
+typedef struct {
+    uint32_t syms[TEST_SYMS];
+    size_t len;
+    int64_t end;
+} test_buf_t;
+
+static uint32_t sym(uint32_t dur0, uint32_t level0, uint32_t dur1, uint32_t level1)
+{
+    return dur0 | level0 << 15 | dur1 << 16 | level1 << 31;
+}
+
+// Receive a line whose pulses start at starts[]. Returns the glitches added.
+static uint32_t receive(wieg_rmt_line_t *line, const int64_t *starts, uint32_t n, uint32_t width,
+    bool glitch, uint32_t *seed)
+{
+    uint32_t glitches = 0;
+    for (uint32_t i = 0; i < n; )
+    {
+        // A buffer ends once the line has been high for the gap. The high
+        // time after its last pulse is what stopped the channel, and isn't
+        // in the buffer.
+        test_buf_t buf = { .len = 0 };
+        uint32_t j = i;
+        while (j + 1 < n && starts[j + 1] - (starts[j] + width) < TEST_GAP)
+        {
+            j++;
+        }
+        for (uint32_t p = i; p <= j; p++)
+        {
+            uint32_t high = p < j ? (uint32_t) (starts[p + 1] - starts[p] - width) : 0;
+            if (glitch && high > 0 && bench_rand(seed) % 3 == 0)
+            {
+                // Split the high time around a glitch
+                buf.syms[buf.len++] = sym(width, 0, high / 2, 1);
+                buf.syms[buf.len++] = sym(TEST_GLITCH, 0, high - high / 2 - TEST_GLITCH, 1);
+                glitches++;
+            }
+            else
+            {
+                buf.syms[buf.len++] = sym(width, 0, high, 1);
+            }
+        }
+        buf.end = starts[j] + width + (int64_t) (bench_rand(seed) % (2 * TEST_JITTER + 1)) - TEST_JITTER;
+        wieg_rmt_line_add(line, buf.syms, buf.len, buf.end, 1000000U);
+        i = j + 1;
+    }
+    return glitches;
+}
+
+int main(void)
+{
+    uint32_t seed = 1;
+    uint32_t split = 0;
+    uint32_t glitches = 0;
+    for (uint32_t frame = 0; frame < TEST_FRAMES; frame++)
+    {
+        // 26-64 bits, 0.5-3 ms apart, 20-100 us pulses
+        uint32_t num_bits = 26 + bench_rand(&seed) % 39;
+        uint32_t interval = 500 + bench_rand(&seed) % 2501;
+        uint32_t width = 20 + bench_rand(&seed) % 81;
+        bool glitch = frame & 1;
+
+        uint64_t bits = 0;
+        int64_t starts[2][WIEG_RMT_PULSES_MAX];
+        uint32_t num[2] = { 0, 0 };
+        int64_t t = 1000000 + bench_rand(&seed) % 1000000;
+        for (uint32_t b = 0; b < num_bits; b++)
+        {
+            uint32_t v = bench_rand(&seed) & 1;
+            bits = bits << 1 | v;
+            starts[v][num[v]++] = t;
+            t += interval;
+        }
+
+        wieg_rmt_line_t lines[2];
+        memset(lines, 0, sizeof(lines));
+        uint32_t added = 0;
+        for (int i = 0; i < 2; i++)
+        {
+            added += receive(&lines[i], starts[i], num[i], width, glitch, &seed);
+            for (uint32_t p = 1; p < num[i]; p++)
+            {
+                split += starts[i][p] - (starts[i][p - 1] + width) >= TEST_GAP;
+            }
+        }
+        glitches += added;
+
+        int64_t times[WIEG_RMT_PULSES_MAX];
+        uint64_t got;
+        uint32_t n = wieg_rmt_merge(&lines[0], &lines[1], &got, times, WIEG_RMT_PULSES_MAX);
+        if (n != num_bits || got != bits || lines[0].num_filtered + lines[1].num_filtered != added)
+        {
+            printf("Frame %u: %u bits %llx, decoded %u bits %llx\n", frame, num_bits,
+                (unsigned long long) bits, n, (unsigned long long) got);
+            return 1;
+        }
+    }
+    printf("%u frames decoded, %u buffer splits and %u glitches\n", TEST_FRAMES, split, glitches);
+    return 0;
+}